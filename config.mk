@@ -1,3 +1,9 @@
 # CFLAGS=-std=c99 -Wall -Wextra -pedantic 
 CFLAGS=-std=c99 -pedantic 
+LIBS=-lm -lpthread
 PREFIX=/usr/local
+# make bench replays BENCH_TRACE (recorded with nim -w) against every BENCH_CORPUS file
+BENCH_TRACE=bench/edit.trace
+BENCH_CORPUS=main.c README.md
+# make microbench runs the microbenchmarks whose name contains MICROBENCH, all of them when empty
+MICROBENCH=
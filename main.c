@@ -8,14 +8,31 @@
 #include <errno.h>
 #include <time.h>
 #include <math.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <regex.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 // }}}
 // Defines {{{
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -32,11 +49,43 @@ enum EditorKey {
   WORD_NEXT = 'w',
   WORD_END = 'e',
   WORD_BACK = 'b',
+  BIGWORD_END = 'E',
   BOTTOM = 'G',
   ESC = 27,
   BACKSPACE = 127,
   ENTER = 13,
   TOP = 1000,
+  // keys decoded from terminal escape sequences
+  KEY_ARROW_LEFT,
+  KEY_ARROW_RIGHT,
+  KEY_ARROW_UP,
+  KEY_ARROW_DOWN,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_PAGE_UP,
+  KEY_PAGE_DOWN,
+  // normal mode commands of more than one key
+  WORD_END_BACK,
+  DELETE_LINE,
+  YANK_LINE,
+  FOLD_OPEN,
+  FOLD_CLOSE,
+  FOLD_TOGGLE,
+  FOLD_OPEN_ALL,
+  FOLD_CLOSE_ALL,
+  WINDOW_SPLIT,
+  WINDOW_VSPLIT,
+  WINDOW_NEXT,
+  WINDOW_PREVIOUS,
+  WINDOW_LEFT,
+  WINDOW_DOWN,
+  WINDOW_UP,
+  WINDOW_RIGHT,
+  WINDOW_CLOSE,
+  WINDOW_ONLY,
+  WINDOW_QUIT,
+  KEY_LAST,
 };
 #define CASE_DOWN case KEY_DOWN: case '+'
 #define CASE_UP case KEY_UP: case '-'
@@ -45,88 +94,780 @@ enum Mode {
   MODE_INSERT,
   MODE_REPLACE,
   MODE_COMMAND,
+  MODE_VISUAL,
 };
+// Allocator {{{
+// every allocation goes through nimRealloc/nimFree with the subsystem it
+// belongs to, so it can be counted and so a subsystem can be given another
+// allocator (e.g. the transient arena below)
+enum AllocSubsystem {
+  ALLOC_RENDER,
+  ALLOC_ROWS,
+  ALLOC_OUTPUT,
+  ALLOC_COMMAND,
+  ALLOC_TRANSIENT,
+  ALLOC_OTHER,
+  ALLOC_SUBSYSTEMS,
+};
+const char *allocSubsystemNames[ALLOC_SUBSYSTEMS] = {
+  "render", "rows", "output", "command", "transient", "other",
+};
+struct Allocator {
+  void *(*realloc)(void *context, void *ptr, size_t size);
+  void (*free)(void *context, void *ptr);
+  void *context;
+};
+struct AllocStats {
+  long long allocs, frees, bytes;
+};
+struct Allocators {
+  // a NULL realloc means libc
+  struct Allocator subsystems[ALLOC_SUBSYSTEMS];
+  struct AllocStats stats[ALLOC_SUBSYSTEMS];
+  // reset by every perf frame
+  long long frameAllocs, frameBytes;
+};
+struct Allocators allocators;
+
+// worker threads (e.g. :s) allocate too, so the counters are atomic. the
+// subsystems they use must stay on a thread safe allocator.
+#define ALLOC_COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+void *nimRealloc(enum AllocSubsystem subsystem, void *ptr, size_t size)
+{
+  struct Allocator *allocator = &allocators.subsystems[subsystem];
+  ALLOC_COUNT(allocators.stats[subsystem].allocs, 1);
+  ALLOC_COUNT(allocators.stats[subsystem].bytes, size);
+  ALLOC_COUNT(allocators.frameAllocs, 1);
+  ALLOC_COUNT(allocators.frameBytes, size);
+
+  if (allocator->realloc)
+    return allocator->realloc(allocator->context, ptr, size);
+  return realloc(ptr, size);
+}
+#define nimMalloc(subsystem, size) nimRealloc(subsystem, NULL, size)
+
+void nimFree(enum AllocSubsystem subsystem, void *ptr)
+{
+  if (ptr == NULL)
+    return;
+  struct Allocator *allocator = &allocators.subsystems[subsystem];
+  ALLOC_COUNT(allocators.stats[subsystem].frees, 1);
+
+  if (allocator->realloc)
+    allocator->free(allocator->context, ptr);
+  else
+    free(ptr);
+}
+
+char *nimStrndup(enum AllocSubsystem subsystem, const char *s, size_t length)
+{
+  char *output = nimMalloc(subsystem, length+1);
+  if (output == NULL)
+    return NULL;
+  memcpy(output, s, length);
+  output[length] = '\0';
+  return output;
+}
+
+void allocatorSet(enum AllocSubsystem subsystem, struct Allocator allocator)
+{
+  allocators.subsystems[subsystem] = allocator;
+}
+// }}}
+// Arena {{{
+// bump allocator for things that only live until the key is handled.
+// blocks carry their size so realloc can copy, and the newest block grows
+// in place. whatever doesn't fit goes to libc.
+#define ARENA_SIZE (64 * 1024)
+struct Arena {
+  char buffer[ARENA_SIZE];
+  size_t used, last;
+};
+struct Arena transientArena;
+
+int arenaOwns(struct Arena *arena, void *ptr)
+{
+  return (char *)ptr >= arena->buffer && (char *)ptr < arena->buffer + ARENA_SIZE;
+}
+
+#define ARENA_HEADER sizeof(size_t)
+#define ARENA_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+void *arenaRealloc(void *context, void *ptr, size_t size)
+{
+  struct Arena *arena = context;
+  if (ptr && !arenaOwns(arena, ptr))
+    return realloc(ptr, size);
+
+  size_t oldSize = 0;
+  if (ptr) {
+    size_t *header = (size_t *)((char *)ptr - ARENA_HEADER);
+    oldSize = *header;
+    // the newest block can just grow
+    if ((char *)header == arena->buffer + arena->last
+        && arena->last + ARENA_HEADER + ARENA_ALIGN(size) <= ARENA_SIZE) {
+      *header = size;
+      arena->used = arena->last + ARENA_HEADER + ARENA_ALIGN(size);
+      return ptr;
+    }
+  }
+
+  char *output;
+  if (arena->used + ARENA_HEADER + ARENA_ALIGN(size) <= ARENA_SIZE) {
+    size_t *header = (size_t *)(arena->buffer + arena->used);
+    *header = size;
+    arena->last = arena->used;
+    arena->used += ARENA_HEADER + ARENA_ALIGN(size);
+    output = (char *)header + ARENA_HEADER;
+  } else {
+    output = malloc(size);
+    if (output == NULL)
+      return NULL;
+  }
+
+  if (ptr)
+    memcpy(output, ptr, oldSize < size ? oldSize : size);
+  return output;
+}
+
+void arenaFree(void *context, void *ptr)
+{
+  // arena blocks go away on arenaReset
+  if (!arenaOwns(context, ptr))
+    free(ptr);
+}
+
+void arenaReset(struct Arena *arena)
+{
+  arena->used = 0;
+  arena->last = 0;
+}
+
+struct Allocator arenaAllocator(struct Arena *arena)
+{
+  struct Allocator allocator = {arenaRealloc, arenaFree, arena};
+  return allocator;
+}
+// }}}
 // Append buffer {{{
 struct appendBuffer {
   char *buffer;
-  int length;
+  int length, capacity;
+  enum AllocSubsystem subsystem;
 };
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0, ALLOC_OUTPUT}
+#define ABUF_INIT_FOR(subsystem) {NULL, 0, 0, subsystem}
 
 void abAppend(struct appendBuffer *ab, const char *s, int len) 
 {
-  char *newCharptr = realloc(ab->buffer, ab->length + len);
+  if (ab->length + len > ab->capacity) {
+    int capacity = ab->capacity ? ab->capacity * 2 : 64;
+    while (capacity < ab->length + len)
+      capacity *= 2;
 
-  if (newCharptr == NULL)
-    return;
+    char *newCharptr = nimRealloc(ab->subsystem, ab->buffer, capacity);
+    if (newCharptr == NULL)
+      return;
+    ab->buffer = newCharptr;
+    ab->capacity = capacity;
+  }
 
-  memcpy(&newCharptr[ab->length], s, len);
-  ab->buffer = newCharptr;
+  memcpy(&ab->buffer[ab->length], s, len);
   ab->length += len;
 }
 
 void abFree(struct appendBuffer *ab)
 {
-  free(ab->buffer);
+  nimFree(ab->subsystem, ab->buffer);
 }
 
 void abReinit(struct appendBuffer *ab)
 {
   ab->buffer = NULL;
   ab->length = 0;
+  ab->capacity = 0;
 }
-void abEmpty(struct appendBuffer *ab)
+// keeps the memory around for the next round of appends
+void abClear(struct appendBuffer *ab)
 {
-  ab->buffer = "";
   ab->length = 0;
 }
 // }}}
+// Perf {{{
+enum PerfStage {
+  PERF_INPUT,
+  PERF_EDIT,
+  PERF_SCROLL,
+  PERF_RENDER,
+  PERF_FLUSH,
+  PERF_STAGES,
+};
+#define PERF_FRAMES 32
+#define FRAME_FPS_DEFAULT 60
+#define FRAME_BACKOFF_MAX (250 * 1000000LL)
+struct PerfFrame {
+  long long stages[PERF_STAGES];
+  int bytes;
+  int rowsRendered;
+  long long heapGrowth;
+  long long allocs, allocBytes;
+};
+struct Perf {
+  struct PerfFrame frames[PERF_FRAMES];
+  struct PerfFrame current;
+  long long framescount;
+  long long heap;
+  int overlay;
+  FILE *csv;
+};
+// }}}
 // }}}
 // Data {{{
+// runs of rows far from the viewport get packed into a compressed block.
+// such a row has no buffer, just its place in the block, and is unpacked
+// again when accessed through editorRowAt. reading it doesn't need that,
+// see editorRowText and struct ColdReader.
+struct ColdBlock {
+  int refs;
+  int rawsize, compressedsize;
+  char data[];
+};
+// rows shorter than ROW_INLINE keep their text in the row itself, and a
+// row without tabs is its own render, so most short lines cost no
+// allocation at all and a row fits in a cache line.
+#define ROW_INLINE 24
 typedef struct EditorRow {
   int size, rendersize;
-  char *buffer, *renderbuffer;
+  // over ROW_INLINE when the text is in heap, see editorRowBuffer
+  int capacity, rendercapacity;
+  union {
+    char *heap;
+    char local[ROW_INLINE];
+  } store;
+  // NULL when the render is the text itself
+  char *renderbuffer;
+  struct ColdBlock *cold;
+  int coldOffset;
+  // set by editorUpdateRow, rows read from disk start clean. large files
+  // keep the edited rows that leave the window.
+  char edited;
+  // nothing but whitespace, so word motions can skip it without looking
+  char blank;
+  // changed while a macro ran, renderbuffer is out of date until drawn
+  char stale;
 } EditorRow;
+#define editorRowBuffer(row) ((row)->capacity > ROW_INLINE ? (row)->store.heap : (row)->store.local)
+#define editorRowRender(row) ((row)->renderbuffer ? (row)->renderbuffer : editorRowBuffer(row))
+// files over the memory cap only keep a window of rows around the viewport.
+// every LARGEFILE_STRIDE-th line start is indexed so any part of the file can
+// be read back, and edited rows that leave the window are kept aside in edits.
+#define LARGEFILE_STRIDE 1024
+#define LARGEFILE_DEFAULT_CAP (256LL * 1024 * 1024)
+struct LargeFileEdit {
+  int row;
+  EditorRow text;
+};
+struct LargeFile {
+  int fd;
+  off_t size;
+  off_t *index;
+  long indexcount;
+  long indexcapacity;
+  // set while the index is the one mapped from the cache, see Index cache
+  void *map;
+  size_t mapsize;
+  int endsWithNewline;
+  int windowStart, windowCount, windowCapacity;
+  struct LargeFileEdit *edits;
+  int editscount, editscapacity;
+};
+// splits incoming bytes into rows. a line cut by the end of a chunk is
+// kept in pending until the rest of it arrives. each line goes to line,
+// which appends it to the buffer unless the reader is a filter's.
+struct LineReader {
+  struct appendBuffer pending;
+  void (*line)(char *line, size_t length);
+};
+void editorAppendLine(char *line, size_t linelen);
+#define LINE_READER_INIT {ABUF_INIT_FOR(ALLOC_OTHER), editorAppendLine}
+// stdin or a followed file. it is read a batch at a time from the main
+// loop, so the editor stays usable while rows are still arriving.
+#define STREAM_BATCH (256 * 1024)
+#define STREAM_FOLLOW_MS 250
+struct Stream {
+  int fd;
+  int follow;
+  struct LineReader reader;
+};
+// :{range}!cmd and :r !cmd. the range is written to the child straight
+// from the rows, FILTER_IOV pieces a writev, while what it prints is read
+// into rows of its own. they replace the range in one go when it exits.
+#define FILTER_IOV 128
+struct Filter {
+  pid_t pid;
+  int infd, outfd;
+  // the rows that go in, and how far into them the child has read. :r
+  // has none and leaves the cursor on the last row read instead.
+  int top, end, read;
+  int writerow, writeoffset;
+  struct LineReader reader;
+  EditorRow *rows;
+  int rowscount, rowscapacity;
+};
+// -b and :set binary show the file as a hex dump. it is mapped private,
+// so a byte edit dirties just its page, and :w writes back those pages.
+// lines are formatted as they are drawn, with no rows behind them.
+#define HEX_BYTES 16
+struct Hex {
+  int fd;
+  unsigned char *map;
+  off_t size;
+  int lines, offsetwidth;
+  long pagesize;
+  // the cursor is on byte cursory * HEX_BYTES + cursorx, on one of its
+  // digits or in the text column
+  int nibble, text;
+  // pages edited since the last write, in order
+  long *dirty;
+  int dirtycount, dirtycapacity;
+};
+// :set foldmethod=marker folds from a line with an open marker to the line
+// with its close marker, foldmethod=indent folds the runs of lines indented
+// a shiftwidth deeper than the one above. what each row adds to that is kept in lines
+// and scanned again only for rows that change. the folds are rebuilt from
+// lines when one of them did, and the closed ones are kept as ranges of
+// hidden rows, so rows and the lines on screen map both ways by a binary
+// search over the closed folds.
+#define FOLD_SHIFTWIDTH_DEFAULT 8
+// split so this file doesn't fold on them
+#define FOLD_MARKER_OPEN "{{" "{"
+#define FOLD_MARKER_CLOSE "}}" "}"
+enum FoldMethod {
+  FOLD_MANUAL,
+  FOLD_MARKER,
+  FOLD_INDENT,
+};
+struct Fold {
+  // rows start to end, inside the fold at parent (-1 for none)
+  int start, end, parent, level, closed;
+};
+struct FoldHidden {
+  // rows start+1 to end are hidden, and before rows above them
+  int start, end, level, before;
+};
+struct Folds {
+  enum FoldMethod method;
+  int shiftwidth;
+  int *lines;
+  int linescapacity;
+  // rows to scan again, the rows whose lines changed since the build (or
+  // stale when it starts over), and whether the next build closes every
+  // fold like a file just opened
+  int rescanFrom, rescanTo, changedFrom, changedTo, stale, closeAll;
+  struct Fold *folds;
+  int count, capacity;
+  struct FoldHidden *hidden;
+  int hiddencount, hiddencapacity, hiddenRows;
+  // bumped when the lines on screen may have moved
+  int generation;
+};
+// Ctrl-N and Ctrl-P complete from the words of the buffer, kept with how
+// often they occur in a trie (for the words with a prefix) and a hash of
+// its nodes (for a word as a whole). longer words aren't kept.
+#define WORDS_MAX_LENGTH 64
+#define WORDS_RECOUNT_ROWS 10000
+// rows counted at a time while waiting for keys
+#define WORDS_IDLE_ROWS 5000
+struct WordNode {
+  // -1 for none. children are in order of c, and a free node is on the
+  // free list through next
+  int parent, child, next;
+  // occurrences of the word ending here, and of it and the words below
+  int count, below;
+  unsigned int hash;
+  char c;
+};
+struct Words {
+  // started when a file is opened. until then the edits don't look at it.
+  int built;
+  struct WordNode *nodes;
+  int nodescount, nodescapacity, freeNode;
+  // open addressing over the nodes with a count, -1 when empty
+  int *table;
+  int tablecapacity, tablecount;
+  // rows from counted on aren't counted yet, they are a little at a time
+  // while no keys come. of the rows before it, those that changed and
+  // whose words aren't counted again yet are pending.
+  int counted;
+  int pendingFrom, pendingTo;
+};
+struct CompletionMatch {
+  int offset, length, count, order;
+};
+// the words the last Ctrl-N or Ctrl-P found, after the text that was
+// typed. match current is in the row from start on.
+struct Completion {
+  int active, row, start, current;
+  struct Window *window;
+  struct appendBuffer text;
+  struct CompletionMatch *matches;
+  int count, capacity;
+};
+// where Ctrl-] and :tag jumped from, for Ctrl-T to go back to
+#define TAG_STACK_MAX 20
+struct TagEntry {
+  char *name;
+  char *filename;
+  int cursorx, cursory;
+};
+struct TagStack {
+  struct TagEntry entries[TAG_STACK_MAX];
+  int count;
+};
+// :split and :vsplit show the buffer in more than one window. each has
+// its own cursor and view of the rows, and remembers what it showed when
+// last drawn, so an edit redraws only the rows of it that changed.
+struct Window {
+  int cursorx, cursory;
+  // the column j and k go back to, and whether $ put the cursor at the end
+  int savedcursorx, isEndMode;
+  int renderx;
+  int rowoffset, coloffset;
+  // its cells on the screen, without the status line under it
+  int top, left, rows, cols;
+  // file rows [damageFrom, damageTo) changed since it was drawn
+  int damageAll, damageFrom, damageTo;
+  int drawnRowoffset, drawnColoffset, drawnFolds;
+  struct Frame *frame;
+};
+// the windows tile the screen as a tree. a frame is a window, or frames
+// side by side (vertical) or one above the other sharing its cells evenly.
+struct Frame {
+  struct Window *window;
+  int vertical;
+  struct Frame *parent;
+  struct Frame **children;
+  int count;
+};
+#define KEYMAP_PENDING 16
+// what visual mode selected: rows top to bottom, from startx on the first
+// row to endx on the last, and the render columns left to right of a block
+struct Selection {
+  int top, bottom;
+  int startx, endx;
+  int left, right;
+};
+// keys as the mode handlers get them, for macros and the . command
+#define MACRO_REGISTERS 26
+struct KeyBuffer {
+  int *keys;
+  int count, capacity;
+};
+// text for p and P. the registers point at refcounted yanks, so the
+// unnamed register and the named one share theirs. text that is still in
+// the buffer stays a slice of its rows, copied out only when one of them
+// is about to change (see editorRegistersChange).
+#define REGISTERS 38
+struct Yank {
+  int refs;
+  // 'v', 'V' or Ctrl-V, like the visual mode that would select it
+  int type;
+  // a slice: rows top to bottom, from startx on the first row to endx
+  // (exclusive) on the last, linked from editor.slices
+  int slice, top, bottom, startx, endx;
+  struct Yank *nextSlice;
+  // or rows of its own, which are never drawn
+  EditorRow *rows;
+  int count;
+};
+// the file as nim last read or wrote it, to tell an append from a
+// rewrite when it changes on disk
+#define DISK_TAIL 256
+struct DiskState {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  int tailsize;
+  char tail[DISK_TAIL];
+};
 struct Editor {
-  char sequenceFirst;
   struct appendBuffer numberSequence;
   int numberSequenceInt;
   enum Mode mode;
-  int cursorx, cursory;
+  // the window the cursor is in, and every window in screen order
+  struct Window *window;
+  struct Window **windows;
+  int windowscount, windowscapacity;
+  struct Frame *layout;
   int beforeDeletex, beforeDeletey;
-  int savedcursorx;
-  int renderx;
-  int isEndMode;
-  int deleteFlag, findFlag, backToInsertFlag;
-  int rowoffset, coloffset;
+  // d or y waiting for its motion
+  int operator, backToInsertFlag;
+  // where the keys typed so far are in the keymaps, see Keymap
+  int keyNode;
+  // v, V or Ctrl-V, and the other end of the selection. a block I, A or
+  // c keeps its block until the insert ends, to repeat it on every row.
+  int visualMode, visualx, visualy;
+  // the rows of the last selection, for '< and '> in a range
+  int visualTop, visualBottom;
+  int blockInsert, blockTop, blockBottom, blockColumn, blockStartx, blockToEnd, blockPad, blockChange;
+  int mapNode, mapPending[KEYMAP_PENDING], mapPendingCount, mapDepth, mapAbort;
+  int escapeNode, escapePending[KEYMAP_PENDING], escapePendingCount;
+  long long escapeDeadline, mapDeadline;
+  int ttimeoutlen, timeoutlen;
+  // q{reg} records typed keys, @{reg} feeds them again. replaying counts
+  // the macros (and . repeats) running, keyFailed stops them.
+  struct KeyBuffer macros[MACRO_REGISTERS];
+  int recording, lastMacro, replaying, keyFailed;
+  // rows changed while this is set are rendered when drawn, not right away
+  int deferRender;
+  // the register a "x in front of the command named, and the registers
+  int regname;
+  struct Yank *registers[REGISTERS];
+  struct Yank *slices;
+  // the keys of the last change and of the command being typed, for .
+  // the count the change was made with is kept out of its keys.
+  struct KeyBuffer redo, redoPending;
+  long long redoChanges;
+  int redoCount, redoInsert, redoReplaying;
+  // the screen without the status bar, which the windows share
   int screenrows, screencols;
-  unsigned int rowscount;
+  unsigned int rowscount, rowscapacity;
   EditorRow* rows;
+  struct LargeFile *large;
+  struct Stream *stream;
+  int follow;
+  struct Filter *filter;
+  // -b or :set binary, and the hex view that comes with it
+  int binary;
+  struct Hex *hex;
+  // keys typed while a filter ran, read before the terminal again
+  struct appendBuffer typeahead;
+  int typeaheadNext;
+  struct Folds folds;
+  struct Words words;
+  struct Completion completion;
+  struct TagStack tags;
+  struct DiskState disk;
+  int watchfd, watchwd;
+  char *watchName;
+  // bumped by every edit, equal to savedChanges when the buffer matches disk
+  long long changes, savedChanges;
+  long long memoryCap;
+  // -n, large files are indexed from scratch every time
+  int noIndexCache;
   EditorRow commandRow;
   struct appendBuffer prompt;
+  struct appendBuffer frame;
   char *filename;
+  char *lastPattern;
+  // the pattern and replacement of the last :s, which :s alone repeats
+  char *substitutePattern, *substituteReplacement;
+  char *iskeyword;
+  int headless, quitRequested;
+  int benchmark;
+  int infd, outfd;
+  // frames are drawn at most fps times a second, slower while the tty is
+  // slow to take them. frameSent is how much of frame is written.
+  int dirty, fps, frameSent;
+  long long lastFrame, frameBackoff;
+  long long bytesWritten;
+  FILE *trace;
+  long long traceStart;
+  long long keyArrived;
+  struct Perf perf;
   struct termios orig_termios;
 };
 struct Editor editor;
+EditorRow *editorRowAt(int at);
+void editorThawRow(EditorRow *row);
+void editorColdRelease(struct ColdBlock *block);
+void editorSetPrompt(const char *format, ...);
+void editorRegistersChange(int top, int bottom);
+void editorRegistersMove(int at, int count);
+void editorFoldsChange(int top, int bottom);
+void editorFoldsMove(int at, int count);
+void editorWordsChange(int top, int bottom);
+void editorWordsMove(int at, int count);
+int editorFoldLine(int row);
+void editorDamageAll();
+void editorDamageRows(int from, int to);
+void editorWindowsMove(int at, int count);
 EditorRow* getCurrentRow()
 {
-  if (editor.cursory >= editor.rowscount)
+  if (editor.window->cursory >= editor.rowscount)
     return NULL;
   
-  return &editor.rows[editor.cursory];
+  return editorRowAt(editor.window->cursory);
+}
+// }}}
+// Word classes {{{
+enum WordType {
+  WT_NON_WORD = 0,
+  WT_WORD,
+  WT_SPACE,
+};
+#define ISKEYWORD_DEFAULT "@,48-57,_,192-255"
+unsigned char wordClasses[256];
+// ascii letters, digits and _ are all keyword characters (true unless
+// iskeyword says otherwise), which lets the sse2 scan skip them
+int wordClassesAsciiAlnum;
+
+enum WordType editorCharWordType(unsigned char ch)
+{
+  return wordClasses[ch];
+}
+
+// one item of a vim style iskeyword: a number or a character
+const char *iskeywordParseChar(const char *spec, int *ch)
+{
+  if (isdigit(*spec))
+    *ch = strtol(spec, (char **)&spec, 10);
+  else if (*spec)
+    *ch = (unsigned char)*spec++;
+  else
+    *ch = -1;
+  return spec;
+}
+
+// fills the class table from a vim style iskeyword option, e.g.
+// "@,48-57,_,192-255". whitespace always stays whitespace.
+int editorSetIskeyword(const char *spec)
+{
+  unsigned char classes[256];
+  for (int c = 0; c < 256; c++)
+    classes[c] = isspace(c) ? WT_SPACE : WT_NON_WORD;
+
+  const char *item = spec;
+  while (*item) {
+    int exclude = 0;
+    if (*item == '^' && item[1] && item[1] != ',') {
+      exclude = 1;
+      item++;
+    }
+
+    int from, to;
+    int alpha = item[0] == '@' && (item[1] == ',' || item[1] == '\0');
+    if (alpha) {
+      item++;
+      from = 0;
+      to = 255;
+    } else {
+      item = iskeywordParseChar(item, &from);
+      to = from;
+      if (*item == '-')
+        item = iskeywordParseChar(item + 1, &to);
+    }
+    if (from < 0 || to > 255 || from > to || (*item && *item != ','))
+      return EXIT_FAILURE;
+
+    for (int c = from; c <= to; c++)
+      if (classes[c] != WT_SPACE && (!alpha || isalpha(c)))
+        classes[c] = exclude ? WT_NON_WORD : WT_WORD;
+    if (*item == ',')
+      item++;
+  }
+
+  memcpy(wordClasses, classes, sizeof(classes));
+  wordClassesAsciiAlnum = 1;
+  for (int c = 0; c < 128; c++)
+    if ((isalnum(c) || c == '_') && wordClasses[c] != WT_WORD)
+      wordClassesAsciiAlnum = 0;
+
+  nimFree(ALLOC_OTHER, editor.iskeyword);
+  editor.iskeyword = nimStrndup(ALLOC_OTHER, spec, strlen(spec));
+  return EXIT_SUCCESS;
+}
+
+#ifdef __SSE2__
+// bit i set when byte i of the chunk is certainly of the class
+int scanClassMask(const char *s, enum WordType type)
+{
+  __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+  __m128i member;
+  if (type == WT_SPACE) {
+    member = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                          _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')));
+  } else {
+    // bytes over 127 are negative here, so they never look like letters
+    __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                    _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                   _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+    member = _mm_or_si128(_mm_or_si128(letters, digits),
+                          _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+  }
+  return _mm_movemask_epi8(member);
+}
+
+// skips 16 bytes at a time while all of them are certainly of the class
+int scanClassRunSse2(const char *s, int start, int end, enum WordType type)
+{
+  while (start + 16 <= end) {
+    int mask = scanClassMask(&s[start], type);
+    if (mask != 0xffff)
+      return start + __builtin_ctz(~mask);
+    start += 16;
+  }
+  return start;
+}
+
+int scanClassRunBackSse2(const char *s, int start, int lower, enum WordType type)
+{
+  while (start - 15 >= lower) {
+    int mask = scanClassMask(&s[start - 15], type);
+    if (mask != 0xffff)
+      return start - 15 + 31 - __builtin_clz(~mask & 0xffff);
+    start -= 16;
+  }
+  return start;
+}
+#endif
+
+// first index in [start, end) whose class isn't type, or end
+int scanClassRun(const char *s, int start, int end, enum WordType type)
+{
+  while (start < end) {
+#ifdef __SSE2__
+    if (type == WT_SPACE || (type == WT_WORD && wordClassesAsciiAlnum)) {
+      start = scanClassRunSse2(s, start, end, type);
+      if (start >= end)
+        break;
+    }
+#endif
+    if (wordClasses[(unsigned char)s[start]] != type)
+      break;
+    start++;
+  }
+  return start;
+}
+
+// last index in [lower, start] whose class isn't type, or lower - 1
+int scanClassRunBack(const char *s, int start, int lower, enum WordType type)
+{
+  while (start >= lower) {
+#ifdef __SSE2__
+    if (type == WT_SPACE || (type == WT_WORD && wordClassesAsciiAlnum)) {
+      start = scanClassRunBackSse2(s, start, lower, type);
+      if (start < lower)
+        break;
+    }
+#endif
+    if (wordClasses[(unsigned char)s[start]] != type)
+      break;
+    start--;
+  }
+  return start;
 }
 // }}}
 // Assets {{{
 size_t firstNonSpaceFromStart (EditorRow *row, int start)
 {
-  size_t output = start;
-  while(isspace(row->buffer[output]))
-  {
-    ++output;
-    if (output > row->size-1)
-      return -1;
-  }
-  if (row->buffer[output] == '\0') 
+  if (start < 0 || start >= row->size)
+    return -1;
+  int output = scanClassRun(editorRowBuffer(row), start, row->size, WT_SPACE);
+  if (output >= row->size || editorRowBuffer(row)[output] == '\0')
     return -1;
   return output;
 }
@@ -163,20 +904,22 @@ int isInRange(int search, struct Range range)
 // }}}
 // Terminal {{{
 void die(const char *s) {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  if (!editor.headless) {
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+  }
   perror(s);
   exit(1);
 }
 
 void disableRawMode() {
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor.orig_termios) == -1)
+  if (tcsetattr(editor.infd, TCSAFLUSH, &editor.orig_termios) == -1)
     die("tcsetattr");
 }
 
 void enableRawMode() 
 {
-  if (tcgetattr(STDIN_FILENO, &editor.orig_termios) == -1) die("tcgetattr");
+  if (tcgetattr(editor.infd, &editor.orig_termios) == -1) die("tcgetattr");
   atexit(disableRawMode);
 
   struct termios raw = editor.orig_termios;
@@ -187,19 +930,144 @@ void enableRawMode()
   raw.c_cc[VMIN] = 0;
   raw.c_cc[VTIME] = 1;
 
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  if (tcsetattr(editor.infd, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+}
+
+long long monotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// keys typed while a filter ran are read back before the terminal, but
+// not by another filter, which only looks out for Ctrl-C
+int editorTypeaheadPending()
+{
+  return !editor.filter && editor.typeaheadNext < editor.typeahead.length;
 }
 
 char editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  if (editorTypeaheadPending()) {
+    c = editor.typeahead.buffer[editor.typeaheadNext++];
+    if (editor.typeaheadNext == editor.typeahead.length) {
+      abClear(&editor.typeahead);
+      editor.typeaheadNext = 0;
+    }
+    editor.keyArrived = monotonicNs();
+    return c;
+  }
+  while ((nread = read(editor.infd, &c, 1)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
   }
-  printf("%c\r\n", c);
+  editor.keyArrived = monotonicNs();
+  // trace lines are "<microseconds since start> <key code>"
+  if (editor.trace)
+    fprintf(editor.trace, "%lld %d\n", (monotonicNs() - editor.traceStart) / 1000, (unsigned char)c);
   return c;
 }
 
+// writes as much of the frame as the terminal takes without blocking.
+// the rest is sent once the tty drains, and returns 0 until then.
+int editorFlush()
+{
+  int flags = fcntl(editor.outfd, F_GETFL);
+  if (!(flags & O_NONBLOCK))
+    fcntl(editor.outfd, F_SETFL, flags | O_NONBLOCK);
+  while (editor.frameSent < editor.frame.length) {
+    ssize_t written = write(editor.outfd, editor.frame.buffer + editor.frameSent,
+                            editor.frame.length - editor.frameSent);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break;
+    editor.frameSent += written;
+    editor.bytesWritten += written;
+    editor.perf.current.bytes += written;
+  }
+  if (!(flags & O_NONBLOCK))
+    fcntl(editor.outfd, F_SETFL, flags);
+  return editor.frameSent == editor.frame.length;
+}
+// }}}
+// Perf {{{
+// stages are timed as they run into perf.current, and editorPerfEndFrame
+// pushes it into the ring that :perf shows
+void editorPerfAdd(enum PerfStage stage, long long start)
+{
+  editor.perf.current.stages[stage] += monotonicNs() - start;
+}
+
+long long editorPerfHeap()
+{
+#ifdef __GLIBC__
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+void editorPerfEndFrame()
+{
+  struct Perf *perf = &editor.perf;
+  long long heap = editorPerfHeap();
+  perf->current.heapGrowth = heap - perf->heap;
+  perf->heap = heap;
+  perf->current.allocs = allocators.frameAllocs;
+  perf->current.allocBytes = allocators.frameBytes;
+  allocators.frameAllocs = 0;
+  allocators.frameBytes = 0;
+
+  if (perf->csv) {
+    fprintf(perf->csv, "%lld", perf->framescount);
+    for (int i = 0; i < PERF_STAGES; i++)
+      fprintf(perf->csv, ",%lld", perf->current.stages[i]);
+    fprintf(perf->csv, ",%d,%d,%lld,%lld,%lld\n", perf->current.bytes, perf->current.rowsRendered,
+            perf->current.heapGrowth, perf->current.allocs, perf->current.allocBytes);
+  }
+
+  perf->frames[perf->framescount % PERF_FRAMES] = perf->current;
+  perf->framescount++;
+  memset(&perf->current, 0, sizeof(perf->current));
+}
+
+int editorPerfOpenCsv(const char *filename)
+{
+  editor.perf.csv = fopen(filename, "w");
+  if (!editor.perf.csv)
+    return EXIT_FAILURE;
+  // stdio flushes it when we exit
+  fprintf(editor.perf.csv, "frame,input_ns,edit_ns,scroll_ns,render_ns,flush_ns,bytes,rows_rendered,heap_growth,allocs,alloc_bytes\n");
+  return EXIT_SUCCESS;
+}
+
+// the overlay takes the top rows of the current window: a header, then
+// the newest frames first
+int editorPerfOverlayHeight()
+{
+  if (!editor.perf.overlay)
+    return 0;
+  long long frames = editor.perf.framescount < PERF_FRAMES ? editor.perf.framescount : PERF_FRAMES;
+  int height = frames + 1;
+  return height < editor.window->rows ? height : editor.window->rows;
+}
+
+int editorPerfOverlayLine(char *buf, size_t size, int y)
+{
+  if (y == 0)
+    return snprintf(buf, size, "%5s %8s %8s %8s %8s %8s %7s %5s %9s %6s", "frame", "input", "edit",
+                    "scroll", "render", "flush", "bytes", "rows", "heap", "allocs");
+
+  long long frame = editor.perf.framescount - y;
+  struct PerfFrame *pf = &editor.perf.frames[frame % PERF_FRAMES];
+  return snprintf(buf, size, "%5lld %6.1fus %6.1fus %6.1fus %6.1fus %6.1fus %7d %5d %+9lld %6lld", frame,
+                  pf->stages[PERF_INPUT] / 1e3, pf->stages[PERF_EDIT] / 1e3, pf->stages[PERF_SCROLL] / 1e3,
+                  pf->stages[PERF_RENDER] / 1e3, pf->stages[PERF_FLUSH] / 1e3, pf->bytes,
+                  pf->rowsRendered, pf->heapGrowth, pf->allocs);
+}
+
 int getCursorPosition(int *rows, int *cols)
 {
   char buf[32];
@@ -209,7 +1077,7 @@ int getCursorPosition(int *rows, int *cols)
     return EXIT_FAILURE;
 
   while (i < sizeof(buf) - 1) {
-    if(read(STDIN_FILENO, &buf[i], 1) != 1)
+    if(read(editor.infd, &buf[i], 1) != 1)
       break;
     if (buf[i] == 'R') 
       break;
@@ -242,122 +1110,343 @@ int getWindowSize(int *rows, int *cols)
 size_t findFirstOfCharacter (EditorRow *row, int start, char ch)
 {
   for (size_t output = start; output < row->size; output++) {
-    if (row->buffer[output] == ch)
+    if (editorRowBuffer(row)[output] == ch)
       return output;
   }
   return -1;
 }
+// the command line is an EditorRow too, but it's accounted on its own
+enum AllocSubsystem editorRowSubsystem(EditorRow *row, enum AllocSubsystem subsystem)
+{
+  return row == &editor.commandRow ? ALLOC_COMMAND : subsystem;
+}
 void editorFreeRow(EditorRow *row) {
-  free(row->renderbuffer);
-  free(row->buffer);
+  if (row->cold) {
+    editorColdRelease(row->cold);
+    return;
+  }
+  nimFree(editorRowSubsystem(row, ALLOC_RENDER), row->renderbuffer);
+  if (row->capacity > ROW_INLINE)
+    nimFree(editorRowSubsystem(row, ALLOC_ROWS), row->store.heap);
+}
+void editorClearRow(EditorRow *row) {
+  editorFreeRow(row);
+  memset(row, 0, sizeof(*row));
+}
+// grows the buffer geometrically, so typing doesn't realloc on every key.
+// the text moves to the heap once it doesn't fit in the row.
+void editorRowReserve(EditorRow *row, int size)
+{
+  if (size <= ROW_INLINE || size <= row->capacity)
+    return;
+  int capacity = row->capacity * 2;
+  if (capacity < size)
+    capacity = size;
+  if (capacity < 2 * ROW_INLINE)
+    capacity = 2 * ROW_INLINE;
+  if (row->capacity > ROW_INLINE)
+    row->store.heap = nimRealloc(editorRowSubsystem(row, ALLOC_ROWS), row->store.heap, capacity);
+  else {
+    char *heap = nimMalloc(editorRowSubsystem(row, ALLOC_ROWS), capacity);
+    memcpy(heap, row->store.local, row->size + 1);
+    row->store.heap = heap;
+  }
+  row->capacity = capacity;
+}
+
+// registers still holding the row as a slice take a copy before it
+// changes, folds and the completion words look at it again and windows
+// showing it draw it again.
+// large files never have slices, see editorYankSlice.
+void editorRowChanging(EditorRow *row)
+{
+  if (row < editor.rows || row >= editor.rows + editor.rowscount)
+    return;
+  if (editor.slices)
+    editorRegistersChange(row - editor.rows, row - editor.rows);
+  editorFoldsChange(row - editor.rows, row - editor.rows);
+  editorWordsChange(row - editor.rows, row - editor.rows);
+  int at = row - editor.rows + (editor.large ? editor.large->windowStart : 0);
+  editorDamageRows(at, at + 1);
+}
+
+// takes over buffer (size bytes and a '\0', from ALLOC_ROWS) as the text
+void editorRowAdopt(EditorRow *row, char *buffer, int size)
+{
+  editorRowChanging(row);
+  if (row->capacity > ROW_INLINE)
+    nimFree(ALLOC_ROWS, row->store.heap);
+  row->size = size;
+  if (size < ROW_INLINE) {
+    memcpy(row->store.local, buffer, size + 1);
+    nimFree(ALLOC_ROWS, buffer);
+    row->capacity = 0;
+  } else {
+    row->store.heap = buffer;
+    row->capacity = size + 1;
+  }
 }
 int editorRowCursorxToRenderx(EditorRow *row, int cursorx)
 {
+  char *buffer = editorRowBuffer(row);
   int renderx = 0;
   for (int i = 0; i < cursorx; ++i) {
-    if(row->buffer[i] == '\t')
+    if(buffer[i] == '\t')
       renderx += (TAB_WIDTH - 1) - (renderx % TAB_WIDTH);
     renderx++;
   }
 
   return renderx;
 }
+// the character shown at render column, or size when the row is shorter
+int editorRowColumnToCursorx(EditorRow *row, int column)
+{
+  char *buffer = editorRowBuffer(row);
+  int renderx = 0;
+  for (int i = 0; i < row->size; ++i) {
+    if(buffer[i] == '\t')
+      renderx += (TAB_WIDTH - 1) - (renderx % TAB_WIDTH);
+    renderx++;
+    if (renderx > column)
+      return i;
+  }
+  return row->size;
+}
 int editorRowRenderxToCursorx(EditorRow *row, int renderx)
 {
   int cursorx = 0;
-  for (int i = editor.cursorx; i < renderx; ++i) {
-    if(row->buffer[i] == '\t')
+  for (int i = editor.window->cursorx; i < renderx; ++i) {
+    if(editorRowBuffer(row)[i] == '\t')
       cursorx -= (TAB_WIDTH - 1) + (cursorx % TAB_WIDTH);
     cursorx++;
   }
   return cursorx;
 }
-void editorUpdateRow(EditorRow *row) 
+void editorRenderRow(EditorRow *row)
 {
+  editor.perf.current.rowsRendered++;
+  row->stale = 0;
+  char *buffer = editorRowBuffer(row);
   int tabs = 0;
   for (int i = 0; i < row->size; i++)
-    if(row->buffer[i] == '\t')
+    if(buffer[i] == '\t')
       tabs++;
+  row->blank = scanClassRun(buffer, 0, row->size, WT_SPACE) == row->size;
+
+  // nothing to expand, the text is shown as it is
+  if (!tabs) {
+    nimFree(editorRowSubsystem(row, ALLOC_RENDER), row->renderbuffer);
+    row->renderbuffer = NULL;
+    row->rendercapacity = 0;
+    row->rendersize = row->size;
+    return;
+  }
 
-  free(row->renderbuffer);
-  row->renderbuffer = malloc(row->size+1 + tabs*(TAB_WIDTH-1));
+  int rendersize = row->size+1 + tabs*(TAB_WIDTH-1);
+  if (rendersize > row->rendercapacity) {
+    row->renderbuffer = nimRealloc(editorRowSubsystem(row, ALLOC_RENDER), row->renderbuffer, rendersize);
+    row->rendercapacity = rendersize;
+  }
 
   int index = 0;
   for (int i = 0; i < row->size; ++i)
   {
-    if (row->buffer[i] == '\t') {
+    if (buffer[i] == '\t') {
       row->renderbuffer[index++] = ' ';
       while (index % TAB_WIDTH != 0)
         row->renderbuffer[index++] = ' ';
     } else
-      row->renderbuffer[index++] = row->buffer[i];
+      row->renderbuffer[index++] = buffer[i];
   }
 
   row->renderbuffer[index] = '\0';
   row->rendersize = index;
 }
 
-void editorUpdateAllRows(){
-  for (int i=0; i < editor.rowscount; i++)
-    editorUpdateRow(&editor.rows[i]);
+void editorUpdateRow(EditorRow *row)
+{
+  row->edited = 1;
+  // typing a : command doesn't change the buffer
+  if (row != &editor.commandRow)
+    editor.changes++;
+  // a macro can change a row thousands of times, or rows that are never
+  // shown. only what motions need is kept up to date, see editorDrawRows.
+  if (editor.deferRender) {
+    row->blank = scanClassRun(editorRowBuffer(row), 0, row->size, WT_SPACE) == row->size;
+    row->stale = 1;
+    return;
+  }
+  editorRenderRow(row);
+}
+
+// rows held in memory: all of them, or the window in large file mode
+int editorResidentRows()
+{
+  return editor.large ? editor.large->windowCount : (int)editor.rowscount;
 }
 
-void editorAppendRowAt(char *s, size_t len, int at)
+
+// the text only, for rows that aren't drawn or are rendered later
+void editorInitRowText(EditorRow *row, const char *s, size_t len)
 {
-  if (at < 0 || at > editor.rowscount) return;
+  memset(row, 0, sizeof(*row));
+  row->size = len;
+  if (len >= ROW_INLINE) {
+    row->capacity = len+1;
+    row->store.heap = nimMalloc(ALLOC_ROWS, len+1);
+  }
+  char *buffer = editorRowBuffer(row);
+  memcpy(buffer, s, len);
+
+  buffer[len] = '\0';
+}
+
+void editorInitRow(EditorRow *row, const char *s, size_t len)
+{
+  editorInitRowText(row, s, len);
+  editorRenderRow(row);
+}
 
-  editor.rows = realloc(editor.rows, sizeof(EditorRow) * (editor.rowscount+1));
-  memmove(&editor.rows[at + 1], &editor.rows[at], sizeof(EditorRow) * (editor.rowscount - at));
+// large files only keep a window of rows, so lines can be changed but not
+// added or removed
+int editorCanChangeLines()
+{
+  if (editor.large) {
+    editorSetPrompt("Lines can't be added or removed in large file mode");
+    return 0;
+  }
+  return 1;
+}
 
-  editor.rows[at].size = len;
-  editor.rows[at].buffer = malloc(len+1);
-  memcpy(editor.rows[at].buffer, s, len);
+// makes room for count rows at at with one move of the rows after it,
+// for the caller to fill. the loader uses it as is, since reading a file
+// in isn't a change to the buffer.
+EditorRow *editorLoadRows(int at, int count)
+{
+  editorRegistersMove(at, count);
+  editorFoldsMove(at, count);
+  editorWordsMove(at, count);
+  editorWindowsMove(at, count);
+  if (editor.rowscount + count > editor.rowscapacity) {
+    while (editor.rowscount + count > editor.rowscapacity)
+      editor.rowscapacity = editor.rowscapacity ? editor.rowscapacity * 2 : 64;
+    editor.rows = nimRealloc(ALLOC_ROWS, editor.rows, sizeof(EditorRow) * editor.rowscapacity);
+  }
+  memmove(&editor.rows[at + count], &editor.rows[at], sizeof(EditorRow) * (editor.rowscount - at));
+  editor.rowscount += count;
+  return &editor.rows[at];
+}
 
-  editor.rows[at].buffer[len] = '\0';
+EditorRow *editorInsertRows(int at, int count)
+{
+  editor.changes++;
+  return editorLoadRows(at, count);
+}
 
-  editor.rows[at].rendersize = 0;
-  editor.rows[at].renderbuffer = NULL;
-  editorUpdateRow(&editor.rows[at]);
+void editorAppendRowAt(char *s, size_t len, int at)
+{
+  if (at < 0 || at > editor.rowscount) return;
+  if (!editorCanChangeLines()) return;
 
-  editor.rowscount++;
+  EditorRow *row = editorInsertRows(at, 1);
+  editorInitRow(row, s, len);
+  row->edited = 1;
 }
 #define editorAppendRow(string, len) editorAppendRowAt(string, len, editor.rowscount)
 
 void editorRowInsertChar(EditorRow *row, int index, int charToInsert) {
   if (index < 0 || index > row->size) index = row->size;
-  row->buffer = realloc(row->buffer, row->size + 2);
-  memmove(&row->buffer[index + 1], &row->buffer[index], row->size - index + 1);
+  editorRowChanging(row);
+  editorRowReserve(row, row->size + 2);
+  memmove(&editorRowBuffer(row)[index + 1], &editorRowBuffer(row)[index], row->size - index + 1);
   row->size++;
-  row->buffer[index] = charToInsert;
+  editorRowBuffer(row)[index] = charToInsert;
   editorUpdateRow(row);
 }
 
-void editorDeleteRow(int at)
+// for rows that leave the buffer but not the memory
+void editorRowDropRender(EditorRow *row)
+{
+  nimFree(ALLOC_RENDER, row->renderbuffer);
+  row->renderbuffer = NULL;
+  row->rendercapacity = 0;
+}
+
+// count rows from at, moving the rows after them up once. they are freed,
+// or handed to into without their render when it's given.
+void editorDeleteRowsInto(int at, int count, EditorRow *into)
 {
-  if (at < 0 || at > editor.rowscount - 1)
+  if (at < 0 || count <= 0 || at > editor.rowscount - 1)
+    return;
+  if (!editorCanChangeLines())
     return;
-  editorFreeRow(&editor.rows[at]);
-  if (at+1 < editor.rowscount) {
-    memmove(&editor.rows[at], &editor.rows[at+1], sizeof(EditorRow)*(editor.rowscount-at-1));
+  if (count > editor.rowscount - at)
+    count = editor.rowscount - at;
+  editorRegistersMove(at, -count);
+  editorFoldsMove(at, -count);
+  editorWordsMove(at, -count);
+  editorWindowsMove(at, -count);
+  for (int i = at; i < at + count; i++) {
+    EditorRow *row = &editor.rows[i];
+    if (!into) {
+      editorFreeRow(row);
+      continue;
+    }
+    editorRowDropRender(row);
+    into[i - at] = *row;
+  }
+  editor.changes++;
+  if (at+count < editor.rowscount) {
+    memmove(&editor.rows[at], &editor.rows[at+count], sizeof(EditorRow)*(editor.rowscount-at-count));
   }
-  editor.rowscount--;
+  editor.rowscount -= count;
+}
+
+void editorDeleteRows(int at, int count)
+{
+  editorDeleteRowsInto(at, count, NULL);
+}
+
+void editorDeleteRow(int at)
+{
+  editorDeleteRows(at, 1);
 }
 
 void editorRowAppendString(EditorRow *row, char *string, size_t length)
 {
+  editorRowChanging(row);
   // +1 for '\0'
-  row->buffer = realloc(row->buffer, row->size + length + 1);
+  editorRowReserve(row, row->size + length + 1);
   // copy string with length to last+1 item of array
-  memcpy(&row->buffer[row->size], string,length);
+  memcpy(&editorRowBuffer(row)[row->size], string,length);
   row->size += length;
-  row->buffer[row->size] = '\0';
+  editorRowBuffer(row)[row->size] = '\0';
 
   editorUpdateRow(row);
 }
 
-void editorRowDeleteChar(EditorRow *row, int index) {
+// replaces deletecount bytes at index with length bytes of string, with
+// one resize and one move of the rest of the row
+void editorRowSplice(EditorRow *row, int index, int deletecount, const char *string, int length)
+{
+  if (index < 0 || index > row->size)
+    index = row->size;
+  if (deletecount > row->size - index)
+    deletecount = row->size - index;
+  editorRowChanging(row);
+  editorRowReserve(row, row->size - deletecount + length + 1);
+  memmove(&editorRowBuffer(row)[index + length], &editorRowBuffer(row)[index + deletecount], row->size - index - deletecount);
+  if (length)
+    memcpy(&editorRowBuffer(row)[index], string, length);
+  row->size += length - deletecount;
+  editorRowBuffer(row)[row->size] = '\0';
+  editorUpdateRow(row);
+}
+
+void editorRowDeleteChar(EditorRow *row, int index) {
   if (index < 0 || index >= row->size) return;
-  memmove(&row->buffer[index], &row->buffer[index + 1], row->size - index);
+  editorRowChanging(row);
+  memmove(&editorRowBuffer(row)[index], &editorRowBuffer(row)[index + 1], row->size - index);
   row->size--;
   editorUpdateRow(row);
   // editor.dirty++;
@@ -365,938 +1454,8224 @@ void editorRowDeleteChar(EditorRow *row, int index) {
 
 void editorNewlineAtCursorx()
 {
-  if (editor.cursorx < getCurrentRow()->size -1) {
-    int newSize = getCurrentRow()->size - editor.cursorx;
-    editorAppendRowAt(strdup(&getCurrentRow()->buffer[editor.cursorx]), newSize, editor.cursory+1);
-    getCurrentRow()->size = editor.cursorx;
-    getCurrentRow()->buffer[editor.cursorx] = '\0';
+  if (!editorCanChangeLines())
+    return;
+  if (editor.window->cursorx < getCurrentRow()->size -1) {
+    int newSize = getCurrentRow()->size - editor.window->cursorx;
+    editorAppendRowAt(nimStrndup(ALLOC_TRANSIENT, &editorRowBuffer(getCurrentRow())[editor.window->cursorx], newSize),
+                      newSize, editor.window->cursory+1);
+    editorRowChanging(getCurrentRow());
+    getCurrentRow()->size = editor.window->cursorx;
+    editorRowBuffer(getCurrentRow())[editor.window->cursorx] = '\0';
     editorUpdateRow(getCurrentRow());
-    editor.cursory++;
+    editor.window->cursory++;
   }
   else
-    editorAppendRowAt("", 0, ++editor.cursory);
+    editorAppendRowAt("", 0, ++editor.window->cursory);
 }
 // }}}
-// Editor operations {{{
-void editorQuit()
+// Index cache {{{
+// the line index of a large file is kept in ~/.cache/nim, in a file
+// named after a hash of its path, so opening it again maps the index in
+// instead of reading the whole file. a file that was only appended to
+// since has the rest indexed from the old end.
+#define INDEX_CACHE_MAGIC "nimidx1"
+struct IndexCacheHeader {
+  char magic[8];
+  long long dev, ino, size, mtimeSec, mtimeNsec;
+  long long lines, indexcount;
+  int stride, endsWithNewline;
+  // the bytes before size, to tell an append from a rewrite
+  int tailsize;
+  char tail[DISK_TAIL];
+  // the path follows the index
+  int pathlength;
+};
+
+// the name of the cache file for path, or NULL without a place for it
+char *editorIndexCachePath(const char *path)
 {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
-  exit(EXIT_SUCCESS);
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if ((!base || !*base) && (!home || !*home))
+    return NULL;
+  // fnv-1a
+  unsigned long long hash = 14695981039346656037ULL;
+  for (const char *c = path; *c; c++)
+    hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+
+  size_t length = strlen(base && *base ? base : home) + 64;
+  char *name = nimMalloc(ALLOC_OTHER, length);
+  if (base && *base)
+    snprintf(name, length, "%s", base);
+  else
+    snprintf(name, length, "%s/.cache", home);
+  mkdir(name, 0755);
+  strcat(name, "/nim");
+  mkdir(name, 0755);
+  size_t directory = strlen(name);
+  snprintf(name + directory, length - directory, "/%016llx.idx", hash);
+  return name;
 }
-// }}}
-// File i/o {{{
-char *editorRowsToString(int *bufferLength)
+
+// the index as it is in the cache, or the part of it before an append.
+// returns how much of the file it covers, 0 when there is nothing to use.
+off_t editorIndexCacheLoad(struct LargeFile *large, const char *path)
 {
-  int totalLength = 0;
-  for (int i = 0; i < editor.rowscount; i++)
-    totalLength += editor.rows[i].size + 1;
-  *bufferLength = totalLength;
+  char *name = editorIndexCachePath(path);
+  if (!name)
+    return 0;
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  nimFree(ALLOC_OTHER, name);
+  if (fd == -1)
+    return 0;
+  struct stat cached, st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &cached) == 0 && fstat(large->fd, &st) == 0 && cached.st_size >= (off_t)sizeof(struct IndexCacheHeader))
+    map = mmap(NULL, cached.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
 
-  char *buffer = malloc(totalLength);
-  char *pointer = buffer;
+  struct IndexCacheHeader *header = map;
+  size_t indexBytes = header->indexcount * sizeof(off_t);
+  int valid = !memcmp(header->magic, INDEX_CACHE_MAGIC, sizeof(header->magic))
+    && header->stride == LARGEFILE_STRIDE && header->indexcount >= 0 && header->pathlength >= 0
+    && header->tailsize >= 0 && header->tailsize <= DISK_TAIL
+    && (size_t)cached.st_size == sizeof(*header) + indexBytes + header->pathlength
+    && header->pathlength == (int)strlen(path)
+    && !memcmp((char *)map + sizeof(*header) + indexBytes, path, header->pathlength)
+    && header->dev == (long long)st.st_dev && header->ino == (long long)st.st_ino
+    && header->lines <= 0x7fffffff;
+  // unchanged, or grown with the old end still in place
+  if (valid && st.st_size == header->size)
+    valid = header->mtimeSec == st.st_mtim.tv_sec && header->mtimeNsec == st.st_mtim.tv_nsec;
+  else if (valid && st.st_size > header->size) {
+    char tail[DISK_TAIL];
+    valid = pread(large->fd, tail, header->tailsize, header->size - header->tailsize) == header->tailsize
+      && !memcmp(tail, header->tail, header->tailsize);
+  } else
+    valid = 0;
+  if (!valid) {
+    munmap(map, cached.st_size);
+    return 0;
+  }
 
-  for (int j = 0; j < editor.rowscount; j++) {
-    memcpy(pointer, editor.rows[j].buffer,editor.rows[j].size);
-    pointer += editor.rows[j].size;
-    *pointer = '\n';
-    pointer++;
+  large->map = map;
+  large->mapsize = cached.st_size;
+  large->index = (off_t *)((char *)map + sizeof(*header));
+  large->indexcount = header->indexcount;
+  large->indexcapacity = 0;
+  large->endsWithNewline = header->endsWithNewline;
+  editor.rowscount = header->lines;
+  return header->size;
+}
+
+// the index is written next to the cache file and renamed over it, so a
+// nim opening the same file meanwhile sees the old one or the new one
+void editorIndexCacheSave(struct LargeFile *large, const char *path)
+{
+  struct stat st;
+  char *name = editorIndexCachePath(path);
+  if (!name)
+    return;
+  if (fstat(large->fd, &st) == -1 || st.st_size != large->size) {
+    nimFree(ALLOC_OTHER, name);
+    return;
   }
-  return buffer;
+
+  struct IndexCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_CACHE_MAGIC, sizeof(header.magic));
+  header.dev = st.st_dev;
+  header.ino = st.st_ino;
+  header.size = large->size;
+  header.mtimeSec = st.st_mtim.tv_sec;
+  header.mtimeNsec = st.st_mtim.tv_nsec;
+  header.lines = editor.rowscount;
+  header.indexcount = large->indexcount;
+  header.stride = LARGEFILE_STRIDE;
+  header.endsWithNewline = large->endsWithNewline;
+  header.tailsize = large->size < DISK_TAIL ? large->size : DISK_TAIL;
+  if (pread(large->fd, header.tail, header.tailsize, large->size - header.tailsize) != header.tailsize) {
+    nimFree(ALLOC_OTHER, name);
+    return;
+  }
+  header.pathlength = strlen(path);
+
+  char *tmpname = nimMalloc(ALLOC_OTHER, strlen(name) + 32);
+  sprintf(tmpname, "%s.%d", name, (int)getpid());
+  int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    struct iovec iov[3] = {
+      {&header, sizeof(header)},
+      {large->index, large->indexcount * sizeof(off_t)},
+      {(char *)path, header.pathlength},
+    };
+    ssize_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    int ok = writev(fd, iov, 3) == total;
+    close(fd);
+    if (!ok || rename(tmpname, name) == -1)
+      unlink(tmpname);
+  }
+  nimFree(ALLOC_OTHER, tmpname);
+  nimFree(ALLOC_OTHER, name);
+}
+// }}}
+// Large file {{{
+EditorRow *editorLargeFileEditAt(int row, int *position)
+{
+  struct LargeFile *large = editor.large;
+  int low = 0, high = large->editscount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (large->edits[middle].row < row)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  *position = low;
+  if (low < large->editscount && large->edits[low].row == row)
+    return &large->edits[low].text;
+  return NULL;
 }
 
-void editorOpen(char *filename) 
+void editorLargeFileKeepEdit(int row, EditorRow *text)
 {
-  free(editor.filename);
-  editor.filename = strdup(filename);
+  struct LargeFile *large = editor.large;
+  int position;
+  editorLargeFileEditAt(row, &position);
+  if (large->editscount == large->editscapacity) {
+    large->editscapacity = large->editscapacity ? large->editscapacity * 2 : 16;
+    large->edits = nimRealloc(ALLOC_ROWS, large->edits, sizeof(*large->edits) * large->editscapacity);
+  }
+  memmove(&large->edits[position + 1], &large->edits[position],
+          sizeof(*large->edits) * (large->editscount - position));
+  large->edits[position].row = row;
+  large->edits[position].text = *text;
+  large->editscount++;
+}
 
-  if (access(filename, F_OK) == 0) {
+// the window is handed back: edited rows are kept aside, the rest is freed
+void editorLargeFileDropWindow()
+{
+  struct LargeFile *large = editor.large;
+  for (int i = 0; i < large->windowCount; i++) {
+    if (editor.rows[i].edited)
+      editorLargeFileKeepEdit(large->windowStart + i, &editor.rows[i]);
+    else
+      editorFreeRow(&editor.rows[i]);
+  }
+  large->windowCount = 0;
+}
 
-    FILE *fptr = fopen(filename, "r");
-    if (!fptr) die("fopen");
+void editorLargeFileWindowAppend(const char *line, size_t len)
+{
+  struct LargeFile *large = editor.large;
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    len--;
+
+  if (large->windowCount == large->windowCapacity) {
+    large->windowCapacity = large->windowCapacity ? large->windowCapacity * 2 : 1024;
+    editor.rows = nimRealloc(ALLOC_ROWS, editor.rows, sizeof(EditorRow) * large->windowCapacity);
+  }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+  int row = large->windowStart + large->windowCount;
+  int position;
+  EditorRow *edit = editorLargeFileEditAt(row, &position);
+  if (edit) {
+    editor.rows[large->windowCount] = *edit;
+    memmove(&large->edits[position], &large->edits[position + 1],
+            sizeof(*large->edits) * (large->editscount - position - 1));
+    large->editscount--;
+  } else
+    editorInitRow(&editor.rows[large->windowCount], line, len);
+  large->windowCount++;
+}
 
-    while ((linelen = getline(&line, &linecap, fptr)) != -1) {
-      if (linelen != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-          linelen--;
+// what a row takes in memory: the struct, and the text and render that
+// don't fit in it
+long long editorRowMemory(EditorRow *row)
+{
+  return sizeof(EditorRow) + (row->capacity > ROW_INLINE ? row->capacity : 0) + row->rendercapacity;
+}
 
-        editorAppendRow(line, linelen);
+// reads rows around at from disk. the window is about a quarter of the
+// memory cap (rows cost their text, their render and the struct), but
+// always covers a few screens after at.
+void editorLargeFileLoadWindow(int at)
+{
+  struct LargeFile *large = editor.large;
+  editorLargeFileDropWindow();
+
+  long long budget = editor.memoryCap / 4;
+  long long averageRow = large->size / (editor.rowscount ? editor.rowscount : 1) + 1 + sizeof(EditorRow);
+  int start = at - (int)(budget / averageRow / 2);
+  if (start < 0)
+    start = 0;
+  start -= start % LARGEFILE_STRIDE;
+  int minimumEnd = at + editor.screenrows * 2;
+
+  large->windowStart = start;
+  off_t offset = large->index[start / LARGEFILE_STRIDE];
+  long long bytes = 0;
+  struct appendBuffer pending = ABUF_INIT_FOR(ALLOC_OTHER);
+  char chunk[64 * 1024];
+  ssize_t nread;
+  int done = 0;
+  while (!done && (nread = pread(large->fd, chunk, sizeof(chunk), offset)) > 0) {
+    offset += nread;
+    char *cursor = chunk, *end = chunk + nread;
+    while (cursor < end) {
+      char *newline = memchr(cursor, '\n', end - cursor);
+      if (newline == NULL) {
+        abAppend(&pending, cursor, end - cursor);
+        break;
+      }
+      if (pending.length) {
+        abAppend(&pending, cursor, newline - cursor);
+        editorLargeFileWindowAppend(pending.buffer, pending.length);
+        abClear(&pending);
+      } else
+        editorLargeFileWindowAppend(cursor, newline - cursor);
+      bytes += editorRowMemory(&editor.rows[large->windowCount - 1]);
+      cursor = newline + 1;
+
+      int last = large->windowStart + large->windowCount;
+      if (last >= (int)editor.rowscount || (bytes >= budget && last > minimumEnd)) {
+        done = 1;
+        break;
       }
     }
-
-    free(line);
-    fclose(fptr);
   }
-  
+  if (!done && pending.length && large->windowStart + large->windowCount < (int)editor.rowscount)
+    editorLargeFileWindowAppend(pending.buffer, pending.length);
+  abFree(&pending);
 }
 
-void editorWrite()
+EditorRow *editorRowAt(int at)
 {
-  if (editor.filename == NULL)
-    return;
-
-  int length;
-  char *buffer = editorRowsToString(&length);
-
-  int fd = open(editor.filename, O_RDWR | O_CREAT, 0644);
-
-  ftruncate(fd, length);
-  write(fd, buffer, length);
-  close(fd);
-  
-  char message[80];
-  int messageSize = sprintf(message, "\"%s\" %dL, %dB", editor.filename, editor.rowscount, length);
-  abAppend(&editor.prompt, message, messageSize);
-  free(buffer);
+  struct LargeFile *large = editor.large;
+  if (large && (at < large->windowStart || at >= large->windowStart + large->windowCount))
+    editorLargeFileLoadWindow(at);
+  EditorRow *row = &editor.rows[large ? at - large->windowStart : at];
+  if (row->cold)
+    editorThawRow(row);
+  return row;
 }
-// }}}
-// Command mode {{{
-void editorExecuteCommandRow()
-{
-  int start = 0;
 
-  while (editor.commandRow.buffer[start] == ':') {
-    start++;
+// a single pass over the file from offset on that counts the lines and
+// indexes every LARGEFILE_STRIDE-th one. an offset past 0 extends the
+// index of a file that was appended to.
+int editorLargeFileIndex(struct LargeFile *large, off_t offset)
+{
+  // an index mapped from the cache is copied out before it can grow
+  if (large->map) {
+    large->indexcapacity = large->indexcount > 1024 ? large->indexcount : 1024;
+    off_t *index = nimMalloc(ALLOC_OTHER, sizeof(off_t) * large->indexcapacity);
+    memcpy(index, large->index, sizeof(off_t) * large->indexcount);
+    munmap(large->map, large->mapsize);
+    large->map = NULL;
+    large->index = index;
   }
-  editor.commandRow.size-=start;
-  memmove(editor.commandRow.buffer, editor.commandRow.buffer+start, editor.commandRow.size);
-  editor.commandRow.buffer[editor.commandRow.size] = '\0';
+  long long lines = offset ? editor.rowscount : 0;
+  char chunk[64 * 1024];
+  ssize_t nread;
+  int lastNewline = offset ? large->endsWithNewline : 1;
+  int indexcount = large->indexcount;
+
+  if (!offset)
+    large->indexcount = 0;
+  while ((nread = pread(large->fd, chunk, sizeof(chunk), offset)) > 0) {
+    char *cursor = chunk, *end = chunk + nread;
+    while (cursor < end) {
+      if (lastNewline) {
+        if (lines % LARGEFILE_STRIDE == 0) {
+          if (large->indexcount == large->indexcapacity) {
+            large->indexcapacity = large->indexcapacity ? large->indexcapacity * 2 : 1024;
+            large->index = nimRealloc(ALLOC_OTHER, large->index, sizeof(off_t) * large->indexcapacity);
+          }
+          large->index[large->indexcount++] = offset + (cursor - chunk);
+        }
+        lines++;
+      }
+      char *newline = memchr(cursor, '\n', end - cursor);
+      lastNewline = newline != NULL;
+      if (newline == NULL)
+        break;
+      cursor = newline + 1;
+    }
+    offset += nread;
+  }
+  // rows are counted in ints
+  if (nread == -1 || lines > INT_MAX) {
+    large->indexcount = indexcount;
+    if (nread == -1)
+      editorSetPrompt("\"%s\" can't be read: %s", editor.filename, strerror(errno));
+    else
+      editorSetPrompt("\"%s\" has more than %d lines, too many to open", editor.filename, INT_MAX);
+    return EXIT_FAILURE;
+  }
+  editor.rowscount = lines;
+  large->size = offset;
+  large->endsWithNewline = lastNewline;
+  return EXIT_SUCCESS;
+}
 
-  if (!strcmp(editor.commandRow.buffer,"q")) 
-  {
-    editorQuit();
+// the file is refused when it can't be read or has too many lines. the
+// buffer is left empty then, without a name so that :w can't write it
+// over the file, and the prompt says why.
+int editorLargeFileOpen(const char *filename, off_t size)
+{
+  struct LargeFile *large = nimMalloc(ALLOC_OTHER, sizeof(*large));
+  memset(large, 0, sizeof(*large));
+  large->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  large->size = size;
+  char path[PATH_MAX];
+  int cached = large->fd != -1 && !editor.noIndexCache && realpath(filename, path);
+  off_t indexed = cached ? editorIndexCacheLoad(large, path) : 0;
+  if (large->fd == -1)
+    editorSetPrompt("\"%s\" can't be opened: %s", filename, strerror(errno));
+  if (large->fd == -1 || ((!indexed || indexed < size) && editorLargeFileIndex(large, indexed) == EXIT_FAILURE)) {
+    if (large->map)
+      munmap(large->map, large->mapsize);
+    else
+      nimFree(ALLOC_OTHER, large->index);
+    if (large->fd != -1)
+      close(large->fd);
+    nimFree(ALLOC_OTHER, large);
+    editor.rowscount = 0;
+    nimFree(ALLOC_OTHER, editor.filename);
+    editor.filename = NULL;
+    return EXIT_FAILURE;
   }
-  if (!strcmp(editor.commandRow.buffer,"nim"))
-    system("xdg-open http://github.com/nimaaskarian/nim");
+  if (cached && (!indexed || indexed < size))
+    editorIndexCacheSave(large, path);
 
-  if (!strcmp(editor.commandRow.buffer,"w"))
-    editorWrite();
+  // the rows array of a file open before is empty by now
+  nimFree(ALLOC_ROWS, editor.rows);
+  editor.large = large;
+  editor.rows = NULL;
+  editor.rowscapacity = 0;
+  editorSetPrompt("\"%s\" %dL, %lldB [large]", filename, editor.rowscount, (long long)size);
+  return EXIT_SUCCESS;
+}
 
-  if (!strcmp(editor.commandRow.buffer,"wq") | !strcmp(editor.commandRow.buffer, "x")) {
-    editorWrite();
-    editorQuit();
+void editorLargeFileClose()
+{
+  struct LargeFile *large = editor.large;
+  for (int i = 0; i < large->windowCount; i++)
+    editorFreeRow(&editor.rows[i]);
+  for (int i = 0; i < large->editscount; i++)
+    editorFreeRow(&large->edits[i].text);
+  nimFree(ALLOC_ROWS, large->edits);
+  nimFree(ALLOC_ROWS, editor.rows);
+  if (large->map)
+    munmap(large->map, large->mapsize);
+  else
+    nimFree(ALLOC_OTHER, large->index);
+  close(large->fd);
+  nimFree(ALLOC_OTHER, large);
+  editor.large = NULL;
+  editor.rows = NULL;
+  editor.rowscount = editor.rowscapacity = 0;
+}
+
+// writes all of buffer, going on after short writes. returns 0 or -1.
+int writeAll(int fd, const char *buffer, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = write(fd, buffer, length);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    buffer += written;
+    length -= written;
   }
+  return 0;
 }
-void editorHandleCommandMode (int keyChar)
+
+// copies the original file, swapping in edited rows, to a temporary file
+// that then replaces it. the line count doesn't change, so the index of
+// the new file is built as it is copied and the file isn't read again.
+// returns the number of bytes written or -1.
+long long editorLargeFileWrite()
 {
-  if (keyChar == ENTER) {
-    editorExecuteCommandRow();
-    free(editor.commandRow.buffer);
-    editor.commandRow.buffer = NULL;
-    editor.commandRow.size = 0;
-    editor.mode = MODE_NORMAL;
-    return;
+  struct LargeFile *large = editor.large;
+  // kept aside and resident edits, in row order
+  editorLargeFileDropWindow();
+
+  struct stat st;
+  if (fstat(large->fd, &st) == -1)
+    return -1;
+  char *tmpname = nimMalloc(ALLOC_OTHER, strlen(editor.filename) + 5);
+  sprintf(tmpname, "%s.nim", editor.filename);
+  // read and write, as it is the file the buffer reads from afterwards
+  int fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nimFree(ALLOC_OTHER, tmpname);
+    return -1;
   }
-  if (keyChar == BACKSPACE) {
-    editorRowDeleteChar(&editor.commandRow, editor.commandRow.size-1);
-    return;
+
+  long indexcount = 0, indexcapacity = large->indexcount ? large->indexcount : 1;
+  off_t *index = nimMalloc(ALLOC_OTHER, sizeof(off_t) * indexcapacity);
+  struct appendBuffer output = ABUF_INIT_FOR(ALLOC_OUTPUT);
+  char chunk[64 * 1024];
+  ssize_t nread;
+  off_t offset = 0;
+  long long written = 0;
+  int row = 0, edit = 0, lineStart = 1, skipping = 0, failed = 0;
+  while (!failed && (nread = pread(large->fd, chunk, sizeof(chunk), offset)) > 0) {
+    offset += nread;
+    char *cursor = chunk, *end = chunk + nread;
+    while (cursor < end) {
+      if (lineStart) {
+        if (row % LARGEFILE_STRIDE == 0) {
+          if (indexcount == indexcapacity) {
+            indexcapacity *= 2;
+            index = nimRealloc(ALLOC_OTHER, index, sizeof(off_t) * indexcapacity);
+          }
+          index[indexcount++] = written + output.length;
+        }
+        if (edit < large->editscount && large->edits[edit].row == row) {
+          EditorRow *text = &large->edits[edit++].text;
+          abAppend(&output, editorRowBuffer(text), text->size);
+          skipping = 1;
+        }
+        lineStart = 0;
+      }
+      char *newline = memchr(cursor, '\n', end - cursor);
+      char *lineEnd = newline ? newline + 1 : end;
+      // an edited row ends in a newline only where the line it replaces did
+      if (!skipping)
+        abAppend(&output, cursor, lineEnd - cursor);
+      else if (newline)
+        abAppend(&output, "\n", 1);
+      if (newline) {
+        row++;
+        lineStart = 1;
+        skipping = 0;
+      }
+      cursor = lineEnd;
+    }
+    if (output.length >= (int)sizeof(chunk)) {
+      failed = writeAll(fd, output.buffer, output.length) == -1;
+      written += output.length;
+      abClear(&output);
+    }
   }
-  if (keyChar == CTRL_KEY('u')) {
-    free(editor.commandRow.buffer);
-    editor.commandRow.buffer = NULL;
-    editor.commandRow.size = 0;
-    editorRowInsertChar(&editor.commandRow,editor.commandRow.size, ':');
-    return;
+  // the temporary file takes the place of the original, so it gets its
+  // mode and is on disk before the rename
+  failed = failed || nread == -1 || writeAll(fd, output.buffer, output.length) == -1
+    || fchmod(fd, st.st_mode & 07777) == -1 || fsync(fd) == -1;
+  written += output.length;
+  abFree(&output);
+
+  if (failed || rename(tmpname, editor.filename) == -1) {
+    close(fd);
+    unlink(tmpname);
+    nimFree(ALLOC_OTHER, tmpname);
+    nimFree(ALLOC_OTHER, index);
+    return -1;
   }
-
-  if (iscntrl(keyChar))
-    return;
-
-  editorRowInsertChar(&editor.commandRow,editor.commandRow.size, keyChar);
+  nimFree(ALLOC_OTHER, tmpname);
+
+  // the edits are in the file now, which the new index describes
+  close(large->fd);
+  large->fd = fd;
+  for (int i = 0; i < large->editscount; i++)
+    editorFreeRow(&large->edits[i].text);
+  large->editscount = 0;
+  if (large->map)
+    munmap(large->map, large->mapsize);
+  else
+    nimFree(ALLOC_OTHER, large->index);
+  large->map = NULL;
+  large->index = index;
+  large->indexcount = indexcount;
+  large->indexcapacity = indexcapacity;
+  large->size = written;
+  char path[PATH_MAX];
+  if (!editor.noIndexCache && realpath(editor.filename, path))
+    editorIndexCacheSave(large, path);
+  return written;
 }
 // }}}
-// Output {{{
-enum WordType {
-  WT_NON_WORD = 0,
-  WT_WORD,
-  WT_SPACE,
+// Cold rows {{{
+// rows this far from the viewport are cold. blocks hold up to
+// COLD_BLOCK_ROWS rows and COLD_BLOCK_SIZE bytes, so lz offsets fit in 16
+// bits.
+#define COLD_DISTANCE 2000
+#define COLD_MIN_ROWS 10000
+#define COLD_BLOCK_ROWS 512
+#define COLD_BLOCK_SIZE (64 * 1024)
+#define COLD_CACHE_BLOCKS 4
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+struct ColdCache {
+  struct ColdBlock *block;
+  char *raw;
+  long long used;
 };
-enum WordType editorCharWordType(unsigned char ch)
+struct ColdCache coldCache[COLD_CACHE_BLOCKS];
+long long coldCacheClock;
+int coldLastCenter = -1;
+
+// a small lz77 in the spirit of lz4: every sequence is a token (literal
+// count in the high nibble, match length-4 in the low one, 15 meaning more
+// length bytes follow), the literals, then a 2 byte offset back to the match.
+// the last sequence has literals only.
+int lzWriteLength(char *output, int length)
 {
-  if (isspace(ch))
-    return WT_SPACE;
-  if (isInRange(ch, createRange('a', 'z')))
-    return WT_WORD;
-  if (isInRange(ch, createRange('A', 'Z')))
-    return WT_WORD;
-  if (isInRange(ch, createRange('0', '9')))
-    return WT_WORD;
-  // code below is from vim iskeyword. first one is inclusive, second is exclusive
-  // so we minus one the second one
-  if (isInRange(ch,  createRange(192, 254)))
-    return WT_WORD;
-  if (ch == '_')
-    return WT_WORD;
-
-  return WT_NON_WORD;
-}
-void editorScroll()
+  int written = 0;
+  while (length >= 255) {
+    output[written++] = (char)255;
+    length -= 255;
+  }
+  output[written++] = length;
+  return written;
+}
+
+int lzCompressBound(int size)
 {
-  if (!editor.rowscount)
-    return;
-  editor.renderx = 0;
-  if (editor.cursory < editor.rowscount)
-    editor.renderx = editorRowCursorxToRenderx(&editor.rows[editor.cursory], editor.cursorx);
+  return size + size / 255 + 16;
+}
 
-  if (editor.cursory < editor.rowoffset)
-    editor.rowoffset = editor.cursory;
-  if (editor.cursory >= editor.rowoffset + editor.screenrows)
-    editor.rowoffset = editor.cursory - editor.screenrows + 1;
+int lzCompress(const char *input, int size, char *output)
+{
+  int table[1 << LZ_HASH_BITS];
+  memset(table, -1, sizeof(table));
+  int anchor = 0, position = 0, out = 0;
+
+  while (position + LZ_MIN_MATCH <= size) {
+    unsigned int sequence;
+    memcpy(&sequence, &input[position], 4);
+    unsigned int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int candidate = table[hash];
+    table[hash] = position;
+
+    if (candidate < 0 || position - candidate > 0xffff
+        || memcmp(&input[candidate], &input[position], LZ_MIN_MATCH)) {
+      position++;
+      continue;
+    }
 
-  if (editor.cursorx < editor.coloffset)
-    editor.coloffset = editor.cursorx;
-  if (editor.cursorx >= editor.coloffset + editor.screencols)
-    editor.coloffset = editor.cursorx - editor.screencols + 1;
+    int length = LZ_MIN_MATCH;
+    while (position + length < size && input[candidate + length] == input[position + length])
+      length++;
+
+    int literals = position - anchor;
+    char *token = &output[out++];
+    *token = (literals < 15 ? literals : 15) << 4 | (length - LZ_MIN_MATCH < 15 ? length - LZ_MIN_MATCH : 15);
+    if (literals >= 15)
+      out += lzWriteLength(&output[out], literals - 15);
+    memcpy(&output[out], &input[anchor], literals);
+    out += literals;
+    int offset = position - candidate;
+    output[out++] = offset & 0xff;
+    output[out++] = offset >> 8;
+    if (length - LZ_MIN_MATCH >= 15)
+      out += lzWriteLength(&output[out], length - LZ_MIN_MATCH - 15);
+
+    position += length;
+    anchor = position;
+  }
 
-  if (editor.renderx < editor.coloffset)
-    editor.coloffset = editor.renderx;
-  if (editor.renderx >= editor.coloffset + editor.screencols)
-    editor.coloffset = editor.renderx - editor.screencols + 1;
+  int literals = size - anchor;
+  output[out++] = (literals < 15 ? literals : 15) << 4;
+  if (literals >= 15)
+    out += lzWriteLength(&output[out], literals - 15);
+  memcpy(&output[out], &input[anchor], literals);
+  return out + literals;
+}
 
-  if (editor.rows[editor.cursory].size <= editor.screencols)
-    editor.coloffset = 0;
+int lzReadLength(const unsigned char *input, int *in, int size)
+{
+  int length = 0;
+  unsigned char byte;
+  do {
+    if (*in >= size)
+      return -1;
+    byte = input[(*in)++];
+    length += byte;
+  } while (byte == 255);
+  return length;
 }
 
-void editorDrawRows(struct appendBuffer *ab)
+// returns the decompressed size, or -1 for corrupt input
+int lzDecompress(const char *compressed, int size, char *output, int capacity)
 {
-  for (int y = 0; y < editor.screenrows; y++) {
-    int filerow = y+editor.rowoffset;
-    if (filerow >= editor.rowscount) {
-      if (editor.rowscount == 0 && y == editor.screenrows/3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome), "Nim editor -- version %s", NIM_VERSION);
-        if (welcomelen > editor.screencols)
-          welcomelen = editor.screencols;
+  const unsigned char *input = (const unsigned char *)compressed;
+  int in = 0, out = 0;
+  while (in < size) {
+    int token = input[in++];
+    int literals = token >> 4;
+    if (literals == 15) {
+      int more = lzReadLength(input, &in, size);
+      if (more < 0)
+        return -1;
+      literals += more;
+    }
+    if (in + literals > size || out + literals > capacity)
+      return -1;
+    memcpy(&output[out], &input[in], literals);
+    in += literals;
+    out += literals;
+    if (in == size)
+      break;
 
-        int padding = (editor.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
+    if (in + 2 > size)
+      return -1;
+    int offset = input[in] | input[in + 1] << 8;
+    in += 2;
+    int length = (token & 15) + LZ_MIN_MATCH;
+    if ((token & 15) == 15) {
+      int more = lzReadLength(input, &in, size);
+      if (more < 0)
+        return -1;
+      length += more;
+    }
+    if (offset == 0 || offset > out || out + length > capacity)
+      return -1;
+    // byte by byte, matches may overlap what they produce
+    for (int i = 0; i < length; i++, out++)
+      output[out] = output[out - offset];
+  }
+  return out;
+}
 
-        abAppend(ab,welcome, welcomelen);
+// raw has room for the block's rawsize bytes
+void editorColdUnpack(struct ColdBlock *block, char *raw)
+{
+  if (block->compressedsize == block->rawsize)
+    memcpy(raw, block->data, block->rawsize);
+  else if (lzDecompress(block->data, block->compressedsize, raw, block->rawsize) != block->rawsize)
+    die("cold block");
+}
 
-      } else 
-        abAppend(ab, "~", 1);
-    } else {
-      int len = editor.rows[filerow].rendersize - editor.coloffset;
-      if (len < 0) 
-        len = 0;
-      if (len > editor.screencols)
-        len = editor.screencols;
-      abAppend(ab, &editor.rows[filerow].renderbuffer[editor.coloffset], len);
+// the decompressed text of a block, through a few cached blocks
+char *editorColdRaw(struct ColdBlock *block)
+{
+  struct ColdCache *slot = &coldCache[0];
+  for (int i = 0; i < COLD_CACHE_BLOCKS; i++) {
+    if (coldCache[i].block == block) {
+      coldCache[i].used = ++coldCacheClock;
+      return coldCache[i].raw;
     }
+    if (coldCache[i].used < slot->used)
+      slot = &coldCache[i];
+  }
 
-    // erase in line
-    abAppend(ab, "\x1b[K", 3);
+  nimFree(ALLOC_ROWS, slot->raw);
+  slot->raw = nimMalloc(ALLOC_ROWS, block->rawsize ? block->rawsize : 1);
+  editorColdUnpack(block, slot->raw);
+  slot->block = block;
+  slot->used = ++coldCacheClock;
+  return slot->raw;
+}
 
-    abAppend(ab, "\r\n", 2);
-  }
+void editorColdRelease(struct ColdBlock *block)
+{
+  if (--block->refs > 0)
+    return;
+  for (int i = 0; i < COLD_CACHE_BLOCKS; i++)
+    if (coldCache[i].block == block) {
+      nimFree(ALLOC_ROWS, coldCache[i].raw);
+      memset(&coldCache[i], 0, sizeof(coldCache[i]));
+    }
+  nimFree(ALLOC_ROWS, block);
 }
-int editorDrawCommand(struct appendBuffer *ab) 
+
+// text of a row without unpacking it. only valid until the next cold access.
+const char *editorRowText(EditorRow *row)
 {
+  if (row->cold)
+    return editorColdRaw(row->cold) + row->coldOffset;
+  return editorRowBuffer(row);
+}
 
-  abAppend(ab, editor.commandRow.buffer, editor.commandRow.size);
-  return editor.commandRow.size;
+void editorThawRow(EditorRow *row)
+{
+  struct ColdBlock *block = row->cold;
+  editorInitRow(row, editorColdRaw(block) + row->coldOffset, row->size);
+  editorColdRelease(block);
 }
 
-void editorDrawStatusBar(struct appendBuffer *ab) 
+// a worker thread's own way to read rows: the cold block it unpacked
+// last, so rows it only looks at stay packed, and the text of a cold row
+// copied out with a '\0' after it like a hot row has.
+struct ColdReader {
+  struct ColdBlock *block;
+  char *raw;
+  char *line;
+  int linecapacity;
+};
+
+const char *editorColdReaderText(struct ColdReader *reader, EditorRow *row)
 {
-  // invert colors
-  // abAppend(ab, "\x1b[7m", 4);
-  int len = 0;
-  if (editor.mode == MODE_COMMAND) {
-    free(editor.prompt.buffer);
-    editor.prompt.buffer = NULL;
-    editor.prompt.length=0;
-    len += editorDrawCommand(ab);
+  if (!row->cold)
+    return editorRowBuffer(row);
+  if (row->cold != reader->block) {
+    reader->raw = nimRealloc(ALLOC_OTHER, reader->raw, row->cold->rawsize ? row->cold->rawsize : 1);
+    editorColdUnpack(row->cold, reader->raw);
+    reader->block = row->cold;
   }
-  if (editor.prompt.length) {
-    abAppend(ab,editor.prompt.buffer, editor.prompt.length);
-    len+=editor.prompt.length;
+  if (row->size >= reader->linecapacity) {
+    reader->linecapacity = row->size + 1;
+    reader->line = nimRealloc(ALLOC_OTHER, reader->line, reader->linecapacity);
   }
+  memcpy(reader->line, reader->raw + row->coldOffset, row->size);
+  reader->line[row->size] = '\0';
+  return reader->line;
+}
 
-  while (len < editor.screencols) {
-    if (len == editor.screencols - 17) {
-      char buf[13];
-      int bufLength = snprintf(buf, sizeof(buf), "%d,%d", editor.cursory+1, editor.cursorx+1);
-      abAppend(ab, buf, bufLength);
-      len+=bufLength;
-    } else if (len == editor.screencols-4) {
-      char buf[4];
-      int scrollPercentage = round((double)editor.rowoffset/(editor.rowscount-editor.screenrows)*100);
-      if (editor.rowscount <= editor.screenrows)
-        scrollPercentage = -1;
-      
-      int bufLength = 0;
-      switch (scrollPercentage) {
-        case -1:
-        bufLength = snprintf(buf, sizeof(buf), "%s", "All");
-        break;
-        case 0:
-        bufLength = snprintf(buf, sizeof (buf), "%s", "Top");
-        break;
-        case 100:
-        bufLength = snprintf(buf, sizeof (buf), "%s", "Bot");
-        break;
-        default:
-        bufLength = snprintf(buf, sizeof (buf), "%d%%", scrollPercentage);
-        break;
-      }
-      abAppend(ab, buf, bufLength);
-      len+=bufLength;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
+void editorColdReaderFree(struct ColdReader *reader)
+{
+  nimFree(ALLOC_OTHER, reader->raw);
+  nimFree(ALLOC_OTHER, reader->line);
+}
+
+// raw and compressed are scratch space for a whole block
+void editorFreezeRows(int start, int end, int rawsize, char *raw, char *compressed)
+{
+  int offset = 0;
+  for (int i = start; i < end; i++) {
+    memcpy(&raw[offset], editorRowBuffer(&editor.rows[i]), editor.rows[i].size);
+    offset += editor.rows[i].size;
+  }
+
+  int compressedsize = lzCompress(raw, rawsize, compressed);
+  // incompressible text is still worth packing, it drops the render and
+  // the per row allocations
+  int stored = compressedsize < rawsize;
+  struct ColdBlock *block = nimMalloc(ALLOC_ROWS, sizeof(*block) + (stored ? compressedsize : rawsize));
+  block->refs = end - start;
+  block->rawsize = rawsize;
+  block->compressedsize = stored ? compressedsize : rawsize;
+  memcpy(block->data, stored ? compressed : raw, block->compressedsize);
+
+  offset = 0;
+  for (int i = start; i < end; i++) {
+    EditorRow *row = &editor.rows[i];
+    editorFreeRow(row);
+    row->renderbuffer = NULL;
+    row->capacity = row->rendercapacity = row->rendersize = 0;
+    row->cold = block;
+    row->coldOffset = offset;
+    offset += row->size;
+  }
+}
+
+// packs runs of rows far from the viewport. runs again whenever
+// the viewport moved far enough since the last time, in lines on screen:
+// moving over a closed fold skips its rows without looking at them.
+void editorCompressColdRows()
+{
+  if (editor.large || editor.rowscount < COLD_MIN_ROWS)
+    return;
+  int center = editorFoldLine(editor.window->cursory);
+  if (coldLastCenter >= 0 && abs(center - coldLastCenter) < COLD_DISTANCE / 2)
+    return;
+  coldLastCenter = center;
+
+  int hotStart = editor.window->cursory - COLD_DISTANCE, hotEnd = editor.window->cursory + COLD_DISTANCE;
+  int start = -1, rawsize = 0;
+  char *raw = nimMalloc(ALLOC_OTHER, COLD_BLOCK_SIZE);
+  char *compressed = nimMalloc(ALLOC_OTHER, lzCompressBound(COLD_BLOCK_SIZE));
+  struct FoldHidden *fold = editor.folds.hidden, *foldsEnd = fold + editor.folds.hiddencount;
+  for (int i = 0; i <= (int)editor.rowscount; i++) {
+    EditorRow *row = i < (int)editor.rowscount ? &editor.rows[i] : NULL;
+    // the line of a closed fold is drawn wherever the viewport is
+    while (fold < foldsEnd && fold->start < i)
+      fold++;
+    // a row longer than a block is left alone
+    int eligible = row && !row->cold && (i < hotStart || i > hotEnd)
+      && row->size <= COLD_BLOCK_SIZE && !(fold < foldsEnd && fold->start == i);
+    // the other windows can be drawn again any time too
+    for (int j = 0; j < editor.windowscount && eligible; j++)
+      eligible = editor.windows[j] == editor.window || abs(i - editor.windows[j]->rowoffset) > COLD_DISTANCE;
+    if (start >= 0 && (!eligible || i - start == COLD_BLOCK_ROWS
+                       || rawsize + row->size > COLD_BLOCK_SIZE)) {
+      editorFreezeRows(start, i, rawsize, raw, compressed);
+      start = -1;
+    }
+    if (eligible && start < 0) {
+      start = i;
+      rawsize = 0;
     }
+    if (eligible)
+      rawsize += row->size;
   }
-  // abAppend(ab, "\x1b[m", 3);
+  nimFree(ALLOC_OTHER, compressed);
+  nimFree(ALLOC_OTHER, raw);
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
 }
+// }}}
+// Registers {{{
+void editorKeyFail();
+void editorSetCursorx(int x);
 
-void editorRefreshScreen() 
+// " is the unnamed register, then come 0-9, a-z and -. -1 for any other name.
+int editorRegisterIndex(int name)
 {
-  editorScroll();
-  struct appendBuffer ab = ABUF_INIT;
+  if (name == '"')
+    return 0;
+  if (name >= '0' && name <= '9')
+    return 1 + name - '0';
+  if (name < 128 && isalpha(name))
+    return 11 + tolower(name) - 'a';
+  if (name == '-')
+    return 37;
+  return -1;
+}
 
-  // hide cursor (set mode ?25 which is hidden)
-  abAppend(&ab, "\x1b[?25l", 6);
+void editorSliceUnlink(struct Yank *yank)
+{
+  struct Yank **link = &editor.slices;
+  while (*link != yank)
+    link = &(*link)->nextSlice;
+  *link = yank->nextSlice;
+  yank->slice = 0;
+}
 
-  // clear entire screen (removed because of erase in line)
-  // abAppend(&ab, "\x1b[2J", 4);
+void editorYankRelease(struct Yank *yank)
+{
+  if (!yank || --yank->refs > 0)
+    return;
+  if (yank->slice)
+    editorSliceUnlink(yank);
+  for (int i = 0; i < yank->count; i++)
+    editorFreeRow(&yank->rows[i]);
+  nimFree(ALLOC_ROWS, yank->rows);
+  nimFree(ALLOC_OTHER, yank);
+}
 
-  // move to top left corner (1;1H cause default is 1)
-  abAppend(&ab, "\x1b[H", 3);
+void editorRegisterSet(int index, struct Yank *yank)
+{
+  yank->refs++;
+  editorYankRelease(editor.registers[index]);
+  editor.registers[index] = yank;
+}
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-
-  abAppend(&ab, "\x1b[H", 3);
-
-  // move cursor to cursor position
-  char buf[32];
-  if (editor.mode == MODE_COMMAND)
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editor.screencols, editor.commandRow.size+1);
-  else
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editor.cursory-editor.rowoffset)+1,
-                                              (editor.renderx-editor.coloffset)+1);
-  abAppend(&ab, buf, strlen(buf));
+void editorRegistersClear()
+{
+  for (int i = 0; i < REGISTERS; i++) {
+    editorYankRelease(editor.registers[i]);
+    editor.registers[i] = NULL;
+  }
+}
 
-  // show cursor (unset mode ?25 which is hidden)
-  abAppend(&ab, "\x1b[?25h", 6);
+int editorYankLines(struct Yank *yank)
+{
+  return yank->slice ? yank->bottom - yank->top + 1 : yank->count;
+}
 
-  write(STDOUT_FILENO, ab.buffer, ab.length);
-  abFree(&ab);
+// the row holding line i of a yank, and the bytes [from, to) of it that
+// are the line
+EditorRow *editorYankSource(struct Yank *yank, int i, int *from, int *to)
+{
+  if (!yank->slice) {
+    *from = 0;
+    *to = yank->rows[i].size;
+    return &yank->rows[i];
+  }
+  int y = yank->top + i;
+  // rows are read as they are, cold ones aren't unpacked
+  EditorRow *row = editor.large ? editorRowAt(y) : &editor.rows[y];
+  *from = y == yank->top && yank->type == 'v' ? yank->startx : 0;
+  *to = y == yank->bottom && yank->type == 'v' && yank->endx < row->size ? yank->endx : row->size;
+  if (*from > *to)
+    *from = *to;
+  return row;
 }
-// }}}
-// Input {{{
-int editorEndOfTheWord(int start) {
-  int end = start;
 
-  // Find current word boundary
-  while (isalnum(getCurrentRow()->buffer[end]) && end <= getCurrentRow()->size) {
-      end++;
+// line i of a yank as a row of its own, rendered by nobody. a whole cold
+// row just takes another reference to its block.
+void editorYankCopyLine(struct Yank *yank, int i, EditorRow *into)
+{
+  int from, to;
+  EditorRow *source = editorYankSource(yank, i, &from, &to);
+  if (source->cold && from == 0 && to == source->size) {
+    *into = *source;
+    into->cold->refs++;
+    return;
   }
+  editorInitRowText(into, editorRowText(source) + from, to - from);
+}
 
-  // Move cursor to end of current word
-  return end;
+// copies a slice out of the buffer
+void editorYankDetach(struct Yank *yank)
+{
+  int count = editorYankLines(yank);
+  EditorRow *rows = nimMalloc(ALLOC_ROWS, sizeof(*rows) * count);
+  for (int i = 0; i < count; i++)
+    editorYankCopyLine(yank, i, &rows[i]);
+  editorSliceUnlink(yank);
+  yank->rows = rows;
+  yank->count = count;
 }
-void editorSetCursorx(int x)
+
+// rows [top, bottom] of the buffer are about to change
+void editorRegistersChange(int top, int bottom)
 {
-  editor.cursorx = x;
-  editor.savedcursorx = x;
+  for (struct Yank *yank = editor.slices, *next; yank; yank = next) {
+    next = yank->nextSlice;
+    if (yank->top <= bottom && yank->bottom >= top)
+      editorYankDetach(yank);
+  }
 }
-void applySavedcursorx()
+
+// count rows are about to go in at at, or to be removed from there when
+// count is negative. the slices after them move along, and the ones they
+// cut into are copied out.
+void editorRegistersMove(int at, int count)
 {
-  if (editor.savedcursorx) {
-    if (getCurrentRow()->size - 1 > editor.savedcursorx) {
-      // editor.cursorx = editorRowRenderxToCursorx(currentRow, editor.savedcursorx);
-      editor.cursorx = editor.savedcursorx;
-    } else {
-      editor.cursorx = getCurrentRow()->size-1;
+  int end = count < 0 ? at - count : at;
+  for (struct Yank *yank = editor.slices, *next; yank; yank = next) {
+    next = yank->nextSlice;
+    if (yank->top < end && yank->bottom >= at)
+      editorYankDetach(yank);
+    else if (yank->top >= at) {
+      yank->top += count;
+      yank->bottom += count;
     }
   }
-
 }
-void editorHandleMoveCursorNormal (int key);
-void editorMoveCursoryToLine(int *linenumber)
-{
-  if (*linenumber > editor.rowscount)
-    *linenumber=editor.rowscount;
-
-  if (*linenumber < 0)
-    *linenumber = -(*linenumber);
 
-  editor.cursory = *linenumber-1;
-  editor.rowoffset = 0;
-  *linenumber=0;
-  // move cursor with zero key so it gets aligned
-  editorHandleMoveCursorNormal(0);
+// the marked rows are about to be removed, see editorDeleteMarkedRows
+void editorRegistersRemoveMarked(const char *marks)
+{
+  for (struct Yank *yank = editor.slices, *next; yank; yank = next) {
+    next = yank->nextSlice;
+    int before = 0, inside = 0;
+    for (int i = 0; i <= yank->bottom; i++) {
+      if (marks[i] && i < yank->top)
+        before++;
+      else if (marks[i])
+        inside = 1;
+    }
+    if (inside)
+      editorYankDetach(yank);
+    else {
+      yank->top -= before;
+      yank->bottom -= before;
+    }
+  }
 }
 
-int editorMoveCursorDown()
+struct Yank *editorYankNew(int type)
 {
-  if (editor.cursory < editor.rowscount - 1) {
-    editor.cursory++;
-    applySavedcursorx();
-    return EXIT_SUCCESS;
-  }
-  return EXIT_FAILURE;
+  struct Yank *yank = nimMalloc(ALLOC_OTHER, sizeof(*yank));
+  memset(yank, 0, sizeof(*yank));
+  yank->type = type;
+  return yank;
 }
 
-int editorMoveCursorUp()
+// text that stays in the buffer, as a slice of it. large files only keep
+// a window of rows, so there it is copied at once, if the window holds it.
+struct Yank *editorYankSlice(int type, int top, int startx, int bottom, int endx)
 {
-  if (editor.cursory > 0) {
-    editor.cursory--;
-    applySavedcursorx();
-    return EXIT_SUCCESS;
+  if (editor.large && bottom - top >= editor.large->windowCount) {
+    editorSetPrompt("Too many lines to yank in large file mode");
+    editorKeyFail();
+    return NULL;
   }
-  return EXIT_FAILURE;
+  struct Yank *yank = editorYankNew(type);
+  yank->slice = 1;
+  yank->top = top;
+  yank->bottom = bottom;
+  yank->startx = startx;
+  yank->endx = endx;
+  yank->nextSlice = editor.slices;
+  editor.slices = yank;
+  if (editor.large)
+    editorYankDetach(yank);
+  return yank;
 }
 
-void editorMoveCursorRight()
+// a row out of the buffer as a yank of one line
+struct Yank *editorYankRow(EditorRow *row)
 {
-  EditorRow *currentRow = getCurrentRow();
-
-  editor.isEndMode = 0;
-  if (currentRow && editor.cursorx < currentRow->size - 1)
-    editorSetCursorx(editor.cursorx+1);
+  struct Yank *yank = editorYankNew('V');
+  yank->rows = nimMalloc(ALLOC_ROWS, sizeof(*yank->rows));
+  yank->count = 1;
+  editorRowDropRender(row);
+  yank->rows[0] = *row;
+  return yank;
 }
 
-void editorMoveCursorLeft()
+// count rows from at go into a yank as they are, nothing is copied
+struct Yank *editorYankTakeRows(int at, int count)
 {
-  editor.isEndMode = 0;
-  if (editor.cursorx != 0) {
-    editorSetCursorx(editor.cursorx-1);
-  } 
+  if (at >= (int)editor.rowscount || !editorCanChangeLines())
+    return NULL;
+  if (count > (int)editor.rowscount - at)
+    count = editor.rowscount - at;
+  struct Yank *yank = editorYankNew('V');
+  yank->rows = nimMalloc(ALLOC_ROWS, sizeof(*yank->rows) * count);
+  yank->count = count;
+  editorDeleteRowsInto(at, count, yank->rows);
+  return yank;
 }
 
-int isRowAllSpace(EditorRow *er)
+// "A to "Z add to what the register has. text after text continues its
+// last line, anything with lines in it makes lines.
+void editorYankAppend(struct Yank *yank, struct Yank *more)
 {
-  for (int i = 0; i < er->size; i++)
-    if (!isspace(er->buffer[i]))
-      return 0;
-
-  return 1;
+  if (yank->slice)
+    editorYankDetach(yank);
+  int lines = editorYankLines(more), i = 0;
+  yank->rows = nimRealloc(ALLOC_ROWS, yank->rows, sizeof(*yank->rows) * (yank->count + lines));
+  if (yank->type == 'v' && more->type == 'v') {
+    EditorRow *last = &yank->rows[yank->count - 1];
+    if (last->cold)
+      editorThawRow(last);
+    int from, to;
+    EditorRow *source = editorYankSource(more, 0, &from, &to);
+    editorRowReserve(last, last->size + to - from + 1);
+    memcpy(&editorRowBuffer(last)[last->size], editorRowText(source) + from, to - from);
+    last->size += to - from;
+    editorRowBuffer(last)[last->size] = '\0';
+    i = 1;
+  }
+  for (; i < lines; i++)
+    editorYankCopyLine(more, i, &yank->rows[yank->count++]);
+  if (more->type == 'V')
+    yank->type = 'V';
+  editorYankRelease(more);
 }
 
-int currentSequenceLastIndex(int start) {
-  EditorRow *currentRow = getCurrentRow();
-  for (int i = start; i < currentRow->size; ++i) 
-    if (editorCharWordType(currentRow->buffer[i]) != editorCharWordType(currentRow->buffer[i+1]))
-      return i;
-
-  return currentRow->size - 1;
+// like vim with report=2, only changes of more than two lines are told
+void editorReportLines(int lines, const char *what)
+{
+  if (lines > 2)
+    editorSetPrompt("%d %s", lines, what);
 }
 
-int currentSequenceLastIndexReversed(int start) {
-  EditorRow *currentRow = getCurrentRow();
-  for (int i = start-1; i > -1; --i) 
-    if (editorCharWordType(currentRow->buffer[i]) != editorCharWordType(currentRow->buffer[i+1]))
-      return i;
-
-  return firstNonSpaceFromStart(currentRow,0);
+// where a yank goes: the register named with ", else "0 for a yank, "1
+// for deleted lines (the older ones move on towards "9) and "- for a
+// smaller delete. the unnamed register always gets it too.
+void editorRegisterStore(struct Yank *yank, int deleted)
+{
+  if (!yank)
+    return;
+  int index = editorRegisterIndex(editor.regname);
+  if (index > 0 && isupper(editor.regname) && editor.registers[index]) {
+    editorYankAppend(editor.registers[index], yank);
+    yank = editor.registers[index];
+  } else if (index > 0)
+    editorRegisterSet(index, yank);
+  else if (!deleted)
+    editorRegisterSet(editorRegisterIndex('0'), yank);
+  else if (yank->type == 'V' || editorYankLines(yank) > 1) {
+    int first = editorRegisterIndex('1');
+    editorYankRelease(editor.registers[first + 8]);
+    memmove(&editor.registers[first + 1], &editor.registers[first], sizeof(*editor.registers) * 8);
+    editor.registers[first] = NULL;
+    editorRegisterSet(first, yank);
+  } else
+    editorRegisterSet(editorRegisterIndex('-'), yank);
+  editorRegisterSet(0, yank);
 }
 
-void editorMoveCursorWordEnd()
+// the lines of a yank joined by newlines, count times over
+void editorYankText(struct Yank *yank, int count, struct appendBuffer *text)
 {
-  EditorRow *currentRow = getCurrentRow();
+  int lines = editorYankLines(yank);
+  for (int n = 0; n < count; n++) {
+    for (int i = 0; i < lines; i++) {
+      int from, to;
+      EditorRow *source = editorYankSource(yank, i, &from, &to);
+      if (i)
+        abAppend(text, "\n", 1);
+      if (to > from)
+        abAppend(text, editorRowText(source) + from, to - from);
+    }
+  }
+}
 
-  if (editor.cursorx >= currentRow->size - 1)
-    if (editorMoveCursorDown() == EXIT_SUCCESS) {
-      currentRow = getCurrentRow();
-      editor.cursorx = 0;
+// the lines go in below or above the cursor line with a single move of
+// the rows after them. whole cold rows share their block with the yank.
+void editorPutLines(struct Yank *yank, int after, int count)
+{
+  if (!editorCanChangeLines())
+    return;
+  int lines = editorYankLines(yank);
+  if ((long long)lines * count > INT_MAX - (long long)editor.rowscount) {
+    editorKeyFail();
+    return;
+  }
+  int at = after ? editor.window->cursory + 1 : editor.window->cursory;
+  if (at > (int)editor.rowscount)
+    at = editor.rowscount;
+  EditorRow *rows = editorInsertRows(at, lines * count);
+  editor.deferRender++;
+  for (int n = 0; n < count; n++) {
+    for (int i = 0; i < lines; i++) {
+      EditorRow *row = &rows[n * lines + i];
+      editorYankCopyLine(yank, i, row);
+      if (!row->cold)
+        editorUpdateRow(row);
     }
-  while(isRowAllSpace(currentRow)){
-    if (editorMoveCursorDown() == EXIT_FAILURE)
-      break;
-    editor.cursorx = 0;
-    currentRow = getCurrentRow();
   }
+  editor.deferRender--;
 
-  char currentChar = currentRow->buffer[editor.cursorx];
-  int lastIndex = currentSequenceLastIndex(editor.cursorx);
+  editor.window->cursory = at;
+  int x = firstNonSpaceFromStart(editorRowAt(at), 0);
+  editorSetCursorx(x >= 0 ? x : 0);
+  editorReportLines(lines * count, "more lines");
+}
 
-  if (editor.cursorx == lastIndex) {
-    int firstNonSpace = firstNonSpaceFromStart(currentRow, editor.cursorx+1);
-    if (firstNonSpace >= 0)
-      editor.cursorx=firstNonSpace;
-    editor.cursorx=currentSequenceLastIndex(editor.cursorx);
-  } else
-    editor.cursorx = lastIndex;
+// text goes in after or at the cursor. with newlines in it, the rest of
+// the cursor line ends up after the last of them.
+void editorPutText(struct Yank *yank, int after, int count)
+{
+  if (!getCurrentRow()) {
+    if (!editorCanChangeLines())
+      return;
+    editorAppendRow("", 0);
+  }
+  struct appendBuffer text = ABUF_INIT_FOR(ALLOC_OTHER);
+  editorYankText(yank, count, &text);
+  EditorRow *row = getCurrentRow();
+  int x = after && row->size ? editor.window->cursorx + 1 : editor.window->cursorx;
+  if (x > row->size)
+    x = row->size;
+  char *newline = text.length ? memchr(text.buffer, '\n', text.length) : NULL;
+  if (!newline) {
+    editorRowSplice(row, x, 0, text.buffer, text.length);
+    editorSetCursorx(text.length ? x + text.length - 1 : x);
+    abFree(&text);
+    return;
+  }
+  if (!editorCanChangeLines()) {
+    abFree(&text);
+    return;
+  }
 
+  int lines = 0;
+  for (char *c = newline; c; c = memchr(c + 1, '\n', text.buffer + text.length - c - 1))
+    lines++;
+  int taillength = row->size - x;
+  char *tail = nimStrndup(ALLOC_OTHER, &editorRowBuffer(row)[x], taillength);
+  editorRowSplice(row, x, taillength, text.buffer, newline - text.buffer);
+  EditorRow *rows = editorInsertRows(editor.window->cursory + 1, lines);
+  editor.deferRender++;
+  char *line = newline + 1, *end = text.buffer + text.length;
+  for (int i = 0; i < lines; i++) {
+    char *next = i < lines - 1 ? memchr(line, '\n', end - line) : end;
+    editorInitRowText(&rows[i], line, next - line);
+    if (i == lines - 1)
+      editorRowAppendString(&rows[i], tail, taillength);
+    else
+      editorUpdateRow(&rows[i]);
+    line = next + 1;
+  }
+  editor.deferRender--;
+  nimFree(ALLOC_OTHER, tail);
+  abFree(&text);
+  editorSetCursorx(x);
 }
 
-void editorMoveCursorWordEndBack()
+// a block goes in at the cursor column of as many rows as it has lines,
+// each line count times. short rows are padded up to the column, and the
+// lines to the width of the block when the row goes on after them.
+void editorPutBlock(struct Yank *yank, int after, int count)
 {
-  EditorRow *currentRow = getCurrentRow();
-  editor.isEndMode = 0;
+  EditorRow *row = getCurrentRow();
+  if (!row) {
+    editorKeyFail();
+    return;
+  }
+  int column = editorRowCursorxToRenderx(row, after && row->size ? editor.window->cursorx + 1 : editor.window->cursorx);
+  int width = 0;
+  for (int i = 0; i < yank->count; i++) {
+    int linewidth = editorRowCursorxToRenderx(&yank->rows[i], yank->rows[i].size);
+    if (linewidth > width)
+      width = linewidth;
+  }
 
-  if (editor.cursorx <= 0)
-    if (editorMoveCursorUp() == EXIT_SUCCESS) {
-      currentRow = getCurrentRow();
-      editorSetCursorx(currentRow->size-1);
+  struct appendBuffer piece = ABUF_INIT_FOR(ALLOC_OTHER);
+  editor.deferRender++;
+  for (int i = 0; i < yank->count; i++) {
+    int y = editor.window->cursory + i;
+    if (y >= (int)editor.rowscount) {
+      if (!editorCanChangeLines())
+        break;
+      editorAppendRow("", 0);
     }
-
-  char currentChar = currentRow->buffer[editor.cursorx];
-  int lastIndex = currentSequenceLastIndexReversed(editor.cursorx);
-
-  if (editor.cursorx == lastIndex) {
-    editorSetCursorx(reversedFirstNonSpace(currentRow->buffer, editor.cursorx+1));
-    editorSetCursorx(currentSequenceLastIndexReversed(editor.cursorx));
-  } else
-     editorSetCursorx(lastIndex);
-
-  while (isspace(currentRow->buffer[editor.cursorx])) {
-    editorSetCursorx(editor.cursorx-1);
-    if (editor.cursorx <= 0) {
-      break;
+    row = editorRowAt(y);
+    int rowwidth = editorRowCursorxToRenderx(row, row->size);
+    abClear(&piece);
+    for (int pad = rowwidth; pad < column; pad++)
+      abAppend(&piece, " ", 1);
+    EditorRow *line = &yank->rows[i];
+    int linewidth = editorRowCursorxToRenderx(line, line->size);
+    for (int n = 0; n < count; n++) {
+      if (line->size)
+        abAppend(&piece, editorRowText(line), line->size);
+      if (n < count - 1 || rowwidth > column)
+        for (int pad = linewidth; pad < width; pad++)
+          abAppend(&piece, " ", 1);
     }
+    int x = rowwidth > column ? editorRowColumnToCursorx(row, column) : row->size;
+    editorRowSplice(row, x, 0, piece.buffer, piece.length);
   }
+  editor.deferRender--;
+  abFree(&piece);
+  editorSetCursorx(editorRowColumnToCursorx(getCurrentRow(), column));
+}
 
-  while(isRowAllSpace(getCurrentRow())){
-    if (editorMoveCursorUp() == EXIT_FAILURE)
-      break;
-    editor.cursorx = getCurrentRow()->size-1;
+// p and P, from the register named with " or the unnamed one
+void editorPut(int after, int count)
+{
+  int name = editor.regname ? editor.regname : '"';
+  struct Yank *yank = editor.registers[editorRegisterIndex(name)];
+  if (!yank) {
+    editorSetPrompt("E353: Nothing in register %c", name);
+    editorKeyFail();
+    return;
   }
+  if (yank->type == 'V')
+    editorPutLines(yank, after, count);
+  else if (yank->type == 'v')
+    editorPutText(yank, after, count);
+  else
+    editorPutBlock(yank, after, count);
+}
+// }}}
+// Folds {{{
+int countMarker(const char *text, int size, const char *marker)
+{
+  int count = 0;
+  for (const char *c = text; (c = memmem(c, text + size - c, marker, 3)); c += 3)
+    count++;
+  return count;
+}
 
+// what row at contributes to the folds: its markers, or its indent
+// level with -1 for blank rows, which take the level around them
+int editorFoldValue(int at)
+{
+  EditorRow *row = &editor.rows[at];
+  const char *text = editorRowText(row);
+  if (editor.folds.method == FOLD_MARKER) {
+    int opens = countMarker(text, row->size, FOLD_MARKER_OPEN);
+    int closes = countMarker(text, row->size, FOLD_MARKER_CLOSE);
+    return (opens > 0xffff ? 0xffff : opens) | (closes > 0x7fff ? 0x7fff : closes) << 16;
+  }
+  int column = 0, i = 0;
+  for (; i < row->size && (text[i] == ' ' || text[i] == '\t'); i++)
+    column = text[i] == '\t' ? (column / TAB_WIDTH + 1) * TAB_WIDTH : column + 1;
+  return i == row->size ? -1 : column / editor.folds.shiftwidth;
 }
 
-void editorMoveCursorWordStartBack()
+// forgets the folds and scans every row again, like a file just opened
+void editorFoldsReset()
 {
-  if (editorCharWordType(getCurrentRow()->buffer[editor.cursorx]) 
-    != editorCharWordType(getCurrentRow()->buffer[editor.cursorx-1]))
-    editorMoveCursorWordEndBack();
+  struct Folds *folds = &editor.folds;
+  folds->count = folds->hiddencount = folds->hiddenRows = 0;
+  folds->generation++;
+  if (folds->method == FOLD_MANUAL || editor.large) {
+    nimFree(ALLOC_OTHER, folds->lines);
+    folds->lines = NULL;
+    folds->linescapacity = 0;
+    folds->stale = 0;
+    return;
+  }
+  if (!folds->lines || folds->linescapacity < (int)editor.rowscount) {
+    folds->linescapacity = editor.rowscount > 64 ? editor.rowscount : 64;
+    folds->lines = nimRealloc(ALLOC_OTHER, folds->lines, sizeof(int) * folds->linescapacity);
+  }
+  folds->rescanFrom = 0;
+  folds->rescanTo = editor.rowscount;
+  folds->changedFrom = folds->changedTo = 0;
+  folds->stale = 1;
+  folds->closeAll = 1;
+}
 
-  while (editor.cursorx > 0) {
-    if (editorCharWordType(getCurrentRow()->buffer[editor.cursorx]) != editorCharWordType(getCurrentRow()->buffer[editor.cursorx-1]))
-      break;
-    editor.cursorx--;
+// grows the rows [*from, *to) to take in [top, bottom)
+void foldsRangeAdd(int *from, int *to, int top, int bottom)
+{
+  if (*from == *to) {
+    *from = top;
+    *to = bottom;
+    return;
   }
+  if (top < *from)
+    *from = top;
+  if (bottom > *to)
+    *to = bottom;
 }
 
-void editorMoveCursorWordStart()
+// the rows [*from, *to) after count rows go in at at, or rows [at, at -
+// count) are removed
+void foldsRangeMove(int *from, int *to, int at, int count)
 {
-  EditorRow *currentRow = getCurrentRow();
+  if (*from == *to)
+    return;
+  int after = count > 0 ? at : at - count;
+  if (*from >= after)
+    *from += count;
+  else if (*from > at)
+    *from = at;
+  if (*to >= after)
+    *to += count;
+  else if (*to > at)
+    *to = at;
+}
 
-  char currentChar = currentRow->buffer[editor.cursorx];
-  if (isspace(currentChar)) {
-    int firstNonSpace = firstNonSpaceFromStart(currentRow, editor.cursorx+1);
-    if (firstNonSpace >= 0)
-      editor.cursorx=firstNonSpace;
+// rows [top, bottom] changed, they are scanned again before the folds
+// are next used
+void editorFoldsChange(int top, int bottom)
+{
+  struct Folds *folds = &editor.folds;
+  if (folds->method == FOLD_MANUAL || editor.large)
     return;
-  }
+  foldsRangeAdd(&folds->rescanFrom, &folds->rescanTo, top, bottom + 1);
+}
 
-  for (int i = editor.cursorx; i < currentRow->size; ++i) {
-    if (editorCharWordType(currentRow->buffer[i]) != editorCharWordType(currentChar)) {
-      while (isspace(currentRow->buffer[i])) {
-        i++;
-        if (i == currentRow->size-1) {
-          editorMoveCursorDown();
-          currentRow = getCurrentRow();
-        }
-      }
-      editor.cursorx = i;
-      return;
+// count rows go in at at, or are removed from there when negative. the
+// folds after them move along, so the closed ones stay closed and only
+// the folds around at are built again.
+void editorFoldsMove(int at, int count)
+{
+  struct Folds *folds = &editor.folds;
+  if (folds->method == FOLD_MANUAL || editor.large)
+    return;
+  int rows = editor.rowscount;
+  if (count > 0 && rows + count > folds->linescapacity) {
+    folds->linescapacity = (rows + count) * 2;
+    folds->lines = nimRealloc(ALLOC_OTHER, folds->lines, sizeof(int) * folds->linescapacity);
+  }
+  int from = count > 0 ? at : at - count;
+  memmove(&folds->lines[at + (count > 0 ? count : 0)], &folds->lines[from], sizeof(int) * (rows - from));
+  for (int i = 0; i < folds->count; i++) {
+    struct Fold *fold = &folds->folds[i];
+    if (fold->start >= from)
+      fold->start += count;
+    else if (fold->start >= at) {
+      fold->start = at;
+      fold->closed = 0;
     }
+    // a fold that ended in removed rows no longer reaches past them
+    if (fold->end >= from)
+      fold->end += count;
+    else if (fold->end >= at)
+      fold->end = at - 1;
   }
+  foldsRangeMove(&folds->rescanFrom, &folds->rescanTo, at, count);
+  foldsRangeMove(&folds->changedFrom, &folds->changedTo, at, count);
+  if (count > 0)
+    editorFoldsChange(at, at + count - 1);
+  foldsRangeAdd(&folds->changedFrom, &folds->changedTo, at, at + (count > 0 ? count : 1));
+}
 
-  if (editorMoveCursorDown() == EXIT_SUCCESS) {
-    int firstNonSpace = firstNonSpaceFromStart(getCurrentRow(), editor.cursorx+1);
-    if (firstNonSpace >= 0)
-      editor.cursorx=firstNonSpace;
+// the marked rows are about to be removed, see editorDeleteMarkedRows
+void editorFoldsRemoveMarked(const char *marks)
+{
+  struct Folds *folds = &editor.folds;
+  if (folds->method == FOLD_MANUAL || editor.large)
+    return;
+  int write = 0, fold = 0;
+  for (int read = 0; read < (int)editor.rowscount; read++) {
+    for (; fold < folds->count && folds->folds[fold].start == read; fold++) {
+      folds->folds[fold].start = write;
+      if (marks[read])
+        folds->folds[fold].closed = 0;
+    }
+    if (!marks[read])
+      folds->lines[write++] = folds->lines[read];
   }
+  folds->rescanFrom = folds->rescanTo = 0;
+  folds->stale = 1;
+}
 
-  while(isRowAllSpace(getCurrentRow())){
-    if (editorMoveCursorDown() == EXIT_FAILURE)
-      break;
-    editor.cursorx = 0;
+int editorFoldPush(int start, int parent)
+{
+  struct Folds *folds = &editor.folds;
+  if (folds->count == folds->capacity) {
+    folds->capacity = folds->capacity ? folds->capacity * 2 : 64;
+    folds->folds = nimRealloc(ALLOC_OTHER, folds->folds, sizeof(struct Fold) * folds->capacity);
   }
+  struct Fold *fold = &folds->folds[folds->count];
+  fold->start = start;
+  fold->end = -1;
+  fold->parent = parent;
+  fold->level = parent == -1 ? 1 : folds->folds[parent].level + 1;
+  fold->closed = 0;
+  return folds->count++;
 }
 
-void editorHandleMoveCursorNormal (int key)
+// the outermost closed folds, in order. each shows as the line of its
+// start, with before the rows hidden above it.
+void editorFoldsHide()
 {
-  EditorRow *currentRow = getCurrentRow();
+  struct Folds *folds = &editor.folds;
+  folds->hiddencount = folds->hiddenRows = 0;
+  folds->generation++;
+  int coveredEnd = -1;
+  for (int i = 0; i < folds->count; i++) {
+    struct Fold *fold = &folds->folds[i];
+    // like vim's foldminlines, a fold of one row is always shown
+    if (!fold->closed || fold->start <= coveredEnd || fold->start == fold->end)
+      continue;
+    if (folds->hiddencount == folds->hiddencapacity) {
+      folds->hiddencapacity = folds->hiddencapacity ? folds->hiddencapacity * 2 : 64;
+      folds->hidden = nimRealloc(ALLOC_OTHER, folds->hidden, sizeof(struct FoldHidden) * folds->hiddencapacity);
+    }
+    folds->hidden[folds->hiddencount++] = (struct FoldHidden){fold->start, fold->end, fold->level, folds->hiddenRows};
+    folds->hiddenRows += fold->end - fold->start;
+    coveredEnd = fold->end;
+  }
+}
 
-  switch (key) {
-    case WORD_NEXT:
-      editorMoveCursorWordStart();
-      break;
-    case WORD_BACK:
-      editorMoveCursorWordStartBack();
-      break;
-    case WORD_END:
-      editorMoveCursorWordEnd();
-      break;
-    case KEY_RIGHT:
-      editorMoveCursorRight();
-      break;
-    CASE_DOWN:
-      editorMoveCursorDown();
-      break;
-    case KEY_LEFT:
-      editorMoveCursorLeft();
-      break;
-    CASE_UP:
-      editorMoveCursorUp();
-      break;
-    case BOTTOM:
-      editor.cursory = editor.rowscount - 1;
-      break;
-    case TOP:
-      editor.cursory = 0;
-      break;
-    case KEY_LINE_FIRST:
-      editor.isEndMode = 0;
-      editor.cursorx = 0;
-      break;
-    case KEY_LINE_START:
-      editor.isEndMode = 0;
-      int firstNonSpace = firstNonSpaceFromStart(currentRow, editor.cursorx+1);
-      if (firstNonSpace >= 0)
-        editor.cursorx=firstNonSpace;
-      break;
-    case KEY_LINE_END:
-      editor.cursorx = currentRow? currentRow->size-1:0;
-      editor.isEndMode = 1;
+// builds the folds of the rows from on, where no fold is open, after the
+// ones already in folds. once past until, it stops at the first row the
+// folds before can't reach over, in the old folds from old on as well as
+// the new ones, and returns it: from there on the old folds still hold.
+int editorFoldsScan(int from, int until, struct Fold *old, int oldcount)
+{
+  struct Folds *folds = &editor.folds;
+  int rows = editor.rowscount;
+  int open = -1, previous = 0, oldAt = 0, oldCovered = -1;
+  int row = from;
+  for (; row < rows; row++) {
+    int value = folds->lines[row];
+    // with indent any row at level 0 closes what is open
+    if (row >= until && row > from && folds->method == FOLD_INDENT && value == 0)
       break;
+    if (row >= until && row > from && folds->method == FOLD_MARKER && open == -1) {
+      for (; oldAt < oldcount && old[oldAt].start < row; oldAt++)
+        if (old[oldAt].end > oldCovered)
+          oldCovered = old[oldAt].end;
+      if (oldCovered < row)
+        break;
+    }
+    if (folds->method == FOLD_MARKER) {
+      for (int i = 0; i < (value & 0xffff); i++)
+        open = editorFoldPush(row, open);
+      for (int i = 0; i < value >> 16 && open != -1; i++) {
+        folds->folds[open].end = row;
+        open = folds->folds[open].parent;
+      }
+      continue;
+    }
+    int level = value, next = row;
+    if (level < 0) {
+      while (next < rows && folds->lines[next] < 0)
+        next++;
+      int after = next < rows ? folds->lines[next] : 0;
+      level = previous < after ? previous : after;
+    }
+    while (open != -1 && folds->folds[open].level > level) {
+      folds->folds[open].end = row - 1;
+      open = folds->folds[open].parent;
+    }
+    while ((open == -1 ? 0 : folds->folds[open].level) < level)
+      open = editorFoldPush(row, open);
+    if (value < 0)
+      row = next - 1;
+    else
+      previous = level;
   }
+  for (; open != -1; open = folds->folds[open].parent)
+    folds->folds[open].end = row - 1;
+  return row;
+}
 
-  currentRow = getCurrentRow();
+int editorFoldAround(int row);
 
-  int currentRowLength = currentRow ? currentRow->size-1 : 0;
-  if (editor.cursorx > currentRowLength || editor.isEndMode)
-    editor.cursorx = currentRowLength;
+// a row before the first changed one that no fold is open over from the
+// rows before it, to build the folds again from
+int editorFoldsScanStart(int changed)
+{
+  struct Folds *folds = &editor.folds;
+  if (folds->method == FOLD_INDENT) {
+    int row = changed - 1;
+    while (row > 0 && folds->lines[row] != 0)
+      row--;
+    return row < 0 ? 0 : row;
+  }
+  // the outermost fold over the row before, which may have reached into
+  // rows that were removed
+  int fold = changed > 0 ? editorFoldAround(changed - 1) : -1;
+  while (fold != -1 && folds->folds[fold].parent != -1)
+    fold = folds->folds[fold].parent;
+  return fold == -1 ? changed : folds->folds[fold].start;
+}
 
-  // first set cursory to 0 if its below 0.
-  // so rowscount comparison be valid
-  if (editor.cursory < 0)
-    editor.cursory = 0;
+// the first fold starting at or after row
+int editorFoldFirstFrom(struct Fold *list, int count, int row)
+{
+  int low = 0, high = count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (list[middle].start < row)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
 
-  if (editor.cursorx < 0)
-    editor.cursorx = 0;
+// the folds nest, so they are a tree: in order of their start, outer
+// before inner, each pointing at the fold around it. only the folds
+// around the changed rows are built again, the ones before and after
+// them are kept.
+void editorFoldsBuild()
+{
+  struct Folds *folds = &editor.folds;
+  struct Fold *old = folds->folds;
+  int oldcount = folds->count;
+  int from = 0, until = editor.rowscount;
+  if (!folds->stale) {
+    from = editorFoldsScanStart(folds->changedFrom);
+    until = folds->changedTo;
+  }
+  folds->changedFrom = folds->changedTo = 0;
+  folds->stale = 0;
+
+  int kept = editorFoldFirstFrom(old, oldcount, from);
+  folds->capacity = oldcount > 64 ? oldcount : 64;
+  folds->folds = nimMalloc(ALLOC_OTHER, sizeof(struct Fold) * folds->capacity);
+  memcpy(folds->folds, old, sizeof(struct Fold) * kept);
+  folds->count = kept;
+  int stop = editorFoldsScan(from, until, old + kept, oldcount - kept);
+  // past the last row are only folds of rows that were removed
+  int rest = stop == (int)editor.rowscount ? oldcount
+    : kept + editorFoldFirstFrom(old + kept, oldcount - kept, stop);
+
+  // both are in order of start and then level
+  for (int i = kept, j = kept; i < folds->count; i++) {
+    struct Fold *fold = &folds->folds[i];
+    while (j < rest && (old[j].start < fold->start
+                        || (old[j].start == fold->start && old[j].level < fold->level)))
+      j++;
+    fold->closed = folds->closeAll
+      || (j < rest && old[j].start == fold->start && old[j].level == fold->level && old[j].closed);
+  }
+  folds->closeAll = 0;
+
+  // the folds after stop are inside each other only, so their parents
+  // move by as much as they do
+  int shift = folds->count - rest, restcount = oldcount - rest;
+  if (folds->count + restcount > folds->capacity) {
+    folds->capacity = folds->count + restcount;
+    folds->folds = nimRealloc(ALLOC_OTHER, folds->folds, sizeof(struct Fold) * folds->capacity);
+  }
+  memcpy(&folds->folds[folds->count], &old[rest], sizeof(struct Fold) * restcount);
+  for (int i = folds->count; i < folds->count + restcount; i++)
+    if (folds->folds[i].parent != -1)
+      folds->folds[i].parent += shift;
+  folds->count += restcount;
+  nimFree(ALLOC_OTHER, old);
+  editorFoldsHide();
+}
 
-  if (editor.cursory > editor.rowscount)
-    editor.cursory = editor.rowscount;
+// brings the folds up to date with the rows, once they are needed
+void editorFoldsUpdate()
+{
+  struct Folds *folds = &editor.folds;
+  if (folds->method == FOLD_MANUAL || editor.large)
+    return;
+  int to = folds->rescanTo < (int)editor.rowscount ? folds->rescanTo : (int)editor.rowscount;
+  for (int row = folds->rescanFrom; row < to; row++) {
+    int value = editorFoldValue(row);
+    if (value != folds->lines[row]) {
+      folds->lines[row] = value;
+      foldsRangeAdd(&folds->changedFrom, &folds->changedTo, row, row + 1);
+    }
+  }
+  folds->rescanFrom = folds->rescanTo = 0;
+  if (folds->stale || folds->changedFrom != folds->changedTo)
+    editorFoldsBuild();
+}
 
+// the last hidden range starting at or before row, or -1
+int editorFoldHiddenAt(int row)
+{
+  struct Folds *folds = &editor.folds;
+  int low = 0, high = folds->hiddencount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (folds->hidden[middle].start <= row)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low - 1;
+}
 
-  while (editor.cursory + editor.rowoffset > editor.rowscount && editor.rowoffset > 0)
-    editor.rowoffset--;
+// the closed fold showing as row's line, or NULL
+struct FoldHidden *editorFoldClosedAt(int row)
+{
+  editorFoldsUpdate();
+  int i = editorFoldHiddenAt(row);
+  if (i < 0 || editor.folds.hidden[i].start != row)
+    return NULL;
+  return &editor.folds.hidden[i];
+}
 
+// the row on screen for row: the start of the closed fold hiding it
+int editorFoldShown(int row)
+{
+  editorFoldsUpdate();
+  int i = editorFoldHiddenAt(row);
+  if (i < 0 || row > editor.folds.hidden[i].end)
+    return row;
+  return editor.folds.hidden[i].start;
+}
 
+// how many lines are shown above row
+int editorFoldLine(int row)
+{
+  editorFoldsUpdate();
+  int i = editorFoldHiddenAt(row);
+  if (i < 0)
+    return row;
+  struct FoldHidden *hidden = &editor.folds.hidden[i];
+  if (row <= hidden->end)
+    return hidden->start - hidden->before;
+  return row - hidden->before - (hidden->end - hidden->start);
 }
 
-void editorHandleNormalMode(char keyChar) {
-  if (editor.findFlag) {
-    do {
-      int firstOfChar  = findFirstOfCharacter(getCurrentRow(), editor.cursorx+1, keyChar);
-      if (firstOfChar != -1)
-        editor.cursorx = firstOfChar;
-    } while (editor.numberSequenceInt-- > 0);
-    editor.findFlag = 0;
-    editor.numberSequenceInt = 0;
-    return;
+// the row shown as the line-th line
+int editorFoldRow(int line)
+{
+  editorFoldsUpdate();
+  struct Folds *folds = &editor.folds;
+  int low = 0, high = folds->hiddencount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (folds->hidden[middle].start - folds->hidden[middle].before <= line)
+      low = middle + 1;
+    else
+      high = middle;
   }
-  if (isdigit(keyChar)) {
-    if (keyChar != '0' || editor.numberSequence.length > 0) {
-      abAppend(&editor.numberSequence, &keyChar, 1);
-      return;
-    }
-  } else {
+  if (!low)
+    return line;
+  struct FoldHidden *hidden = &folds->hidden[low - 1];
+  int at = hidden->start - hidden->before;
+  return line == at ? hidden->start : hidden->end + line - at;
+}
+
+// the lines there are to show
+int editorFoldLines()
+{
+  editorFoldsUpdate();
+  return editor.rowscount - editor.folds.hiddenRows;
+}
+
+// the innermost fold around row, or -1
+int editorFoldAround(int row)
+{
+  struct Folds *folds = &editor.folds;
+  int low = 0, high = folds->count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (folds->folds[middle].start <= row)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  int fold = low - 1;
+  while (fold != -1 && folds->folds[fold].end < row)
+    fold = folds->folds[fold].parent;
+  return fold;
+}
+
+// the outermost closed fold around row, or -1
+int editorFoldClosedAround(int row)
+{
+  int closed = -1;
+  for (int fold = editorFoldAround(row); fold != -1; fold = editor.folds.folds[fold].parent)
+    if (editor.folds.folds[fold].closed)
+      closed = fold;
+  return closed;
+}
+
+// widens rows top to bottom over the closed folds at either end: like in
+// vim, a linewise operator takes all the rows of a closed fold
+void editorFoldWiden(int *top, int *bottom)
+{
+  *top = editorFoldShown(*top);
+  struct FoldHidden *fold = editorFoldClosedAt(editorFoldShown(*bottom));
+  if (fold && fold->end > *bottom)
+    *bottom = fold->end;
+}
+
+// the rows of count lines on screen from row's on, for dd and yy
+void editorFoldLinesSpan(int row, int count, int *top, int *bottom)
+{
+  int line = editorFoldLine(row), last = editorFoldLines() - 1;
+  *top = *bottom = row;
+  if (last < 0)
+    return;
+  *bottom = editorFoldRow(line + count - 1 < last ? line + count - 1 : last);
+  editorFoldWiden(top, bottom);
+}
+
+// opens the closed folds that hide row
+void editorFoldReveal(int row)
+{
+  if (editorFoldShown(row) == row)
+    return;
+  for (int fold = editorFoldAround(row); fold != -1; fold = editor.folds.folds[fold].parent)
+    if (editor.folds.folds[fold].start != row)
+      editor.folds.folds[fold].closed = 0;
+  editorFoldsHide();
+}
+
+// zo, zc, za, zR and zM
+void editorFoldCommand(int command)
+{
+  struct Folds *folds = &editor.folds;
+  editorFoldsUpdate();
+  if (command == FOLD_OPEN_ALL || command == FOLD_CLOSE_ALL) {
+    for (int i = 0; i < folds->count; i++)
+      folds->folds[i].closed = command == FOLD_CLOSE_ALL;
+    editorFoldsHide();
+    editor.window->cursory = editorFoldShown(editor.window->cursory);
+    return;
+  }
+  int fold = editorFoldAround(editor.window->cursory);
+  if (fold == -1) {
+    editorSetPrompt("E490: No fold found");
+    editorKeyFail();
+    return;
+  }
+  int closed = editorFoldClosedAround(editor.window->cursory);
+  if (command == FOLD_TOGGLE)
+    command = closed == -1 ? FOLD_CLOSE : FOLD_OPEN;
+  if (command == FOLD_OPEN && closed != -1)
+    folds->folds[closed].closed = 0;
+  // zc on a closed fold closes the one around it
+  if (command == FOLD_CLOSE && closed == -1)
+    folds->folds[fold].closed = 1;
+  else if (command == FOLD_CLOSE && folds->folds[closed].parent != -1)
+    folds->folds[folds->folds[closed].parent].closed = 1;
+  editorFoldsHide();
+  editor.window->cursory = editorFoldShown(editor.window->cursory);
+}
+
+// like vim's foldtext(): the first line without its markers and
+// comment ends, after dashes for the level and the lines it hides. it is
+// filled with dashes to cols.
+void editorFoldDrawRow(struct appendBuffer *ab, struct FoldHidden *fold, int cols)
+{
+  EditorRow *row = editorRowAt(fold->start);
+  const char *text = editorRowBuffer(row);
+  const char dashes[] = "--------------------------------";
+  char line[256];
+  // "+-", a dash per level and the count in three columns. by hand, as
+  // snprintf was most of the time a screen of folds took to draw.
+  int length = 2 + (fold->level < 32 ? fold->level : 32);
+  memcpy(line, "+-", 2);
+  memcpy(line + 2, dashes, length - 2);
+  char digits[12];
+  int digitscount = 0;
+  for (int count = fold->end - fold->start + 1; count || !digitscount; count /= 10)
+    digits[digitscount++] = '0' + count % 10;
+  for (int i = digitscount; i < 3; i++)
+    line[length++] = ' ';
+  while (digitscount)
+    line[length++] = digits[--digitscount];
+  memcpy(line + length, " lines: ", 8);
+  length += 8;
+  int i = scanClassRun(text, 0, row->size, WT_SPACE), textStart = length;
+  int limit = cols < (int)sizeof(line) ? cols : (int)sizeof(line);
+  while (i < row->size && length < limit) {
+    char c = text[i];
+    if (c == '{' && i + 3 <= row->size && !memcmp(&text[i], FOLD_MARKER_OPEN, 3)) {
+      for (i += 3; i < row->size && isdigit((unsigned char)text[i]); i++)
+        ;
+    } else if ((c == '/' || c == '*') && i + 2 <= row->size && (!memcmp(&text[i], "/*", 2) || !memcmp(&text[i], "*/", 2)))
+      i += 2;
+    else if (length == textStart && (c == ' ' || c == '\t'))
+      i++;
+    else {
+      line[length++] = c == '\t' ? ' ' : c;
+      i++;
+    }
+  }
+  while (length > textStart && line[length - 1] == ' ')
+    length--;
+  if (length > cols)
+    length = cols;
+  abAppend(ab, line, length);
+  while (length < cols) {
+    int fill = cols - length < 32 ? cols - length : 32;
+    abAppend(ab, dashes, fill);
+    length += fill;
+  }
+}
+// }}}
+// Windows {{{
+struct Frame *editorFrameNew(struct Window *window)
+{
+  struct Frame *frame = nimMalloc(ALLOC_OTHER, sizeof(*frame));
+  *frame = (struct Frame){window, 0, NULL, NULL, 0};
+  if (window)
+    window->frame = frame;
+  return frame;
+}
+
+void editorFrameFree(struct Frame *frame)
+{
+  for (int i = 0; i < frame->count; i++)
+    editorFrameFree(frame->children[i]);
+  nimFree(ALLOC_OTHER, frame->children);
+  nimFree(ALLOC_OTHER, frame->window);
+  nimFree(ALLOC_OTHER, frame);
+}
+
+void editorFrameInsert(struct Frame *parent, int at, struct Frame *child)
+{
+  parent->children = nimRealloc(ALLOC_OTHER, parent->children, sizeof(struct Frame *) * (parent->count + 1));
+  memmove(&parent->children[at + 1], &parent->children[at], sizeof(struct Frame *) * (parent->count - at));
+  parent->children[at] = child;
+  parent->count++;
+  child->parent = parent;
+}
+
+int editorFrameIndex(struct Frame *frame)
+{
+  int at = 0;
+  while (frame->parent->children[at] != frame)
+    at++;
+  return at;
+}
+
+// the one window, like a file just opened
+void editorWindowsInit()
+{
+  if (editor.layout)
+    editorFrameFree(editor.layout);
+  struct Window *window = nimMalloc(ALLOC_OTHER, sizeof(*window));
+  memset(window, 0, sizeof(*window));
+  window->damageAll = 1;
+  editor.layout = editorFrameNew(window);
+  editor.window = window;
+  editor.windowscount = 1;
+  if (!editor.windowscapacity) {
+    editor.windowscapacity = 8;
+    editor.windows = nimMalloc(ALLOC_OTHER, sizeof(struct Window *) * editor.windowscapacity);
+  }
+  editor.windows[0] = window;
+}
+
+// gives frame the cells rows by cols at top, left, and returns where the
+// windows after its own go in editor.windows. a window only has a status
+// line when there are others, the last line of the screen is the status bar.
+int editorLayoutFrame(struct Frame *frame, int at, int top, int left, int rows, int cols)
+{
+  if (frame->window) {
+    struct Window *window = frame->window;
+    window->top = top;
+    window->left = left;
+    window->rows = editor.windowscount > 1 && rows > 1 ? rows - 1 : rows;
+    window->cols = cols;
+    window->damageAll = 1;
+    editor.windows[at] = window;
+    return at + 1;
+  }
+  // frames side by side are split by a column of |
+  int size = frame->vertical ? cols - (frame->count - 1) : rows;
+  for (int i = 0; i < frame->count; i++) {
+    int share = size / frame->count + (i < size % frame->count);
+    if (share < 1)
+      share = 1;
+    if (frame->vertical) {
+      at = editorLayoutFrame(frame->children[i], at, top, left, rows, share);
+      left += share + 1;
+    } else {
+      at = editorLayoutFrame(frame->children[i], at, top, left, share, cols);
+      top += share;
+    }
+  }
+  return at;
+}
+
+void editorLayout()
+{
+  editorLayoutFrame(editor.layout, 0, 0, 0, editor.screenrows, editor.screencols);
+  editor.dirty = 1;
+}
+
+// the rows and columns a frame has, with the status lines and separators
+// of the windows in it
+void editorFrameSize(struct Frame *frame, int *rows, int *cols)
+{
+  struct Frame *first = frame, *last = frame;
+  while (!first->window)
+    first = first->children[0];
+  while (!last->window)
+    last = last->children[last->count - 1];
+  *rows = last->window->top + last->window->rows + (editor.windowscount > 1) - first->window->top;
+  *cols = last->window->left + last->window->cols - first->window->left;
+}
+
+// :split and :vsplit. like vim's, the new window goes above or left of
+// the current one, with the same view of the rows, and takes the cursor.
+void editorWindowSplit(int vertical)
+{
+  struct Window *current = editor.window;
+  struct Frame *frame = current->frame, *parent = frame->parent;
+  // next to the others in a frame split the same way, or in a new one
+  struct Frame *container = parent && parent->vertical == vertical ? parent : frame;
+  int count = container == parent ? parent->count + 1 : 2, rows, cols;
+  editorFrameSize(container, &rows, &cols);
+  // every window keeps a row and its status line, or a column
+  if (vertical ? cols - (count - 1) < count : rows < 2 * count) {
+    editorSetPrompt("E36: Not enough room");
+    editorKeyFail();
+    return;
+  }
+
+  if (container == frame) {
+    struct Frame *leaf = editorFrameNew(current);
+    frame->window = NULL;
+    frame->vertical = vertical;
+    editorFrameInsert(frame, 0, leaf);
+    frame = leaf;
+  }
+  struct Window *window = nimMalloc(ALLOC_OTHER, sizeof(*window));
+  *window = *current;
+  editorFrameInsert(frame->parent, editorFrameIndex(frame), editorFrameNew(window));
+  if (editor.windowscount == editor.windowscapacity) {
+    editor.windowscapacity *= 2;
+    editor.windows = nimRealloc(ALLOC_OTHER, editor.windows, sizeof(struct Window *) * editor.windowscapacity);
+  }
+  editor.windowscount++;
+  editor.window = window;
+  editorLayout();
+}
+
+// makes window the current one. its row may have changed since it was.
+void editorWindowCurrent(struct Window *window)
+{
+  editor.window = window;
+  if (!editor.hex && editor.rowscount) {
+    if (window->cursory >= editor.rowscount)
+      window->cursory = editor.rowscount - 1;
+    EditorRow *row = getCurrentRow();
+    if (window->cursorx >= row->size)
+      window->cursorx = row->size ? row->size - 1 : 0;
+  }
+}
+
+void editorWindowGo(struct Window *window)
+{
+  if (!window) {
+    editorKeyFail();
+    return;
+  }
+  // the old one may have had the perf overlay or a selection
+  editor.window->damageAll = 1;
+  editorWindowCurrent(window);
+}
+
+// the window in frame nearest to its first (or last) one
+struct Window *editorFrameWindow(struct Frame *frame, int last)
+{
+  while (!frame->window)
+    frame = frame->children[last ? frame->count - 1 : 0];
+  return frame->window;
+}
+
+// :close. the cursor goes to the window above or left of it, like vim.
+void editorWindowClose(struct Window *window)
+{
+  if (editor.windowscount == 1) {
+    editorSetPrompt("E444: Cannot close last window");
+    editorKeyFail();
+    return;
+  }
+  struct Frame *frame = window->frame, *parent = frame->parent;
+  int at = editorFrameIndex(frame);
+  memmove(&parent->children[at], &parent->children[at + 1], sizeof(struct Frame *) * (parent->count - at - 1));
+  parent->count--;
+  editorFrameFree(frame);
+  editor.windowscount--;
+  if (window == editor.window)
+    editorWindowCurrent(at ? editorFrameWindow(parent->children[at - 1], 1) : editorFrameWindow(parent->children[0], 0));
+
+  // a split of one frame is that frame
+  if (parent->count == 1) {
+    struct Frame *child = parent->children[0];
+    nimFree(ALLOC_OTHER, parent->children);
+    struct Frame *grandparent = parent->parent;
+    *parent = *child;
+    parent->parent = grandparent;
+    if (parent->window)
+      parent->window->frame = parent;
+    for (int i = 0; i < parent->count; i++)
+      parent->children[i]->parent = parent;
+    nimFree(ALLOC_OTHER, child);
+    // and one split the same way as the frame around it joins that
+    if (!parent->window && grandparent && grandparent->vertical == parent->vertical) {
+      int index = editorFrameIndex(parent);
+      memmove(&grandparent->children[index], &grandparent->children[index + 1],
+              sizeof(struct Frame *) * (grandparent->count - index - 1));
+      grandparent->count--;
+      for (int i = 0; i < parent->count; i++)
+        editorFrameInsert(grandparent, index + i, parent->children[i]);
+      nimFree(ALLOC_OTHER, parent->children);
+      nimFree(ALLOC_OTHER, parent);
+    }
+  }
+  editorLayout();
+}
+
+// :only
+void editorWindowOnly()
+{
+  struct Window *window = editor.window;
+  window->frame->window = NULL;
+  editorFrameFree(editor.layout);
+  editor.layout = editorFrameNew(window);
+  editor.windowscount = 1;
+  editorLayout();
+}
+
+// :q and Ctrl-W q close the window, and quit with the last one
+void editorQuit();
+void editorWindowQuit()
+{
+  if (editor.windowscount > 1)
+    editorWindowClose(editor.window);
+  else
+    editorQuit();
+}
+
+// the window next to the current one in a direction, beside the cursor
+struct Window *editorWindowBeside(int dx, int dy)
+{
+  struct Window *current = editor.window;
+  int y = current->top + editorFoldLine(current->cursory) - editorFoldLine(current->rowoffset);
+  int x = current->left + current->renderx - current->coloffset;
+  for (int i = 0; i < editor.windowscount; i++) {
+    struct Window *window = editor.windows[i];
+    // the status line under a window and the | right of it are its too
+    int beside = dx ? window->top <= y && y <= window->top + window->rows
+                    : window->left <= x && x <= window->left + window->cols;
+    if (beside && ((dx > 0 && window->left == current->left + current->cols + 1)
+                   || (dx < 0 && window->left + window->cols + 1 == current->left)
+                   || (dy > 0 && window->top == current->top + current->rows + 1)
+                   || (dy < 0 && window->top + window->rows + 1 == current->top)))
+      return window;
+  }
+  return NULL;
+}
+
+int editorWindowIndex(struct Window *window)
+{
+  int at = 0;
+  while (editor.windows[at] != window)
+    at++;
+  return at;
+}
+
+void editorWindowCommand(int command)
+{
+  int at = editorWindowIndex(editor.window), count = editor.windowscount;
+  switch (command) {
+    case WINDOW_SPLIT:
+    case WINDOW_VSPLIT:
+      editorWindowSplit(command == WINDOW_VSPLIT);
+      break;
+    case WINDOW_NEXT:
+      editorWindowGo(editor.windows[(at + 1) % count]);
+      break;
+    case WINDOW_PREVIOUS:
+      editorWindowGo(editor.windows[(at + count - 1) % count]);
+      break;
+    case WINDOW_LEFT:
+      editorWindowGo(editorWindowBeside(-1, 0));
+      break;
+    case WINDOW_DOWN:
+      editorWindowGo(editorWindowBeside(0, 1));
+      break;
+    case WINDOW_UP:
+      editorWindowGo(editorWindowBeside(0, -1));
+      break;
+    case WINDOW_RIGHT:
+      editorWindowGo(editorWindowBeside(1, 0));
+      break;
+    case WINDOW_CLOSE:
+      editorWindowClose(editor.window);
+      break;
+    case WINDOW_ONLY:
+      editorWindowOnly();
+      break;
+    case WINDOW_QUIT:
+      editorWindowQuit();
+      break;
+  }
+}
+
+void editorDamageWindowRows(struct Window *window, int from, int to)
+{
+  if (window->damageFrom == window->damageTo) {
+    window->damageFrom = from;
+    window->damageTo = to;
+    return;
+  }
+  if (from < window->damageFrom)
+    window->damageFrom = from;
+  if (to > window->damageTo)
+    window->damageTo = to;
+}
+
+// count rows are about to be inserted at at, or removed from it when
+// negative. the other windows keep showing the same rows, and only the
+// part of a window the rows move in is drawn again.
+void editorWindowsMove(int at, int count)
+{
+  int end = editor.rowscount + (count > 0 ? count : 0);
+  // an empty buffer has the welcome message in every window
+  if (!editor.rowscount || !(editor.rowscount + count))
+    editorDamageAll();
+  for (int i = 0; i < editor.windowscount; i++) {
+    struct Window *window = editor.windows[i];
+    if (window != editor.window && window->rowoffset >= at && window->rowoffset >= at - count) {
+      window->rowoffset += count;
+      window->drawnRowoffset += count;
+    } else {
+      if (window != editor.window && window->rowoffset >= at)
+        window->rowoffset = at;
+      editorDamageWindowRows(window, at, end);
+    }
+    if (window == editor.window || window->cursory < at)
+      continue;
+    if (count < 0 && window->cursory < at - count)
+      window->cursory = at;
+    else
+      window->cursory += count;
+  }
+  editor.dirty = 1;
+}
+
+// the marked rows are about to be removed in one go, see
+// editorDeleteMarkedRows. like above, the other windows keep their rows.
+void editorWindowsRemoveMarked(const char *marks)
+{
+  int rows = editor.rowscount, marked = 0;
+  for (int row = 0; row < rows; row++)
+    marked += marks[row];
+  if (marked == rows)
+    editorDamageAll();
+  for (int i = 0; i < editor.windowscount; i++) {
+    struct Window *window = editor.windows[i];
+    int top = window == editor.window || window->rowoffset > rows ? 0 : window->rowoffset;
+    int before = 0, first = top;
+    for (int row = 0; row < top; row++)
+      before += marks[row];
+    while (first < rows && !marks[first])
+      first++;
+    // rows move from the first one removed in the window on
+    if (first < rows)
+      editorDamageWindowRows(window, first - before, rows);
+    if (window == editor.window)
+      continue;
+    window->rowoffset -= before;
+    window->drawnRowoffset -= before;
+    int cursorBefore = 0;
+    for (int row = 0; row < window->cursory && row < rows; row++)
+      cursorBefore += marks[row];
+    window->cursory -= cursorBefore;
+  }
+  editor.dirty = 1;
+}
+// }}}
+// Words {{{
+int editorWorkersFor(int rows);
+void editorRunWorkers(void *workers, size_t size, int count, void *(*run)(void *));
+
+// fnv-1a
+unsigned int wordHash(const char *s, int length)
+{
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)s[i]) * 16777619u;
+  return hash;
+}
+
+// the next word of text from *at on: returns its start, with *at after
+// it, or -1 when there are no more
+int wordNext(const char *text, int size, int *at)
+{
+  int start = *at;
+  while (start < size && wordClasses[(unsigned char)text[start]] != WT_WORD)
+    start++;
+  if (start == size)
+    return -1;
+  *at = scanClassRun(text, start, size, WT_WORD);
+  return start;
+}
+
+void editorWordsReset()
+{
+  struct Words *words = &editor.words;
+  nimFree(ALLOC_OTHER, words->nodes);
+  nimFree(ALLOC_OTHER, words->table);
+  memset(words, 0, sizeof(*words));
+}
+
+int editorWordsNewNode(int parent, char c)
+{
+  struct Words *words = &editor.words;
+  int node = words->freeNode;
+  if (node >= 0)
+    words->freeNode = words->nodes[node].next;
+  else {
+    if (words->nodescount == words->nodescapacity) {
+      words->nodescapacity = words->nodescapacity ? words->nodescapacity * 2 : 1024;
+      words->nodes = nimRealloc(ALLOC_OTHER, words->nodes, sizeof(struct WordNode) * words->nodescapacity);
+    }
+    node = words->nodescount++;
+  }
+  words->nodes[node] = (struct WordNode){parent, -1, -1, 0, 0, 0, c};
+  return node;
+}
+
+// the child of node for c, -1 when there is none and make isn't set
+int editorWordsChild(int node, char c, int make)
+{
+  struct Words *words = &editor.words;
+  int previous = -1, child = words->nodes[node].child;
+  while (child >= 0 && (unsigned char)words->nodes[child].c < (unsigned char)c) {
+    previous = child;
+    child = words->nodes[child].next;
+  }
+  int found = child >= 0 && words->nodes[child].c == c;
+  if (found || !make)
+    return found ? child : -1;
+  int made = editorWordsNewNode(node, c);
+  words->nodes[made].next = child;
+  if (previous < 0)
+    words->nodes[node].child = made;
+  else
+    words->nodes[previous].next = made;
+  return made;
+}
+
+// no word goes through node any more, so neither does one through its
+// children, which were freed before it
+void editorWordsFreeNode(int node)
+{
+  struct Words *words = &editor.words;
+  int *link = &words->nodes[words->nodes[node].parent].child;
+  while (*link != node)
+    link = &words->nodes[*link].next;
+  *link = words->nodes[node].next;
+  words->nodes[node].next = words->freeNode;
+  words->freeNode = node;
+}
+
+// whether the word ending at node is s
+int editorWordsIs(int node, const char *s, int length)
+{
+  struct WordNode *nodes = editor.words.nodes;
+  while (length > 0 && node > 0 && nodes[node].c == s[length - 1]) {
+    node = nodes[node].parent;
+    length--;
+  }
+  return !length && !node;
+}
+
+void editorWordsTableResize(int capacity)
+{
+  struct Words *words = &editor.words;
+  int *old = words->table, oldcapacity = words->tablecapacity;
+  unsigned int mask = capacity - 1;
+  words->table = nimMalloc(ALLOC_OTHER, sizeof(int) * capacity);
+  memset(words->table, -1, sizeof(int) * capacity);
+  words->tablecapacity = capacity;
+  for (int i = 0; i < oldcapacity; i++) {
+    if (old[i] < 0)
+      continue;
+    unsigned int j = words->nodes[old[i]].hash & mask;
+    while (words->table[j] >= 0)
+      j = (j + 1) & mask;
+    words->table[j] = old[i];
+  }
+  nimFree(ALLOC_OTHER, old);
+}
+
+// the slot of word s, or the empty one it goes in
+int editorWordsSlot(const char *s, int length, unsigned int hash)
+{
+  struct Words *words = &editor.words;
+  unsigned int mask = words->tablecapacity - 1;
+  for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+    int node = words->table[i];
+    if (node < 0 || (words->nodes[node].hash == hash && editorWordsIs(node, s, length)))
+      return i;
+  }
+}
+
+// the words after it that couldn't have their own slot while it was
+// taken move back, so every word is found before the first empty slot
+void editorWordsTableRemove(unsigned int slot)
+{
+  struct Words *words = &editor.words;
+  unsigned int mask = words->tablecapacity - 1;
+  for (unsigned int i = (slot + 1) & mask; words->table[i] >= 0; i = (i + 1) & mask) {
+    unsigned int home = words->nodes[words->table[i]].hash & mask;
+    if (((i - home) & mask) >= ((i - slot) & mask)) {
+      words->table[slot] = words->table[i];
+      slot = i;
+    }
+  }
+  words->table[slot] = -1;
+  words->tablecount--;
+}
+
+// count more occurrences of word s, or fewer when negative. a word seen
+// before is found through the table, a new one goes down the trie.
+void editorWordsAdd(const char *s, int length, int count)
+{
+  struct Words *words = &editor.words;
+  if (length > WORDS_MAX_LENGTH)
+    return;
+  if (words->tablecount * 2 >= words->tablecapacity)
+    editorWordsTableResize(words->tablecapacity * 2);
+  unsigned int hash = wordHash(s, length);
+  int slot = editorWordsSlot(s, length, hash);
+  int node = words->table[slot];
+  if (node < 0) {
+    if (count < 0)
+      return;
+    node = 0;
+    for (int i = 0; i < length; i++)
+      node = editorWordsChild(node, s[i], 1);
+    words->nodes[node].hash = hash;
+    words->table[slot] = node;
+    words->tablecount++;
+  }
+  words->nodes[node].count += count;
+  if (!words->nodes[node].count)
+    editorWordsTableRemove(slot);
+  while (node >= 0) {
+    int parent = words->nodes[node].parent;
+    words->nodes[node].below += count;
+    if (node && !words->nodes[node].below)
+      editorWordsFreeNode(node);
+    node = parent;
+  }
+}
+
+// counts the words of every row again, from the first one on
+void editorWordsStart()
+{
+  struct Words *words = &editor.words;
+  editorWordsReset();
+  if (editor.large || editor.hex)
+    return;
+  words->built = 1;
+  words->freeNode = -1;
+  editorWordsNewNode(-1, 0);
+  editorWordsTableResize(1024);
+}
+
+void editorWordsRows(int from, int to, int count)
+{
+  if (to > editor.words.counted)
+    to = editor.words.counted;
+  for (int i = from; i < to; i++) {
+    const char *text = editorRowText(&editor.rows[i]);
+    for (int at = 0, start; (start = wordNext(text, editor.rows[i].size, &at)) >= 0;)
+      editorWordsAdd(text + start, at - start, count);
+  }
+}
+
+// when this many rows change at once, and more than half of them, the
+// words are counted again from scratch instead
+int editorWordsRecount(int rows)
+{
+  if (rows <= WORDS_RECOUNT_ROWS || rows * 2 <= (int)editor.rowscount)
+    return 0;
+  editorWordsStart();
+  return 1;
+}
+
+// rows [top, bottom] are about to change. their words are taken out until
+// the change is done, and those of the rows between them and the rows
+// already pending too, as one range is kept.
+void editorWordsChange(int top, int bottom)
+{
+  struct Words *words = &editor.words;
+  if (!words->built)
+    return;
+  int from = top, to = bottom + 1;
+  if (words->pendingFrom == words->pendingTo) {
+    if (editorWordsRecount(to - from))
+      return;
+    editorWordsRows(from, to, -1);
+    words->pendingFrom = from;
+    words->pendingTo = to;
+    return;
+  }
+  if (editorWordsRecount((to > words->pendingTo ? to : words->pendingTo)
+                         - (from < words->pendingFrom ? from : words->pendingFrom)))
+    return;
+  if (from < words->pendingFrom) {
+    editorWordsRows(from, words->pendingFrom, -1);
+    words->pendingFrom = from;
+  }
+  if (to > words->pendingTo) {
+    editorWordsRows(words->pendingTo, to, -1);
+    words->pendingTo = to;
+  }
+}
+
+// count rows go in at at, or are removed from there when negative. new
+// rows are pending, removed ones that were counted are taken out.
+void editorWordsMove(int at, int count)
+{
+  struct Words *words = &editor.words;
+  if (!words->built)
+    return;
+  int from = words->pendingFrom, to = words->pendingTo;
+  if (count < 0) {
+    int end = at - count;
+    if (editorWordsRecount(-count))
+      return;
+    if (from == to)
+      editorWordsRows(at, end, -1);
+    else {
+      if (at < from)
+        editorWordsRows(at, end < from ? end : from, -1);
+      if (end > to)
+        editorWordsRows(at > to ? at : to, end, -1);
+    }
+    from = from >= end ? from + count : from > at ? at : from;
+    to = to >= end ? to + count : to > at ? at : to;
+    words->counted = words->counted >= end ? words->counted + count
+      : words->counted > at ? at : words->counted;
+  } else if (from == to) {
+    from = at;
+    to = at + count;
+  } else if (to < at) {
+    if (editorWordsRecount(at + count - from))
+      return;
+    editorWordsRows(to, at, -1);
+    to = at + count;
+  } else if (from > at) {
+    if (editorWordsRecount(to + count - at))
+      return;
+    editorWordsRows(at, from, -1);
+    from = at;
+    to += count;
+  } else
+    to += count;
+  if (count > 0 && at <= words->counted)
+    words->counted += count;
+  words->pendingFrom = from;
+  words->pendingTo = to;
+}
+
+// the marked rows are about to be removed, see editorDeleteMarkedRows
+void editorWordsRemoveMarked(const char *marks)
+{
+  struct Words *words = &editor.words;
+  if (!words->built)
+    return;
+  int rows = editor.rowscount, marked = 0;
+  for (int row = 0; row < rows; row++)
+    marked += marks[row];
+  if (editorWordsRecount(marked))
+    return;
+  int beforeFrom = 0, beforeTo = 0, beforeCounted = 0;
+  for (int row = 0; row < rows; row++) {
+    if (!marks[row])
+      continue;
+    if (row < words->pendingFrom || row >= words->pendingTo)
+      editorWordsRows(row, row + 1, -1);
+    beforeFrom += row < words->pendingFrom;
+    beforeTo += row < words->pendingTo;
+    beforeCounted += row < words->counted;
+  }
+  words->pendingFrom -= beforeFrom;
+  words->pendingTo -= beforeTo;
+  words->counted -= beforeCounted;
+}
+
+// counts the words of the rows that changed. runs after every key, so
+// only the rows the key changed are pending.
+void editorWordsFlush()
+{
+  struct Words *words = &editor.words;
+  if (!words->built || words->pendingFrom == words->pendingTo)
+    return;
+  editorWordsRows(words->pendingFrom, words->pendingTo, 1);
+  words->pendingFrom = words->pendingTo = 0;
+}
+
+struct WordsCount {
+  unsigned int hash;
+  // a length of 0 is an empty slot
+  int offset, length, count;
+};
+// counts the words of rows [start, end) on its own thread, with their
+// text one after another in text. cold rows are unpacked into raw here
+// rather than through the cache, which isn't shared.
+struct WordsWorker {
+  int start, end;
+  struct WordsCount *counts;
+  int capacity, used;
+  struct appendBuffer text;
+  struct ColdBlock *block;
+  char *raw;
+};
+
+void wordsWorkerResize(struct WordsWorker *worker, int capacity)
+{
+  struct WordsCount *old = worker->counts;
+  int oldcapacity = worker->capacity;
+  unsigned int mask = capacity - 1;
+  worker->counts = nimMalloc(ALLOC_OTHER, sizeof(struct WordsCount) * capacity);
+  memset(worker->counts, 0, sizeof(struct WordsCount) * capacity);
+  worker->capacity = capacity;
+  for (int i = 0; i < oldcapacity; i++) {
+    if (!old[i].length)
+      continue;
+    unsigned int j = old[i].hash & mask;
+    while (worker->counts[j].length)
+      j = (j + 1) & mask;
+    worker->counts[j] = old[i];
+  }
+  nimFree(ALLOC_OTHER, old);
+}
+
+void wordsWorkerAdd(struct WordsWorker *worker, const char *s, int length)
+{
+  if (length > WORDS_MAX_LENGTH)
+    return;
+  if (worker->used * 2 >= worker->capacity)
+    wordsWorkerResize(worker, worker->capacity * 2);
+  unsigned int hash = wordHash(s, length), mask = worker->capacity - 1;
+  for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+    struct WordsCount *entry = &worker->counts[i];
+    if (!entry->length) {
+      *entry = (struct WordsCount){hash, worker->text.length, length, 1};
+      abAppend(&worker->text, s, length);
+      worker->used++;
+      return;
+    }
+    if (entry->hash == hash && entry->length == length
+        && !memcmp(worker->text.buffer + entry->offset, s, length)) {
+      entry->count++;
+      return;
+    }
+  }
+}
+
+void *wordsWorkerRun(void *arg)
+{
+  struct WordsWorker *worker = arg;
+  for (int i = worker->start; i < worker->end; i++) {
+    EditorRow *row = &editor.rows[i];
+    const char *text = editorRowBuffer(row);
+    if (row->cold) {
+      if (row->cold != worker->block) {
+        worker->raw = nimRealloc(ALLOC_OTHER, worker->raw, row->cold->rawsize ? row->cold->rawsize : 1);
+        editorColdUnpack(row->cold, worker->raw);
+        worker->block = row->cold;
+      }
+      text = worker->raw + row->coldOffset;
+    }
+    for (int at = 0, start; (start = wordNext(text, row->size, &at)) >= 0;)
+      wordsWorkerAdd(worker, text + start, at - start);
+  }
+  return NULL;
+}
+
+// counts the rows not counted yet, in parallel on big buffers like :g.
+// the workers count the words they see, and only the different words are
+// then added to the trie.
+void editorWordsCountRest()
+{
+  struct Words *words = &editor.words;
+  editorWordsFlush();
+  int from = words->counted, rows = editor.rowscount - from;
+  words->counted = editor.rowscount;
+  int workerscount = editorWorkersFor(rows);
+  struct WordsWorker *workers = nimMalloc(ALLOC_OTHER, sizeof(*workers) * workerscount);
+  for (int i = 0; i < workerscount; i++) {
+    memset(&workers[i], 0, sizeof(workers[i]));
+    workers[i].start = from + (long long)rows * i / workerscount;
+    workers[i].end = from + (long long)rows * (i+1) / workerscount;
+    workers[i].text = (struct appendBuffer)ABUF_INIT_FOR(ALLOC_OTHER);
+    wordsWorkerResize(&workers[i], 1024);
+  }
+  editorRunWorkers(workers, sizeof(*workers), workerscount, wordsWorkerRun);
+
+  for (int i = 0; i < workerscount; i++) {
+    struct WordsWorker *worker = &workers[i];
+    for (int j = 0; j < worker->capacity; j++)
+      if (worker->counts[j].length)
+        editorWordsAdd(worker->text.buffer + worker->counts[j].offset, worker->counts[j].length, worker->counts[j].count);
+    nimFree(ALLOC_OTHER, worker->counts);
+    abFree(&worker->text);
+    nimFree(ALLOC_OTHER, worker->raw);
+  }
+  nimFree(ALLOC_OTHER, workers);
+}
+
+// whether there are rows left to count while waiting for keys
+int editorWordsCounting()
+{
+  return editor.words.built && editor.words.counted < (int)editor.rowscount;
+}
+
+void editorWordsCountSome()
+{
+  struct Words *words = &editor.words;
+  editorWordsFlush();
+  int from = words->counted, to = from + WORDS_IDLE_ROWS;
+  if (to > (int)editor.rowscount)
+    to = editor.rowscount;
+  words->counted = to;
+  editorWordsRows(from, to, 1);
+}
+
+// every word counted, for a completion
+void editorWordsUpdate()
+{
+  if (!editor.words.built)
+    editorWordsStart();
+  if (editorWordsCounting())
+    editorWordsCountRest();
+  else
+    editorWordsFlush();
+}
+// }}}
+// Editor operations {{{
+void editorQuit()
+{
+  // batch workers exit from editorBatchFile, so the script can decide
+  // whether the file gets saved. replays stop at the quit too.
+  if (editor.headless || editor.benchmark) {
+    editor.quitRequested = 1;
+    return;
+  }
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(EXIT_SUCCESS);
+}
+void editorSetPrompt(const char *format, ...)
+{
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  int messageSize = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (messageSize >= (int)sizeof(message))
+    messageSize = sizeof(message) - 1;
+
+  abClear(&editor.prompt);
+  abAppend(&editor.prompt, message, messageSize);
+}
+
+void editorAllocReport()
+{
+  char report[256];
+  int length = 0;
+  for (int i = 0; i < ALLOC_SUBSYSTEMS && length < (int)sizeof(report); i++)
+    length += snprintf(&report[length], sizeof(report) - length, "%s%s %lld/%lldB",
+                       i ? ", " : "", allocSubsystemNames[i], allocators.stats[i].allocs,
+                       allocators.stats[i].bytes);
+  editorSetPrompt("%s", report);
+}
+// }}}
+// Hex view {{{
+int editorHexOpen(const char *filename)
+{
+  struct Hex *hex = nimMalloc(ALLOC_OTHER, sizeof(*hex));
+  memset(hex, 0, sizeof(*hex));
+  hex->fd = open(filename, O_RDWR | O_CLOEXEC);
+  if (hex->fd == -1)
+    hex->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (hex->fd == -1 || fstat(hex->fd, &st) == -1 || (off_t)(st.st_size / HEX_BYTES) >= INT_MAX) {
+    if (hex->fd != -1)
+      close(hex->fd);
+    nimFree(ALLOC_OTHER, hex);
+    return EXIT_FAILURE;
+  }
+  hex->size = st.st_size;
+  hex->lines = (hex->size + HEX_BYTES - 1) / HEX_BYTES;
+  hex->pagesize = sysconf(_SC_PAGESIZE);
+  if (hex->size) {
+    hex->map = mmap(NULL, hex->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, hex->fd, 0);
+    if (hex->map == MAP_FAILED) {
+      close(hex->fd);
+      nimFree(ALLOC_OTHER, hex);
+      return EXIT_FAILURE;
+    }
+  }
+  hex->offsetwidth = 8;
+  while (hex->offsetwidth < 16 && (hex->size - 1) >> (hex->offsetwidth * 4))
+    hex->offsetwidth++;
+
+  editor.hex = hex;
+  editor.savedChanges = editor.changes;
+  editorSetPrompt("\"%s\" %lldB [binary]", filename, (long long)hex->size);
+  return EXIT_SUCCESS;
+}
+
+void editorHexClose()
+{
+  struct Hex *hex = editor.hex;
+  if (hex->map)
+    munmap(hex->map, hex->size);
+  close(hex->fd);
+  nimFree(ALLOC_OTHER, hex->dirty);
+  nimFree(ALLOC_OTHER, hex);
+  editor.hex = NULL;
+}
+
+off_t editorHexCursor()
+{
+  return (off_t)editor.window->cursory * HEX_BYTES + editor.window->cursorx;
+}
+
+void editorHexSetCursor(off_t offset)
+{
+  if (offset >= editor.hex->size)
+    offset = editor.hex->size - 1;
+  if (offset < 0)
+    offset = 0;
+  editor.window->cursory = offset / HEX_BYTES;
+  editor.window->cursorx = offset % HEX_BYTES;
+}
+
+// the screen column of byte x of a line, in the hex or the text column
+int editorHexColumn(int x, int text)
+{
+  int start = editor.hex->offsetwidth + 2;
+  if (text)
+    return start + HEX_BYTES / 2 * 5 + 1 + x;
+  return start + x / 2 * 5 + x % 2 * 2;
+}
+
+// like xxd: the offset, the bytes in pairs and then as text. the byte
+// under the cursor is marked in the column the cursor isn't in. returns
+// the columns it took.
+int editorHexDrawRow(struct appendBuffer *ab, struct Window *window, int line)
+{
+  struct Hex *hex = editor.hex;
+  char text[128];
+  off_t start = (off_t)line * HEX_BYTES;
+  int count = hex->size - start < HEX_BYTES ? hex->size - start : HEX_BYTES;
+  int length = snprintf(text, sizeof(text), "%0*llx: ", hex->offsetwidth, (long long)start);
+  memset(text + length, ' ', HEX_BYTES / 2 * 5 + 1 + count);
+  for (int x = 0; x < count; x++) {
+    unsigned char byte = hex->map[start + x];
+    int column = editorHexColumn(x, 0);
+    text[column] = "0123456789abcdef"[byte >> 4];
+    text[column + 1] = "0123456789abcdef"[byte & 15];
+    text[editorHexColumn(x, 1)] = isprint(byte) ? byte : '.';
+  }
+  length = editorHexColumn(count, 1);
+
+  int mark = -1;
+  if (window == editor.window && line == window->cursory && window->cursorx < count)
+    mark = editorHexColumn(window->cursorx, !hex->text);
+  int width = length < window->cols ? length : window->cols;
+  if (mark < 0 || mark >= width) {
+    abAppend(ab, text, width);
+    return width;
+  }
+  int markwidth = hex->text ? 2 : 1;
+  if (mark + markwidth > width)
+    markwidth = width - mark;
+  abAppend(ab, text, mark);
+  abAppend(ab, "\x1b[7m", 4);
+  abAppend(ab, text + mark, markwidth);
+  abAppend(ab, "\x1b[m", 3);
+  abAppend(ab, text + mark + markwidth, width - mark - markwidth);
+  return width;
+}
+
+void editorHexScroll(struct Window *window)
+{
+  struct Hex *hex = editor.hex;
+  if (window->cursory >= hex->lines)
+    window->cursory = hex->lines ? hex->lines - 1 : 0;
+  window->renderx = editorHexColumn(window->cursorx, hex->text) + (hex->text ? 0 : hex->nibble);
+  window->coloffset = 0;
+  if (window->cursory < window->rowoffset)
+    window->rowoffset = window->cursory;
+  if (window->cursory >= window->rowoffset + window->rows)
+    window->rowoffset = window->cursory - window->rows + 1;
+}
+
+// the page of a changed byte is remembered, in order, for :w
+void editorHexSetByte(off_t offset, unsigned char byte)
+{
+  struct Hex *hex = editor.hex;
+  if (hex->map[offset] == byte)
+    return;
+  hex->map[offset] = byte;
+  editor.changes++;
+  editorDamageRows(offset / HEX_BYTES, offset / HEX_BYTES + 1);
+
+  long page = offset / hex->pagesize;
+  int low = 0, high = hex->dirtycount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (hex->dirty[middle] < page)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low < hex->dirtycount && hex->dirty[low] == page)
+    return;
+  if (hex->dirtycount == hex->dirtycapacity) {
+    hex->dirtycapacity = hex->dirtycapacity ? hex->dirtycapacity * 2 : 16;
+    hex->dirty = nimRealloc(ALLOC_OTHER, hex->dirty, sizeof(long) * hex->dirtycapacity);
+  }
+  memmove(&hex->dirty[low + 1], &hex->dirty[low], sizeof(long) * (hex->dirtycount - low));
+  hex->dirty[low] = page;
+  hex->dirtycount++;
+}
+
+// writes back the changed pages only. returns how many, or -1.
+int editorHexWrite()
+{
+  struct Hex *hex = editor.hex;
+  int pages = hex->dirtycount;
+  for (int i = 0; i < hex->dirtycount; i++) {
+    off_t offset = (off_t)hex->dirty[i] * hex->pagesize;
+    size_t length = hex->size - offset < hex->pagesize ? (size_t)(hex->size - offset) : (size_t)hex->pagesize;
+    if (pwrite(hex->fd, hex->map + offset, length, offset) != (ssize_t)length)
+      return -1;
+  }
+  hex->dirtycount = 0;
+  editor.savedChanges = editor.changes;
+  return pages;
+}
+// }}}
+// File i/o {{{
+char *editorRowsToString(int *bufferLength)
+{
+  int totalLength = 0;
+  for (int i = 0; i < editor.rowscount; i++)
+    totalLength += editor.rows[i].size + 1;
+  *bufferLength = totalLength;
+
+  char *buffer = nimMalloc(ALLOC_OUTPUT, totalLength);
+  char *pointer = buffer;
+
+  for (int j = 0; j < editor.rowscount; j++) {
+    memcpy(pointer, editorRowText(&editor.rows[j]),editor.rows[j].size);
+    pointer += editor.rows[j].size;
+    *pointer = '\n';
+    pointer++;
+  }
+  return buffer;
+}
+
+void editorAppendLine(char *line, size_t linelen)
+{
+  while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                         line[linelen - 1] == '\r'))
+    linelen--;
+
+  // straight from the file, so not edited
+  editorInitRow(editorLoadRows(editor.rowscount, 1), line, linelen);
+}
+
+void lineReaderFeed(struct LineReader *reader, char *chunk, size_t length)
+{
+  char *end = chunk + length;
+  while (chunk < end) {
+    char *newline = memchr(chunk, '\n', end - chunk);
+    if (newline == NULL) {
+      abAppend(&reader->pending, chunk, end - chunk);
+      return;
+    }
+    if (reader->pending.length) {
+      abAppend(&reader->pending, chunk, newline - chunk);
+      reader->line(reader->pending.buffer, reader->pending.length);
+      abClear(&reader->pending);
+    } else
+      reader->line(chunk, newline - chunk);
+    chunk = newline + 1;
+  }
+}
+
+void lineReaderFinish(struct LineReader *reader)
+{
+  if (reader->pending.length)
+    reader->line(reader->pending.buffer, reader->pending.length);
+  abFree(&reader->pending);
+  abReinit(&reader->pending);
+}
+
+void editorStreamOpen(int fd, int follow);
+void editorStreamClose();
+void editorDiskRemember(int fd, off_t size);
+void editorWatchStart();
+void editorModeline();
+
+void editorOpen(char *filename) 
+{
+  nimFree(ALLOC_OTHER, editor.filename);
+  editor.filename = NULL;
+
+  // what was open before goes, the registers keep their copy of it
+  if (editor.rowscount)
+    editorRegistersChange(0, editor.rowscount - 1);
+  // and the words are counted again from the new rows, not taken out
+  editorWordsReset();
+  if (editor.large)
+    editorLargeFileClose();
+  else
+    editorDeleteRows(0, editor.rowscount);
+  if (editor.hex)
+    editorHexClose();
+  if (editor.stream)
+    editorStreamClose();
+  for (int i = 0; i < editor.windowscount; i++) {
+    struct Window *window = editor.windows[i];
+    window->cursorx = window->cursory = 0;
+    window->rowoffset = window->coloffset = 0;
+  }
+  editorDamageAll();
+  editorFoldsReset();
+
+  // "-" is stdin, read by the main loop as it arrives. it has no name to
+  // write back to.
+  if (!strcmp(filename, "-")) {
+    editorStreamOpen(STDIN_FILENO, 0);
+    editorWordsStart();
+    return;
+  }
+  editor.filename = nimStrndup(ALLOC_OTHER, filename, strlen(filename));
+
+  editorWatchStart();
+
+  if (editor.binary) {
+    if (editorHexOpen(filename) == EXIT_FAILURE)
+      editorSetPrompt("\"%s\" can't be opened in binary mode", filename);
+    return;
+  }
+
+  struct stat st;
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > editor.memoryCap) {
+    if (editorLargeFileOpen(filename, st.st_size) == EXIT_FAILURE)
+      return;
+    editorDiskRemember(editor.large->fd, editor.large->size);
+    if (editor.follow)
+      editorSetPrompt("Follow mode isn't available in large file mode");
+    return;
+  }
+
+  if (access(filename, F_OK) == 0) {
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    struct LineReader reader = LINE_READER_INIT;
+    char chunk[64 * 1024];
+    ssize_t nread;
+    off_t size = 0;
+    while ((nread = read(fd, chunk, sizeof(chunk))) > 0) {
+      lineReaderFeed(&reader, chunk, nread);
+      size += nread;
+    }
+    if (nread == -1) die("read");
+
+    lineReaderFinish(&reader);
+    editorDiskRemember(fd, size);
+    if (editor.follow)
+      editorStreamOpen(fd, 1);
+    else
+      close(fd);
+    editorModeline();
+  }
+  // the words are counted while no keys come, for completion
+  editorWordsStart();
+}
+
+// :set binary and :set nobinary open the file again in the other view
+void editorSetBinary(int binary)
+{
+  if (editor.filename == NULL) {
+    editorSetPrompt("E32: No file name");
+    return;
+  }
+  if (editor.changes != editor.savedChanges) {
+    editorSetPrompt("E37: No write since last change");
+    return;
+  }
+  char *filename = nimStrndup(ALLOC_OTHER, editor.filename, strlen(editor.filename));
+  editor.binary = binary;
+  editorOpen(filename);
+  nimFree(ALLOC_OTHER, filename);
+}
+
+// returns EXIT_FAILURE, with the error in the prompt, when the file
+// couldn't be written. the buffer then still counts as changed.
+int editorWrite()
+{
+  if (editor.filename == NULL) {
+    editorSetPrompt("E32: No file name");
+    return EXIT_FAILURE;
+  }
+
+  if (editor.hex) {
+    int pages = editor.benchmark ? 0 : editorHexWrite();
+    if (pages == -1) {
+      editorSetPrompt("\"%s\" E212: Can't open file for writing", editor.filename);
+      return EXIT_FAILURE;
+    }
+    editorSetPrompt("\"%s\" %lldB, %d pages written", editor.filename, (long long)editor.hex->size, pages);
+    return EXIT_SUCCESS;
+  }
+
+  if (editor.large) {
+    long long written = editor.benchmark ? 0 : editorLargeFileWrite();
+    if (written == -1) {
+      editorSetPrompt("\"%s\" E212: Can't open file for writing", editor.filename);
+      return EXIT_FAILURE;
+    }
+    editorSetPrompt("\"%s\" %dL, %lldB written", editor.filename, editor.rowscount, written);
+    if (!editor.benchmark)
+      editorDiskRemember(editor.large->fd, editor.large->size);
+    return EXIT_SUCCESS;
+  }
+
+  int length;
+  char *buffer = editorRowsToString(&length);
+
+  // benchmarks measure building the buffer, but leave the corpus alone
+  if (!editor.benchmark) {
+    int fd = open(editor.filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      editorSetPrompt("\"%s\" E212: Can't open file for writing", editor.filename);
+      nimFree(ALLOC_OUTPUT, buffer);
+      return EXIT_FAILURE;
+    }
+    // what the buffer was last saved as stays until the write made it
+    struct DiskState disk = editor.disk;
+    long long savedChanges = editor.savedChanges;
+    int failed = ftruncate(fd, length) == -1 || writeAll(fd, buffer, length) == -1;
+    if (!failed)
+      editorDiskRemember(fd, length);
+    if (close(fd) == -1 || failed) {
+      editor.disk = disk;
+      editor.savedChanges = savedChanges;
+      editorSetPrompt("\"%s\" E514: write error (file system full?)", editor.filename);
+      nimFree(ALLOC_OUTPUT, buffer);
+      return EXIT_FAILURE;
+    }
+  }
+  
+  editorSetPrompt("\"%s\" %dL, %dB", editor.filename, editor.rowscount, length);
+  nimFree(ALLOC_OUTPUT, buffer);
+  return EXIT_SUCCESS;
+}
+// }}}
+// Watch {{{
+void editorDamageAll();
+
+void editorDiskRemember(int fd, off_t size)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return;
+  editor.disk.dev = st.st_dev;
+  editor.disk.ino = st.st_ino;
+  editor.disk.size = size;
+  editor.disk.mtime = st.st_mtim;
+  editor.disk.tailsize = size < DISK_TAIL ? size : DISK_TAIL;
+  if (pread(fd, editor.disk.tail, editor.disk.tailsize, size - editor.disk.tailsize) != editor.disk.tailsize)
+    editor.disk.tailsize = -1;
+  editor.savedChanges = editor.changes;
+}
+
+// the directory is watched rather than the file, so a file that deploy
+// tooling renames over ours is seen too
+void editorWatchStart()
+{
+  if (editor.headless || editor.benchmark)
+    return;
+  if (editor.watchfd == -1)
+    editor.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (editor.watchfd == -1)
+    return;
+  if (editor.watchName)
+    inotify_rm_watch(editor.watchfd, editor.watchwd);
+  nimFree(ALLOC_OTHER, editor.watchName);
+
+  char *slash = strrchr(editor.filename, '/');
+  char *directory = slash ? nimStrndup(ALLOC_OTHER, editor.filename, slash - editor.filename + 1)
+                          : nimStrndup(ALLOC_OTHER, ".", 1);
+  const char *name = slash ? slash + 1 : editor.filename;
+  editor.watchName = nimStrndup(ALLOC_OTHER, name, strlen(name));
+  editor.watchwd = inotify_add_watch(editor.watchfd, directory,
+                                     IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  nimFree(ALLOC_OTHER, directory);
+}
+
+// drains the pending events, returns whether any was about our file
+int editorWatchChanged()
+{
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int changed = 0;
+  ssize_t nread;
+  while ((nread = read(editor.watchfd, events, sizeof(events))) > 0) {
+    for (char *cursor = events; cursor < events + nread;) {
+      struct inotify_event *event = (struct inotify_event *)cursor;
+      if (event->len && !strcmp(event->name, editor.watchName))
+        changed = 1;
+      cursor += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+
+int editorDiskTailMatches(int fd)
+{
+  char tail[DISK_TAIL];
+  int size = editor.disk.tailsize;
+  return size >= 0 && pread(fd, tail, size, editor.disk.size - size) == size
+    && !memcmp(tail, editor.disk.tail, size);
+}
+
+// only the bytes after the old end are read. a last line that had no
+// newline yet is taken back out and read again with its continuation.
+// returns the size that was read, or -1 when that line was edited or the
+// file can't be indexed, with the reason in the prompt.
+off_t editorReloadAppend(int fd, off_t from)
+{
+  int endsWithNewline = editor.disk.tailsize == 0 || editor.disk.tail[editor.disk.tailsize-1] == '\n';
+  if (editor.large) {
+    struct LargeFile *large = editor.large;
+    int last = editor.rowscount - 1, position;
+    int resident = large->windowCount && large->windowStart + large->windowCount == (int)editor.rowscount;
+    if (!endsWithNewline && last >= 0) {
+      // the edit would be written over the line and its continuation
+      if ((resident && editor.rows[large->windowCount-1].edited) || editorLargeFileEditAt(last, &position)) {
+        editorSetPrompt("W12: \"%s\" changed on disk and in the buffer, not reloaded", editor.filename);
+        return -1;
+      }
+      if (resident)
+        editorFreeRow(&editor.rows[--large->windowCount]);
+    }
+    if (editorLargeFileIndex(large, from) == EXIT_FAILURE)
+      return -1;
+    return large->size;
+  }
+
+  struct LineReader reader = LINE_READER_INIT;
+  if (!endsWithNewline && editor.rowscount) {
+    EditorRow *last = editorRowAt(editor.rowscount - 1);
+    abAppend(&reader.pending, editorRowBuffer(last), last->size);
+    editorRegistersMove(editor.rowscount - 1, -1);
+    editorFoldsMove(editor.rowscount - 1, -1);
+    editorWordsMove(editor.rowscount - 1, -1);
+    editorWindowsMove(editor.rowscount - 1, -1);
+    editorFreeRow(last);
+    editor.rowscount--;
+  }
+  char chunk[64 * 1024];
+  ssize_t nread;
+  while ((nread = pread(fd, chunk, sizeof(chunk), from)) > 0) {
+    lineReaderFeed(&reader, chunk, nread);
+    from += nread;
+  }
+  lineReaderFinish(&reader);
+  return from;
+}
+
+struct DiffLine {
+  const char *text;
+  int size;
+};
+
+int editorRowEquals(int at, struct DiffLine *line)
+{
+  EditorRow *row = &editor.rows[at];
+  return row->size == line->size && !memcmp(editorRowText(row), line->text, line->size);
+}
+
+// the new content is split into lines and compared with the rows from
+// both ends. only the rows in between are replaced, in place where the
+// counts allow and with one move of the tail otherwise. returns the size
+// that was read.
+off_t editorReloadDiff(int fd)
+{
+  struct appendBuffer content = ABUF_INIT_FOR(ALLOC_OTHER);
+  char chunk[64 * 1024];
+  ssize_t nread;
+  while ((nread = read(fd, chunk, sizeof(chunk))) > 0)
+    abAppend(&content, chunk, nread);
+
+  int linescount = 0, linescapacity = 1024;
+  struct DiffLine *lines = nimMalloc(ALLOC_OTHER, sizeof(*lines) * linescapacity);
+  for (int start = 0; start < content.length;) {
+    char *newline = memchr(content.buffer + start, '\n', content.length - start);
+    int end = newline ? newline - content.buffer : content.length;
+    if (linescount == linescapacity) {
+      linescapacity *= 2;
+      lines = nimRealloc(ALLOC_OTHER, lines, sizeof(*lines) * linescapacity);
+    }
+    int size = end - start;
+    if (size && content.buffer[end-1] == '\r')
+      size--;
+    lines[linescount++] = (struct DiffLine){content.buffer + start, size};
+    start = end + 1;
+  }
+
+  int oldcount = editor.rowscount;
+  int prefix = 0, suffix = 0;
+  while (prefix < oldcount && prefix < linescount && editorRowEquals(prefix, &lines[prefix]))
+    prefix++;
+  while (suffix < oldcount - prefix && suffix < linescount - prefix
+         && editorRowEquals(oldcount - 1 - suffix, &lines[linescount - 1 - suffix]))
+    suffix++;
+
+  int removed = oldcount - prefix - suffix, added = linescount - prefix - suffix;
+  int replaced = removed < added ? removed : added;
+  int at = prefix + replaced;
+  int delta = added - removed;
+  if (replaced) {
+    editorRegistersChange(prefix, at - 1);
+    editorFoldsChange(prefix, at - 1);
+    editorWordsChange(prefix, at - 1);
+    editorDamageRows(prefix, at);
+  }
+  if (delta) {
+    editorRegistersMove(at, delta);
+    editorFoldsMove(at, delta);
+    editorWordsMove(at, delta);
+    editorWindowsMove(at, delta);
+  }
+  for (int i = 0; i < replaced; i++) {
+    EditorRow *row = &editor.rows[prefix + i];
+    editorFreeRow(row);
+    editorInitRow(row, lines[prefix + i].text, lines[prefix + i].size);
+  }
+
+  if (delta < 0)
+    for (int i = 0; i < -delta; i++)
+      editorFreeRow(&editor.rows[at + i]);
+  if (delta > 0 && editor.rowscount + delta > editor.rowscapacity) {
+    while (editor.rowscount + delta > editor.rowscapacity)
+      editor.rowscapacity = editor.rowscapacity ? editor.rowscapacity * 2 : 64;
+    editor.rows = nimRealloc(ALLOC_ROWS, editor.rows, sizeof(EditorRow) * editor.rowscapacity);
+  }
+  if (delta)
+    memmove(&editor.rows[at + (delta > 0 ? delta : 0)], &editor.rows[at + (delta < 0 ? -delta : 0)],
+            sizeof(EditorRow) * suffix);
+  for (int i = 0; i < delta; i++)
+    editorInitRow(&editor.rows[at + i], lines[at + i].text, lines[at + i].size);
+  editor.rowscount += delta;
+
+  // the cursor stays on the same text when it was after the change
+  if (editor.window->cursory >= oldcount - suffix && delta) {
+    editor.window->cursory += delta;
+    editor.window->rowoffset += delta;
+    if (editor.window->rowoffset < 0)
+      editor.window->rowoffset = 0;
+  }
+
+  off_t size = content.length;
+  nimFree(ALLOC_OTHER, lines);
+  abFree(&content);
+  return size;
+}
+
+void editorReload()
+{
+  // the hex view has the file mapped, and its own writes land here too.
+  // a large file that was refused left the buffer without a name.
+  if (editor.hex || !editor.filename)
+    return;
+  if (editor.changes != editor.savedChanges) {
+    editorSetPrompt("W12: \"%s\" changed on disk and in the buffer, not reloaded", editor.filename);
+    return;
+  }
+  // mid rename, the event for the new file follows
+  int fd = open(editor.filename, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  fstat(fd, &st);
+  int sameFile = st.st_dev == editor.disk.dev && st.st_ino == editor.disk.ino;
+  if (sameFile && st.st_size == editor.disk.size
+      && st.st_mtim.tv_sec == editor.disk.mtime.tv_sec && st.st_mtim.tv_nsec == editor.disk.mtime.tv_nsec) {
+    close(fd);
+    return;
+  }
+
+  off_t size;
+  if (sameFile && st.st_size > editor.disk.size && editorDiskTailMatches(fd)) {
+    size = editorReloadAppend(fd, editor.disk.size);
+    if (size == -1) {
+      close(fd);
+      return;
+    }
+  } else if (editor.large) {
+    editorLargeFileClose();
+    if (editorLargeFileOpen(editor.filename, st.st_size) == EXIT_FAILURE) {
+      close(fd);
+      editorDamageAll();
+      return;
+    }
+    size = editor.large->size;
+  } else
+    size = editorReloadDiff(fd);
+
+  editorDiskRemember(fd, size);
+  close(fd);
+
+  if (editor.window->cursory >= editor.rowscount)
+    editor.window->cursory = editor.rowscount ? editor.rowscount - 1 : 0;
+  if (editor.window->rowoffset > editor.window->cursory)
+    editor.window->rowoffset = editor.window->cursory;
+  if (editor.window->cursory < editor.rowscount && editor.window->cursorx > getCurrentRow()->size)
+    editor.window->cursorx = getCurrentRow()->size ? getCurrentRow()->size - 1 : 0;
+  editorDamageAll();
+  editorSetPrompt("\"%s\" changed on disk, %dL", editor.filename, editor.rowscount);
+}
+// }}}
+// Streaming {{{
+void editorDamageRows(int from, int to);
+
+void editorStreamOpen(int fd, int follow)
+{
+  // without a terminal there is no loop to feed it, read everything now
+  if (editor.headless || editor.benchmark) {
+    struct LineReader reader = LINE_READER_INIT;
+    char chunk[64 * 1024];
+    ssize_t nread;
+    while ((nread = read(fd, chunk, sizeof(chunk))) > 0)
+      lineReaderFeed(&reader, chunk, nread);
+    lineReaderFinish(&reader);
+    if (fd != STDIN_FILENO)
+      close(fd);
+    return;
+  }
+
+  editor.stream = nimMalloc(ALLOC_OTHER, sizeof(struct Stream));
+  editor.stream->fd = fd;
+  editor.stream->follow = follow;
+  editor.stream->reader = (struct LineReader)LINE_READER_INIT;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void editorStreamClose()
+{
+  lineReaderFinish(&editor.stream->reader);
+  close(editor.stream->fd);
+  nimFree(ALLOC_OTHER, editor.stream);
+  editor.stream = NULL;
+}
+
+// reads what is available, up to STREAM_BATCH bytes so a fast producer
+// can't starve the keyboard. in follow mode the cursor goes along with
+// new rows when it was on the last one, like less +F.
+void editorStreamRead()
+{
+  struct Stream *stream = editor.stream;
+  int oldcount = editor.rowscount;
+  int atBottom = editor.follow && (editor.rowscount == 0 || editor.window->cursory >= editor.rowscount - 1);
+  char chunk[64 * 1024];
+  ssize_t nread = 0;
+  size_t total = 0;
+
+  while (total < STREAM_BATCH && (nread = read(stream->fd, chunk, sizeof(chunk))) > 0) {
+    lineReaderFeed(&stream->reader, chunk, nread);
+    total += nread;
+  }
+  if (nread == -1 && errno != EAGAIN && errno != EINTR)
+    die("read");
+  // a followed file keeps its partial last line until the rest is written
+  if (nread == 0 && !stream->follow)
+    editorStreamClose();
+
+  if (editor.rowscount == oldcount)
+    return;
+  // the first rows replace the welcome message
+  if (oldcount == 0)
+    editorDamageAll();
+  editorDamageRows(oldcount, editor.rowscount);
+  if (atBottom) {
+    editor.window->cursory = editor.rowscount - 1;
+    editor.window->cursorx = 0;
+  }
+}
+
+// waits for a key while feeding the stream. returns 0 when it woke up for
+// the stream instead, so the caller can draw the new rows.
+int editorFrameTimeout();
+int editorKeyTimeoutMs();
+int editorFlush();
+
+void editorFilterWrite();
+void editorFilterRead();
+
+int editorWaitForKey()
+{
+  if (editorTypeaheadPending())
+    return 1;
+  struct pollfd fds[6] = {{editor.infd, POLLIN, 0}, {-1, POLLIN, 0}, {-1, POLLIN, 0}, {-1, POLLOUT, 0},
+                          {-1, POLLOUT, 0}, {-1, POLLIN, 0}};
+  int timeout = editorFrameTimeout();
+  int keyTimeout = editorKeyTimeoutMs();
+  if (keyTimeout != -1 && (timeout == -1 || keyTimeout < timeout))
+    timeout = keyTimeout;
+  // the words are counted a slice at a time until a key comes
+  int counting = editorWordsCounting();
+  if (counting)
+    timeout = 0;
+  // a reload while a filter runs would move its rows, it waits until after
+  fds[2].fd = editor.filter ? -1 : editor.watchfd;
+  if (editor.frameSent < editor.frame.length)
+    fds[3].fd = editor.outfd;
+  if (editor.stream) {
+    // regular files always poll as readable, followed ones wait for the
+    // watch or are checked on a timer without it
+    if (!editor.stream->follow)
+      fds[1].fd = editor.stream->fd;
+    else if (fds[2].fd == -1 && (timeout == -1 || timeout > STREAM_FOLLOW_MS))
+      timeout = STREAM_FOLLOW_MS;
+  }
+
+  if (editor.filter) {
+    fds[4].fd = editor.filter->infd;
+    fds[5].fd = editor.filter->outfd;
+  }
+
+  int ready = poll(fds, 6, timeout);
+  if (ready == -1 && errno != EINTR)
+    die("poll");
+  if (ready > 0 && fds[3].revents)
+    editorFlush();
+  if (ready > 0 && fds[4].revents)
+    editorFilterWrite();
+  if (ready > 0 && fds[5].revents && editor.filter)
+    editorFilterRead();
+  if (ready > 0 && fds[0].revents)
+    return 1;
+  int changed = ready > 0 && fds[2].revents && editorWatchChanged();
+  if (editor.stream && (ready == 0 || fds[1].revents || changed))
+    editorStreamRead();
+  else if (changed)
+    editorReload();
+  if (ready == 0 && counting)
+    editorWordsCountSome();
+  return 0;
+}
+// }}}
+// Filter {{{
+void editorScheduleFrame();
+
+void editorFilterLine(char *line, size_t length)
+{
+  struct Filter *filter = editor.filter;
+  while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    length--;
+  if (filter->rowscount == filter->rowscapacity) {
+    filter->rowscapacity = filter->rowscapacity ? filter->rowscapacity * 2 : 64;
+    filter->rows = nimRealloc(ALLOC_ROWS, filter->rows, sizeof(EditorRow) * filter->rowscapacity);
+  }
+  editorInitRowText(&filter->rows[filter->rowscount++], line, length);
+}
+
+// writes what the pipe takes of the rows, a newline after each. the
+// pieces point into the rows and are gathered again for every writev, so
+// a cold row's text is never held on to while its cache slot is reused.
+void editorFilterWrite()
+{
+  struct Filter *filter = editor.filter;
+  while (filter->writerow < filter->end) {
+    struct iovec iov[FILTER_IOV];
+    struct ColdBlock *blocks[COLD_CACHE_BLOCKS];
+    int count = 0, blockscount = 0;
+    for (int y = filter->writerow; y < filter->end && count + 2 <= FILTER_IOV; y++) {
+      EditorRow *row = &editor.rows[y];
+      if (row->cold) {
+        int known = 0;
+        for (int i = 0; i < blockscount; i++)
+          known |= blocks[i] == row->cold;
+        if (!known && blockscount == COLD_CACHE_BLOCKS)
+          break;
+        if (!known)
+          blocks[blockscount++] = row->cold;
+      }
+      int offset = y == filter->writerow ? filter->writeoffset : 0;
+      if (offset < row->size)
+        iov[count++] = (struct iovec){(char *)editorRowText(row) + offset, row->size - offset};
+      iov[count++] = (struct iovec){"\n", 1};
+    }
+
+    ssize_t written = writev(filter->infd, iov, count);
+    if (written == -1 && (errno == EAGAIN || errno == EINTR))
+      return;
+    // the child stopped reading, what it printed is all there is
+    if (written == -1)
+      break;
+    while (written > 0) {
+      int left = editor.rows[filter->writerow].size + 1 - filter->writeoffset;
+      if (written < left) {
+        filter->writeoffset += written;
+        break;
+      }
+      written -= left;
+      filter->writerow++;
+      filter->writeoffset = 0;
+    }
+  }
+  close(filter->infd);
+  filter->infd = -1;
+}
+
+// the output takes the place of the range, with one move of the rows
+// after it
+void editorFilterApply(struct Filter *filter)
+{
+  int at = filter->top, removed = filter->end - filter->top, added = filter->rowscount;
+  int replaced = removed < added ? removed : added;
+  if (added > removed)
+    editorInsertRows(at + removed, added - removed);
+  else if (removed > added)
+    editorDeleteRows(at + added, removed - added);
+  if (replaced) {
+    editorRegistersChange(at, at + replaced - 1);
+    editorFoldsChange(at, at + replaced - 1);
+    editorWordsChange(at, at + replaced - 1);
+    editorDamageRows(at, at + replaced);
+  }
+  for (int i = 0; i < replaced; i++)
+    editorFreeRow(&editor.rows[at + i]);
+  memcpy(&editor.rows[at], filter->rows, sizeof(EditorRow) * added);
+
+  editor.deferRender++;
+  for (int i = 0; i < added; i++)
+    editorUpdateRow(&editor.rows[at + i]);
+  editor.deferRender--;
+
+  if (filter->read && added)
+    editor.window->cursory = at + added - 1;
+  else if (!filter->read)
+    editor.window->cursory = at;
+  if (editor.window->cursory >= (int)editor.rowscount)
+    editor.window->cursory = editor.rowscount ? editor.rowscount - 1 : 0;
+  int x = getCurrentRow() ? firstNonSpaceFromStart(getCurrentRow(), 0) : 0;
+  editorSetCursorx(x >= 0 ? x : 0);
+}
+
+void editorFilterDone(int interrupted)
+{
+  struct Filter *filter = editor.filter;
+  lineReaderFinish(&filter->reader);
+  if (filter->infd != -1)
+    close(filter->infd);
+  close(filter->outfd);
+  int status = 0;
+  waitpid(filter->pid, &status, 0);
+  editor.filter = NULL;
+
+  // a command that failed keeps the range as it was, so :%!false doesn't
+  // empty the buffer
+  int failed = !interrupted && WIFEXITED(status) && WEXITSTATUS(status);
+  if (interrupted || failed) {
+    for (int i = 0; i < filter->rowscount; i++)
+      editorFreeRow(&filter->rows[i]);
+    if (interrupted)
+      editorSetPrompt("Interrupted");
+    else
+      editorSetPrompt("shell returned %d", WEXITSTATUS(status));
+  } else {
+    editorFilterApply(filter);
+    if (!filter->read)
+      editorReportLines(filter->end - filter->top, "lines filtered");
+  }
+  nimFree(ALLOC_ROWS, filter->rows);
+  nimFree(ALLOC_OTHER, filter);
+  editorDamageAll();
+}
+
+// reads what is there, up to STREAM_BATCH bytes so the keyboard and the
+// child's stdin get their turn
+void editorFilterRead()
+{
+  struct Filter *filter = editor.filter;
+  char chunk[64 * 1024];
+  ssize_t nread = 0;
+  size_t total = 0;
+  while (total < STREAM_BATCH && (nread = read(filter->outfd, chunk, sizeof(chunk))) > 0) {
+    lineReaderFeed(&filter->reader, chunk, nread);
+    total += nread;
+  }
+  if (nread == 0 || (nread == -1 && errno != EAGAIN && errno != EINTR))
+    editorFilterDone(0);
+}
+
+// Ctrl-C kills the command and whatever it started, anything else is
+// kept for when the filter is done
+void editorFilterKey(char c)
+{
+  if (c == CTRL_KEY('c')) {
+    kill(-editor.filter->pid, SIGKILL);
+    editorFilterDone(1);
+    return;
+  }
+  abAppend(&editor.typeahead, &c, 1);
+}
+
+// runs command through sh with rows [top, end) on its stdin, and puts
+// what it prints (stderr too, like vim) in their place. it is fed and
+// drained from the same poll as the main loop, so frames still go out
+// while it runs, but the next key is only handled once it is done.
+void editorFilter(int top, int end, const char *command, int reading)
+{
+  if (!editorCanChangeLines())
+    return;
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) == -1) {
+    editorSetPrompt("E485: Can't create pipe: %s", strerror(errno));
+    return;
+  }
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    editorSetPrompt("E485: Can't create pipe: %s", strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    return;
+  }
+  // a child that exits before reading everything must not take nim along
+  signal(SIGPIPE, SIG_IGN);
+  pid_t pid = fork();
+  if (pid == -1)
+    die("fork");
+  if (pid == 0) {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL);
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  close(in[0]);
+  close(out[1]);
+  fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+  fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+
+  struct Filter *filter = nimMalloc(ALLOC_OTHER, sizeof(struct Filter));
+  memset(filter, 0, sizeof(*filter));
+  filter->pid = pid;
+  filter->infd = in[1];
+  filter->outfd = out[0];
+  filter->top = filter->writerow = top;
+  filter->end = end;
+  filter->read = reading;
+  filter->reader = (struct LineReader){ABUF_INIT_FOR(ALLOC_OTHER), editorFilterLine};
+  editor.filter = filter;
+  if (top == end) {
+    close(filter->infd);
+    filter->infd = -1;
+  }
+
+  while (editor.filter) {
+    // without a terminal there is nothing else to wait for
+    if (editor.headless || editor.benchmark) {
+      struct pollfd fds[2] = {{filter->infd, POLLOUT, 0}, {filter->outfd, POLLIN, 0}};
+      if (poll(fds, 2, -1) == -1 && errno != EINTR)
+        die("poll");
+      if (fds[0].revents)
+        editorFilterWrite();
+      if (fds[1].revents)
+        editorFilterRead();
+      continue;
+    }
+    editorScheduleFrame();
+    if (editorWaitForKey())
+      editorFilterKey(editorReadKey());
+  }
+}
+// }}}
+// Regex {{{
+// ranges smaller than this aren't worth starting threads for
+#define PARALLEL_MIN_ROWS 50000
+// the longest run of plain characters every match has to contain, so rows
+// without it can be skipped with memmem instead of running the regex.
+// returns 0 when there is nothing safe to use.
+size_t regexRequiredLiteral(const char *pattern, char *literal, size_t size)
+{
+  size_t best = 0, run = 0;
+  char current[256];
+  int depth = 0;
+
+  for (const char *p = pattern; ; p++) {
+    int plain = 0;
+    if (*p == '\0')
+      ;
+    else if (*p == '\\') {
+      p++;
+      if (*p == '|' || *p == '\0')
+        return 0;
+      if (*p == '(')
+        depth++;
+      else if (*p == ')')
+        depth--;
+      // everything else behind a backslash is an operator or a back reference
+    } else if (depth == 0 && !strchr(".[]*^$", *p)) {
+      // a quantified character isn't required
+      plain = !(p[1] == '*' || (p[1] == '\\' && p[2] && strchr("{?+=", p[2])));
+    } else if (*p == '[') {
+      // skip the bracket expression, "]" right after "[" or "[^" is literal
+      p++;
+      if (*p == '^')
+        p++;
+      if (*p == ']')
+        p++;
+      while (*p && *p != ']')
+        p++;
+      if (*p == '\0')
+        return 0;
+    }
+
+    if (plain && run < sizeof(current)) {
+      current[run++] = *p;
+      continue;
+    }
+    if (run > best && run <= size) {
+      best = run;
+      memcpy(literal, current, run);
+    }
+    run = 0;
+    if (*p == '\0')
+      break;
+  }
+  return best;
+}
+
+// splits "/pat/rep/flags" in place: the delimiter is whatever follows the
+// command, and a backslash in front of it makes it part of the text.
+// returns what's left after the last field, or NULL for a bad delimiter.
+char *editorSplitPattern(char *cmd, char **fields, int fieldscount)
+{
+  char delimiter = *cmd;
+  if (delimiter == '\0' || isalnum(delimiter) || delimiter == '\\' || delimiter == ' ')
+    return NULL;
+
+  char *read = cmd + 1, *write = cmd + 1;
+  for (int i = 0; i < fieldscount; i++) {
+    fields[i] = write;
+    while (*read && *read != delimiter) {
+      if (*read == '\\' && read[1] == delimiter)
+        read++;
+      *write++ = *read++;
+    }
+    int end = *read == '\0';
+    *write++ = '\0';
+    if (!end)
+      read++;
+    // missing fields are empty, like in vim
+    if (end)
+      for (i++; i < fieldscount; i++)
+        fields[i] = write - 1;
+  }
+  return read;
+}
+
+struct RegexSearch {
+  regex_t regex;
+  // what regex was compiled from, for the copies of the workers
+  const char *pattern;
+  int cflags;
+  char literal[256];
+  size_t literallength;
+};
+
+// an empty pattern means the last one used. reports errors in the prompt.
+int regexSearchCompile(struct RegexSearch *search, const char *pattern, int icase)
+{
+  if (*pattern == '\0') {
+    if (editor.lastPattern == NULL) {
+      editorSetPrompt("E35: No previous regular expression");
+      return EXIT_FAILURE;
+    }
+    pattern = editor.lastPattern;
+  } else if (pattern != editor.lastPattern) {
+    nimFree(ALLOC_OTHER, editor.lastPattern);
+    editor.lastPattern = nimStrndup(ALLOC_OTHER, pattern, strlen(pattern));
+  }
+
+  search->pattern = editor.lastPattern;
+  search->cflags = icase ? REG_ICASE : 0;
+  int error = regcomp(&search->regex, pattern, search->cflags);
+  if (error) {
+    char message[128];
+    regerror(error, &search->regex, message, sizeof(message));
+    editorSetPrompt("E486: %s", message);
+    return EXIT_FAILURE;
+  }
+  search->literallength = icase ? 0
+    : regexRequiredLiteral(pattern, search->literal, sizeof(search->literal));
+  return EXIT_SUCCESS;
+}
+
+// cheap check that rules out lines which can't match
+int regexSearchMayMatch(struct RegexSearch *search, const char *text, int size)
+{
+  return !search->literallength
+    || memmem(text, size, search->literal, search->literallength);
+}
+
+// text is '\0' terminated
+int regexSearchLine(struct RegexSearch *search, regex_t *regex, const char *text, int size)
+{
+  return regexSearchMayMatch(search, text, size) && regexec(regex, text, 0, NULL, 0) == 0;
+}
+
+// glibc's regexec locks the regex_t it runs, so workers sharing one would
+// take turns. a worker that doesn't run alone matches with its own copy,
+// or with the shared one if that can't be compiled.
+regex_t *regexSearchWorkerRegex(struct RegexSearch *search, regex_t *own, int alone)
+{
+  if (alone || regcomp(own, search->pattern, search->cflags))
+    return &search->regex;
+  return own;
+}
+
+void regexSearchWorkerDone(struct RegexSearch *search, regex_t *regex)
+{
+  if (regex != &search->regex)
+    regfree(regex);
+}
+
+int editorWorkersFor(int rows)
+{
+  // the large file window moves under our feet, so stay on one thread
+  if (editor.large)
+    return 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = rows / PARALLEL_MIN_ROWS;
+  if (workers > cpus)
+    workers = cpus;
+  return workers < 1 ? 1 : workers;
+}
+
+// runs every worker (an array of count structs of the given size) on its
+// own thread, or on this one when there is only one
+void editorRunWorkers(void *workers, size_t size, int count, void *(*run)(void *))
+{
+  if (count == 1) {
+    run(workers);
+    return;
+  }
+  pthread_t *threads = nimMalloc(ALLOC_OTHER, sizeof(pthread_t) * count);
+  for (int i = 0; i < count; i++)
+    if (pthread_create(&threads[i], NULL, run, (char *)workers + i * size))
+      die("pthread_create");
+  for (int i = 0; i < count; i++)
+    pthread_join(threads[i], NULL);
+  nimFree(ALLOC_OTHER, threads);
+}
+// }}}
+// Substitute {{{
+#define SUBSTITUTE_MAX_GROUPS 10
+
+struct Substitute {
+  struct RegexSearch search;
+  const char *replacement;
+  int global;
+};
+
+struct SubstituteLine {
+  int row;
+  char *buffer;
+  int size;
+};
+
+struct SubstituteWorker {
+  struct Substitute *substitute;
+  const char *marks;
+  int start, end, alone;
+  regex_t own, *regex;
+  struct SubstituteLine *lines;
+  int linescount, linescapacity;
+  // the groups of every match in the row being changed
+  regmatch_t *matches;
+  int matchescapacity;
+  long long substitutions;
+  struct ColdReader reader;
+};
+
+// length of the replacement for one match, or writes it to output
+int substituteExpand(const char *replacement, const char *line, regmatch_t *groups, char *output)
+{
+  int length = 0;
+  for (const char *r = replacement; *r; r++) {
+    int group = -1;
+    if (*r == '&')
+      group = 0;
+    else if (*r == '\\' && r[1]) {
+      r++;
+      if (isdigit(*r))
+        group = *r - '0';
+    }
+
+    if (group < 0) {
+      if (output)
+        output[length] = *r;
+      length++;
+    } else if (group < SUBSTITUTE_MAX_GROUPS && groups[group].rm_so != -1) {
+      int groupLength = groups[group].rm_eo - groups[group].rm_so;
+      if (output)
+        memcpy(&output[length], &line[groups[group].rm_so], groupLength);
+      length += groupLength;
+    }
+  }
+  return length;
+}
+
+// matches the row once, keeping the groups of every match, and builds
+// the new line from them with a single allocation
+int substituteRow(struct SubstituteWorker *worker, const char *text, int size, struct SubstituteLine *output)
+{
+  struct Substitute *substitute = worker->substitute;
+  if (!regexSearchMayMatch(&substitute->search, text, size))
+    return 0;
+
+  regmatch_t groups[SUBSTITUTE_MAX_GROUPS];
+  int offset = 0, lastEnd = -1, matches = 0, newsize = size;
+  while (offset <= size
+         && regexec(worker->regex, &text[offset], SUBSTITUTE_MAX_GROUPS, groups,
+                    offset ? REG_NOTBOL : 0) == 0) {
+    for (int i = 0; i < SUBSTITUTE_MAX_GROUPS; i++)
+      if (groups[i].rm_so != -1) {
+        groups[i].rm_so += offset;
+        groups[i].rm_eo += offset;
+      }
+
+    // like vim, no empty match right where the previous match ended
+    if (groups[0].rm_so == groups[0].rm_eo && groups[0].rm_so == lastEnd) {
+      offset++;
+      continue;
+    }
+
+    if (matches == worker->matchescapacity) {
+      worker->matchescapacity = worker->matchescapacity ? worker->matchescapacity * 2 : 16;
+      worker->matches = nimRealloc(ALLOC_OTHER, worker->matches,
+                                   sizeof(groups) * worker->matchescapacity);
+    }
+    memcpy(&worker->matches[matches * SUBSTITUTE_MAX_GROUPS], groups, sizeof(groups));
+    newsize += substituteExpand(substitute->replacement, text, groups, NULL)
+      - (groups[0].rm_eo - groups[0].rm_so);
+    matches++;
+
+    offset = groups[0].rm_eo;
+    lastEnd = offset;
+    // an empty match would match again at the same place
+    if (groups[0].rm_so == groups[0].rm_eo)
+      offset++;
+    if (!substitute->global)
+      break;
+  }
+  if (!matches)
+    return 0;
+
+  char *buffer = nimMalloc(ALLOC_ROWS, newsize + 1);
+  int length = 0, end = 0;
+  for (int i = 0; i < matches; i++) {
+    regmatch_t *match = &worker->matches[i * SUBSTITUTE_MAX_GROUPS];
+    memcpy(&buffer[length], &text[end], match[0].rm_so - end);
+    length += match[0].rm_so - end;
+    length += substituteExpand(substitute->replacement, text, match, &buffer[length]);
+    end = match[0].rm_eo;
+  }
+  memcpy(&buffer[length], &text[end], size - end);
+  buffer[newsize] = '\0';
+  output->buffer = buffer;
+  output->size = newsize;
+  return matches;
+}
+
+void *substituteWorkerRun(void *arg)
+{
+  struct SubstituteWorker *worker = arg;
+  worker->regex = regexSearchWorkerRegex(&worker->substitute->search, &worker->own, worker->alone);
+  for (int i = worker->start; i < worker->end; i++) {
+    if (worker->marks && !worker->marks[i])
+      continue;
+    struct SubstituteLine line;
+    // the large file window moves, but there are no cold rows then
+    EditorRow *row = editor.large ? editorRowAt(i) : &editor.rows[i];
+    int matches = substituteRow(worker, editorColdReaderText(&worker->reader, row), row->size, &line);
+    if (!matches)
+      continue;
+
+    if (worker->linescount == worker->linescapacity) {
+      worker->linescapacity = worker->linescapacity ? worker->linescapacity * 2 : 64;
+      worker->lines = nimRealloc(ALLOC_OTHER, worker->lines, sizeof(*worker->lines) * worker->linescapacity);
+    }
+    line.row = i;
+    worker->lines[worker->linescount++] = line;
+    worker->substitutions += matches;
+  }
+  editorColdReaderFree(&worker->reader);
+  regexSearchWorkerDone(&worker->substitute->search, worker->regex);
+  nimFree(ALLOC_OTHER, worker->matches);
+  return NULL;
+}
+
+// the pattern is matched in parallel over slices of the range, then the new
+// lines are swapped in by the main thread in one go. with marks, only the
+// marked rows of the range are looked at.
+void editorSubstitute(struct Range range, const char *marks, const char *pattern,
+                      const char *replacement, const char *flags)
+{
+  // only g and i are done here. the rest, like n which only counts
+  // matches, would otherwise quietly rewrite the buffer
+  if (strspn(flags, "gi") != strlen(flags)) {
+    editorSetPrompt("E488: Trailing characters: %s", flags);
+    return;
+  }
+  struct Substitute substitute;
+  substitute.global = strchr(flags, 'g') != NULL;
+  substitute.replacement = replacement;
+  if (regexSearchCompile(&substitute.search, pattern, strchr(flags, 'i') != NULL) == EXIT_FAILURE)
+    return;
+  if (pattern != editor.substitutePattern) {
+    nimFree(ALLOC_OTHER, editor.substitutePattern);
+    editor.substitutePattern = nimStrndup(ALLOC_OTHER, editor.lastPattern, strlen(editor.lastPattern));
+  }
+  if (replacement != editor.substituteReplacement) {
+    nimFree(ALLOC_OTHER, editor.substituteReplacement);
+    editor.substituteReplacement = nimStrndup(ALLOC_OTHER, replacement, strlen(replacement));
+  }
+
+  int rows = range.end - range.start + 1;
+  int workerscount = editorWorkersFor(rows);
+  struct SubstituteWorker *workers = nimMalloc(ALLOC_OTHER, sizeof(*workers) * workerscount);
+  for (int i = 0; i < workerscount; i++) {
+    memset(&workers[i], 0, sizeof(workers[i]));
+    workers[i].substitute = &substitute;
+    workers[i].marks = marks;
+    workers[i].alone = workerscount == 1;
+    workers[i].start = range.start + (long long)rows * i / workerscount;
+    workers[i].end = range.start + (long long)rows * (i+1) / workerscount;
+  }
+  editorRunWorkers(workers, sizeof(*workers), workerscount, substituteWorkerRun);
+
+  long long substitutions = 0;
+  int lines = 0, lastRow = -1;
+  for (int i = 0; i < workerscount; i++) {
+    for (int j = 0; j < workers[i].linescount; j++) {
+      struct SubstituteLine *line = &workers[i].lines[j];
+      EditorRow *row = editorRowAt(line->row);
+      editorRowAdopt(row, line->buffer, line->size);
+      editorUpdateRow(row);
+      lastRow = line->row;
+    }
+    lines += workers[i].linescount;
+    substitutions += workers[i].substitutions;
+    nimFree(ALLOC_OTHER, workers[i].lines);
+  }
+  nimFree(ALLOC_OTHER, workers);
+  regfree(&substitute.search.regex);
+
+  if (lastRow == -1) {
+    editorSetPrompt("E486: Pattern not found: %s", editor.lastPattern);
+    return;
+  }
+  editor.window->cursory = lastRow;
+  editor.window->cursorx = 0;
+  editor.window->savedcursorx = 0;
+  if (lines > 1)
+    editorSetPrompt("%lld substitutions on %d lines", substitutions, lines);
+}
+
+// what follows a :s with only flags and no pattern, as in ":s g", or NULL
+const char *substituteRepeatFlags(const char *cmd)
+{
+  while (*cmd == ' ')
+    cmd++;
+  return strspn(cmd, "&cegiIn") == strlen(cmd) ? cmd : NULL;
+}
+
+// :s without a pattern runs the last substitution again, with the new
+// flags, like vim's :&
+void editorSubstituteRepeat(struct Range range, const char *marks, const char *flags)
+{
+  if (editor.substitutePattern == NULL) {
+    editorSetPrompt("E35: No previous regular expression");
+    return;
+  }
+  editorSubstitute(range, marks, editor.substitutePattern, editor.substituteReplacement, flags);
+}
+// }}}
+// Global {{{
+struct GlobalWorker {
+  struct RegexSearch *search;
+  regex_t own, *regex;
+  char *marks;
+  int start, end, alone;
+  int invert;
+  int marked;
+  struct ColdReader reader;
+};
+
+void *globalWorkerRun(void *arg)
+{
+  struct GlobalWorker *worker = arg;
+  worker->regex = regexSearchWorkerRegex(worker->search, &worker->own, worker->alone);
+  for (int i = worker->start; i < worker->end; i++) {
+    EditorRow *row = editor.large ? editorRowAt(i) : &editor.rows[i];
+    const char *text = editorColdReaderText(&worker->reader, row);
+    worker->marks[i] = regexSearchLine(worker->search, worker->regex, text, row->size) != worker->invert;
+    worker->marked += worker->marks[i];
+  }
+  editorColdReaderFree(&worker->reader);
+  regexSearchWorkerDone(worker->search, worker->regex);
+  return NULL;
+}
+
+// one pass over the whole row array: marked rows are freed and the rest
+// slide down over them. like a :d per line in vim, the last ones deleted
+// go to "1 to "9 and the unnamed register.
+void editorDeleteMarkedRows(const char *marks)
+{
+  editorRegistersRemoveMarked(marks);
+  editorFoldsRemoveMarked(marks);
+  editorWordsRemoveMarked(marks);
+  editorWindowsRemoveMarked(marks);
+  int marked = 0;
+  for (int i = 0; i < (int)editor.rowscount; i++)
+    marked += marks[i];
+  int write = 0, cursory = -1;
+  for (int read = 0; read < (int)editor.rowscount; read++) {
+    if (marks[read]) {
+      if (marked-- <= 9)
+        editorRegisterStore(editorYankRow(&editor.rows[read]), 1);
+      else
+        editorFreeRow(&editor.rows[read]);
+      cursory = write;
+      continue;
+    }
+    editor.rows[write++] = editor.rows[read];
+  }
+  int deleted = editor.rowscount - write;
+  editor.rowscount = write;
+
+  if (cursory >= (int)editor.rowscount)
+    cursory = editor.rowscount - 1;
+  editor.window->cursory = cursory < 0 ? 0 : cursory;
+  editor.window->cursorx = 0;
+  if (deleted > 1)
+    editorSetPrompt("%d fewer lines", deleted);
+}
+
+// :p on the marked rows, which :g runs without a command. batch mode
+// writes them to stdout in one go. the prompt has room for one, so on the
+// screen the last one is shown there, with the cursor on it.
+void editorPrintMarkedRows(const char *marks)
+{
+  struct appendBuffer output = ABUF_INIT_FOR(ALLOC_OUTPUT);
+  int last = -1;
+  for (int i = 0; i < (int)editor.rowscount; i++) {
+    if (!marks[i])
+      continue;
+    last = i;
+    if (editor.headless) {
+      EditorRow *row = editorRowAt(i);
+      abAppend(&output, editorRowText(row), row->size);
+      abAppend(&output, "\n", 1);
+    }
+  }
+  if (editor.headless)
+    writeAll(STDOUT_FILENO, output.buffer, output.length);
+  abFree(&output);
+
+  EditorRow *row = editorRowAt(last);
+  editorSetPrompt("%.*s", row->size, editorRowText(row));
+  editor.window->cursory = last;
+  editor.window->cursorx = 0;
+}
+
+// :g/pat/cmd and :v/pat/cmd (or :g!). matching rows are marked first, in
+// parallel, and the command then runs over all of them at once instead of
+// one row at a time.
+void editorGlobal(struct Range range, char *cmd, int invert)
+{
+  char *fields[1];
+  char *command = editorSplitPattern(cmd, fields, 1);
+  if (command == NULL) {
+    editorSetPrompt("E146: Regular expressions can't be delimited by letters");
+    return;
+  }
+
+  struct RegexSearch search;
+  if (regexSearchCompile(&search, fields[0], 0) == EXIT_FAILURE)
+    return;
+
+  char *marks = nimMalloc(ALLOC_OTHER, editor.rowscount ? editor.rowscount : 1);
+  memset(marks, 0, editor.rowscount);
+  int rows = range.end - range.start + 1;
+  int workerscount = editorWorkersFor(rows);
+  struct GlobalWorker *workers = nimMalloc(ALLOC_OTHER, sizeof(*workers) * workerscount);
+  for (int i = 0; i < workerscount; i++) {
+    memset(&workers[i], 0, sizeof(workers[i]));
+    workers[i].search = &search;
+    workers[i].marks = marks;
+    workers[i].alone = workerscount == 1;
+    workers[i].invert = invert;
+    workers[i].start = range.start + (long long)rows * i / workerscount;
+    workers[i].end = range.start + (long long)rows * (i+1) / workerscount;
+  }
+  editorRunWorkers(workers, sizeof(*workers), workerscount, globalWorkerRun);
+
+  int marked = 0;
+  for (int i = 0; i < workerscount; i++)
+    marked += workers[i].marked;
+  nimFree(ALLOC_OTHER, workers);
+  regfree(&search.regex);
+
+  while (*command == ' ')
+    command++;
+
+  if (!marked)
+    editorSetPrompt("E486: Pattern not found: %s", editor.lastPattern);
+  else if (*command == '\0' || (*command == 'p' && !strncmp(command, "print", strlen(command))))
+    editorPrintMarkedRows(marks);
+  else if (*command == 'd' && (command[1] == '\0' || !strncmp(command, "delete", strlen(command))))
+    editorDeleteMarkedRows(marks);
+  else if (*command == 's' && !isalpha(command[1])) {
+    char *subfields[3];
+    const char *flags = substituteRepeatFlags(command + 1);
+    if (flags)
+      editorSubstituteRepeat(range, marks, flags);
+    else if (editorSplitPattern(command + 1, subfields, 3))
+      editorSubstitute(range, marks, subfields[0], subfields[1], subfields[2]);
+    else
+      editorSetPrompt("E146: Regular expressions can't be delimited by letters");
+  } else
+    editorSetPrompt("E492: Not supported by :g: %s", command);
+
+  nimFree(ALLOC_OTHER, marks);
+}
+// }}}
+// Tags {{{
+// the tags file is mapped rather than read. a sorted one (ctags sorts
+// them by default) is binary searched, which touches a few of its pages
+// however big it is, and an unsorted one is scanned in parallel chunks.
+#define TAGS_CHUNK (16 * 1024 * 1024)
+struct TagsFile {
+  const char *map;
+  size_t size;
+  // !_TAG_FILE_SORTED: 0 unsorted, 1 sorted, 2 sorted ignoring case
+  int sorted;
+  // what the file names in it are relative to, "" or ending in /
+  char *directory;
+};
+// offsets of the lines of the tags that matched, in file order
+struct TagsFound {
+  size_t *offsets;
+  int count, capacity;
+};
+// where a tag line points: its file, and a line number or a pattern
+// that is text to find, at the start or end of a row when anchored
+struct TagTarget {
+  char *filename;
+  int line;
+  char *pattern;
+  int length, anchorStart, anchorEnd;
+};
+
+// the tags file next to the current file, or the one in the working
+// directory
+int editorTagsOpen(struct TagsFile *tags)
+{
+  const char *slash = editor.filename ? strrchr(editor.filename, '/') : NULL;
+  int prefix = slash ? slash - editor.filename + 1 : 0;
+  for (int i = prefix ? 0 : 1; i < 2; i++) {
+    int length = i ? 0 : prefix;
+    char *path = nimMalloc(ALLOC_OTHER, length + sizeof("tags"));
+    if (length)
+      memcpy(path, editor.filename, length);
+    memcpy(path + length, "tags", sizeof("tags"));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fd != -1) {
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+    }
+    if (map == MAP_FAILED) {
+      nimFree(ALLOC_OTHER, path);
+      continue;
+    }
+    path[length] = '\0';
+    tags->directory = path;
+    tags->map = map;
+    tags->size = st.st_size;
+
+    // the header lines start with ! and come first
+    tags->sorted = 0;
+    const char *line = tags->map, *end = tags->map + tags->size;
+    while (line < end && *line == '!') {
+      const char *next = memchr(line, '\n', end - line);
+      next = next ? next + 1 : end;
+      if (next - line > 19 && !memcmp(line, "!_TAG_FILE_SORTED\t", 18) && (line[18] == '1' || line[18] == '2'))
+        tags->sorted = line[18] - '0';
+      line = next;
+    }
+    madvise(map, tags->size, tags->sorted ? MADV_RANDOM : MADV_SEQUENTIAL);
+    return EXIT_SUCCESS;
+  }
+  return EXIT_FAILURE;
+}
+
+void editorTagsClose(struct TagsFile *tags)
+{
+  munmap((void *)tags->map, tags->size);
+  nimFree(ALLOC_OTHER, tags->directory);
+}
+
+void tagsFoundAdd(struct TagsFound *found, size_t offset)
+{
+  if (found->count == found->capacity) {
+    found->capacity = found->capacity ? found->capacity * 2 : 8;
+    found->offsets = nimRealloc(ALLOC_OTHER, found->offsets, sizeof(size_t) * found->capacity);
+  }
+  found->offsets[found->count++] = offset;
+}
+
+// the start of the first line at or after offset
+size_t tagsLineStart(struct TagsFile *tags, size_t offset)
+{
+  if (offset == 0)
+    return 0;
+  const char *newline = memchr(tags->map + offset - 1, '\n', tags->size - offset + 1);
+  return newline ? (size_t)(newline - tags->map) + 1 : tags->size;
+}
+
+// orders the name of the tag on the line at offset against name the way
+// the file is sorted: bytes, or bytes in upper case. a tab ends the name
+// and sorts before any character, so a shorter name comes first.
+int tagsCompare(struct TagsFile *tags, size_t offset, const char *name, int length, int foldcase)
+{
+  const char *line = tags->map + offset;
+  size_t room = tags->size - offset;
+  for (int i = 0; i < length; i++) {
+    if ((size_t)i >= room || line[i] == '\t' || line[i] == '\n')
+      return -1;
+    int a = (unsigned char)line[i], b = (unsigned char)name[i];
+    if (foldcase) {
+      a = toupper(a);
+      b = toupper(b);
+    }
+    if (a != b)
+      return a - b;
+  }
+  return (size_t)length < room && line[length] != '\t' && line[length] != '\n';
+}
+
+// the lines of a sorted file whose name sorts the same as name are next
+// to each other, after the last one that sorts before it. a lookup reads
+// a line at about log2(size) offsets, each one page or two.
+void editorTagsSearch(struct TagsFile *tags, const char *name, int length, struct TagsFound *found)
+{
+  int foldcase = tags->sorted == 2;
+  // lines that start before low sort before name, the ones from high on don't
+  size_t low = 0, high = tags->size;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    size_t line = tagsLineStart(tags, middle);
+    if (line >= high)
+      high = middle;
+    else if (tagsCompare(tags, line, name, length, foldcase) < 0)
+      low = tagsLineStart(tags, line + 1);
+    else
+      high = line;
+  }
+  for (size_t line = low; line < tags->size; line = tagsLineStart(tags, line + 1)) {
+    if (tagsCompare(tags, line, name, length, foldcase))
+      break;
+    if (!foldcase || !tagsCompare(tags, line, name, length, 0))
+      tagsFoundAdd(found, line);
+  }
+}
+
+struct TagsWorker {
+  struct TagsFile *tags;
+  const char *name;
+  int length;
+  // the lines that start in [start, end)
+  size_t start, end;
+  struct TagsFound found;
+};
+
+// the other lines of a tag are a newline, its name and a tab, which
+// memmem finds a lot faster than looking at every line
+void *tagsWorkerRun(void *arg)
+{
+  struct TagsWorker *worker = arg;
+  struct TagsFile *tags = worker->tags;
+  if (worker->start == 0 && !tagsCompare(tags, 0, worker->name, worker->length, 0))
+    tagsFoundAdd(&worker->found, 0);
+
+  size_t needlesize = worker->length + 2;
+  char *needle = nimMalloc(ALLOC_OTHER, needlesize);
+  needle[0] = '\n';
+  memcpy(needle + 1, worker->name, worker->length);
+  needle[needlesize - 1] = '\t';
+  // the newlines before the lines that start in [start, end)
+  const char *from = tags->map + (worker->start ? worker->start - 1 : 0);
+  const char *last = tags->map + worker->end - 1;
+  const char *end = worker->end - 1 + needlesize < tags->size ? last + needlesize : tags->map + tags->size;
+  const char *found;
+  while (from < last && (found = memmem(from, end - from, needle, needlesize)) && found < last) {
+    tagsFoundAdd(&worker->found, found - tags->map + 1);
+    from = found + 1;
+  }
+  nimFree(ALLOC_OTHER, needle);
+  return NULL;
+}
+
+// an unsorted file is read through, a chunk of it per cpu
+void editorTagsScan(struct TagsFile *tags, const char *name, int length, struct TagsFound *found)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workerscount = tags->size / TAGS_CHUNK + 1;
+  if (workerscount > cpus)
+    workerscount = cpus;
+  if (workerscount < 1)
+    workerscount = 1;
+  struct TagsWorker *workers = nimMalloc(ALLOC_OTHER, sizeof(*workers) * workerscount);
+  size_t chunk = tags->size / workerscount;
+  for (int i = 0; i < workerscount; i++)
+    workers[i] = (struct TagsWorker){tags, name, length, chunk * i,
+                                     i == workerscount - 1 ? tags->size : chunk * (i + 1)};
+  editorRunWorkers(workers, sizeof(*workers), workerscount, tagsWorkerRun);
+  for (int i = 0; i < workerscount; i++) {
+    for (int j = 0; j < workers[i].found.count; j++)
+      tagsFoundAdd(found, workers[i].found.offsets[j]);
+    nimFree(ALLOC_OTHER, workers[i].found.offsets);
+  }
+  nimFree(ALLOC_OTHER, workers);
+}
+
+// a tag line is name<Tab>file<Tab>address, and ;" after the address
+// starts more fields. the address is a line number, or a /pattern/ (or
+// ?pattern?) in which, as ctags writes them, only ^ and $ are special.
+int editorTagParse(struct TagsFile *tags, size_t offset, struct TagTarget *target)
+{
+  const char *line = tags->map + offset, *end = tags->map + tags->size;
+  const char *newline = memchr(line, '\n', end - line);
+  if (newline)
+    end = newline;
+  const char *file = memchr(line, '\t', end - line);
+  const char *address = file ? memchr(file + 1, '\t', end - file - 1) : NULL;
+  if (!address || address == file + 1 || address + 1 == end)
+    return EXIT_FAILURE;
+  file++;
+  int length = address - file;
+  address++;
+
+  memset(target, 0, sizeof(*target));
+  if (*address == '/' || *address == '?') {
+    char delimiter = *address++;
+    target->pattern = nimMalloc(ALLOC_OTHER, end - address + 1);
+    if (address < end && *address == '^') {
+      target->anchorStart = 1;
+      address++;
+    }
+    while (address < end && *address != delimiter) {
+      if (*address == '\\' && address + 1 < end && (address[1] == delimiter || address[1] == '\\'))
+        address++;
+      target->pattern[target->length++] = *address++;
+    }
+    if (target->length && target->pattern[target->length - 1] == '$'
+        && (target->length < 2 || target->pattern[target->length - 2] != '\\')) {
+      target->anchorEnd = 1;
+      target->length--;
+    }
+  } else {
+    for (; address < end && isdigit((unsigned char)*address); address++)
+      target->line = target->line * 10 + *address - '0';
+    if (!target->line)
+      return EXIT_FAILURE;
+  }
+
+  int prefix = *file == '/' ? 0 : strlen(tags->directory);
+  target->filename = nimMalloc(ALLOC_OTHER, prefix + length + 1);
+  memcpy(target->filename, tags->directory, prefix);
+  memcpy(target->filename + prefix, file, length);
+  target->filename[prefix + length] = '\0';
+  return EXIT_SUCCESS;
+}
+
+// the first row the pattern matches in, with the column in column
+int editorTagFind(struct TagTarget *target, int *column)
+{
+  for (int i = 0; i < (int)editor.rowscount; i++) {
+    EditorRow *row = editor.large ? editorRowAt(i) : &editor.rows[i];
+    const char *text = editorRowText(row);
+    int size = row->size, length = target->length;
+    if (size < length)
+      continue;
+    int from = target->anchorEnd ? size - length : 0;
+    int to = target->anchorStart ? 0 : size - length;
+    for (int x = from; x <= to; x++) {
+      if (!memcmp(text + x, target->pattern, length)) {
+        *column = x;
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+// opens filename, unless it is the file that is open already
+int editorTagEdit(char *filename)
+{
+  struct stat target, current;
+  if (stat(filename, &target) == -1) {
+    editorSetPrompt("E429: File \"%s\" does not exist", filename);
+    return EXIT_FAILURE;
+  }
+  if (editor.filename && stat(editor.filename, &current) == 0
+      && current.st_dev == target.st_dev && current.st_ino == target.st_ino)
+    return EXIT_SUCCESS;
+  if (editor.changes != editor.savedChanges) {
+    editorSetPrompt("E37: No write since last change");
+    return EXIT_FAILURE;
+  }
+  editorOpen(filename);
+  return EXIT_SUCCESS;
+}
+
+// puts the cursor on row, in the middle of the window when it was off it
+void editorTagGoto(int row, int column)
+{
+  struct Window *window = editor.window;
+  if (row >= (int)editor.rowscount)
+    row = editor.rowscount - 1;
+  if (row < 0)
+    row = 0;
+  window->cursory = row;
+  editorSetCursorx(column);
+  editorWindowCurrent(window);
+  editorFoldReveal(row);
+  int line = editorFoldLine(row), top = editorFoldLine(window->rowoffset);
+  if (line < top || line >= top + window->rows)
+    window->rowoffset = editorFoldRow(line > window->rows / 2 ? line - window->rows / 2 : 0);
+}
+
+void editorTagFree(struct TagEntry *entry)
+{
+  nimFree(ALLOC_OTHER, entry->name);
+  nimFree(ALLOC_OTHER, entry->filename);
+}
+
+// Ctrl-] and :tag. the first tag called name is jumped to, and where the
+// cursor was goes on the tag stack.
+void editorTagJump(const char *name, int length)
+{
+  if (editor.hex) {
+    editorSetPrompt("Tags aren't available in binary mode");
+    return;
+  }
+  struct TagsFile tags;
+  if (editorTagsOpen(&tags) == EXIT_FAILURE) {
+    editorSetPrompt("E433: No tags file");
+    return;
+  }
+  struct TagsFound found = {0};
+  if (tags.sorted)
+    editorTagsSearch(&tags, name, length, &found);
+  else
+    editorTagsScan(&tags, name, length, &found);
+  struct TagTarget target;
+  int parsed = found.count && editorTagParse(&tags, found.offsets[0], &target) == EXIT_SUCCESS;
+  int count = found.count;
+  nimFree(ALLOC_OTHER, found.offsets);
+  editorTagsClose(&tags);
+  if (!parsed) {
+    editorSetPrompt("E426: Tag not found: %.*s", length, name);
+    return;
+  }
+
+  struct TagEntry from = {
+    nimStrndup(ALLOC_OTHER, name, length),
+    editor.filename ? nimStrndup(ALLOC_OTHER, editor.filename, strlen(editor.filename)) : NULL,
+    editor.window->cursorx, editor.window->cursory,
+  };
+  if (editorTagEdit(target.filename) == EXIT_FAILURE) {
+    editorTagFree(&from);
+  } else {
+    struct TagStack *stack = &editor.tags;
+    if (stack->count == TAG_STACK_MAX) {
+      editorTagFree(&stack->entries[0]);
+      memmove(stack->entries, stack->entries + 1, sizeof(*stack->entries) * --stack->count);
+    }
+    stack->entries[stack->count++] = from;
+
+    int row = target.line - 1, column = 0;
+    if (target.pattern)
+      row = editorTagFind(&target, &column);
+    if (row == -1)
+      editorSetPrompt("E434: Can't find tag pattern");
+    else {
+      editorTagGoto(row, column);
+      if (count > 1)
+        editorSetPrompt("tag 1 of %d", count);
+    }
+  }
+  nimFree(ALLOC_OTHER, target.filename);
+  nimFree(ALLOC_OTHER, target.pattern);
+}
+
+// Ctrl-] jumps to the keyword under the cursor, or the next one after it
+void editorTagJumpCursor()
+{
+  EditorRow *row = getCurrentRow();
+  int x = editor.window->cursorx;
+  const char *text = row ? editorRowText(row) : NULL;
+  while (row && x < row->size && editorCharWordType(text[x]) != WT_WORD)
+    x++;
+  if (!row || x >= row->size) {
+    editorSetPrompt("E349: No identifier under cursor");
+    return;
+  }
+  int start = scanClassRunBack(text, x, 0, WT_WORD) + 1;
+  int end = scanClassRun(text, x, row->size, WT_WORD);
+  editorTagJump(text + start, end - start);
+}
+
+// Ctrl-T and :pop go back to where the last jump was made from
+void editorTagPop()
+{
+  struct TagStack *stack = &editor.tags;
+  if (!stack->count) {
+    editorSetPrompt("E73: Tag stack empty");
+    return;
+  }
+  struct TagEntry *entry = &stack->entries[stack->count - 1];
+  if (entry->filename && editorTagEdit(entry->filename) == EXIT_FAILURE)
+    return;
+  stack->count--;
+  editorTagGoto(entry->cursory, entry->cursorx);
+  editorTagFree(entry);
+}
+// }}}
+// Keymap {{{
+// a trie over keys. the children of a node are indexed by key, so walking
+// it costs one array lookup per key. nodes refer to each other by their
+// index in the pool, and 0 (the root) doubles as no child.
+#define KEY_SLOTS (256 + KEY_LAST - TOP)
+#define KEYMAP_MAX_NODES 0xffff
+#define KEYMAP_MAX_DEPTH 100
+#define TTIMEOUTLEN_DEFAULT 50
+#define TIMEOUTLEN_DEFAULT 1000
+enum BindingFlags {
+  // also bound after d and y, which then delete or yank what it moved over
+  BINDING_MOTION = 1,
+  // the key after it is its argument, as in f{char}
+  BINDING_ARGUMENT = 2,
+  // d and y take the character the motion lands on too, as with d$
+  BINDING_INCLUSIVE = 4,
+};
+struct KeyNode {
+  unsigned short next[KEY_SLOTS];
+  int children;
+  // built in bindings: what to run once the keys are complete
+  int command, flags;
+  char operator;
+  // user mappings: the keys to feed instead
+  int *rhs, rhscount, noremap;
+};
+struct Keymap {
+  struct KeyNode *nodes;
+  int count, capacity;
+};
+// terminal escape sequences, the built in normal, visual and hex view
+// commands, and the normal and insert mode mappings from :map
+struct Keymap terminalKeymap, normalKeymap, visualKeymap, hexKeymap, normalMaps, insertMaps;
+
+struct Binding {
+  int keys[3];
+  int command, flags;
+};
+const struct Binding normalBindings[] = {
+  {{'i'}, 'i'}, {{'I'}, 'I'}, {{'a'}, 'a'}, {{'A'}, 'A'},
+  {{'o'}, 'o'}, {{'O'}, 'O'}, {{'D'}, 'D'}, {{'J'}, 'J'},
+  {{'x'}, 'x'}, {{KEY_DELETE}, 'x'}, {{':'}, ':'},
+  {{'d', 'd'}, DELETE_LINE}, {{'y', 'y'}, YANK_LINE}, {{'Y'}, YANK_LINE},
+  {{'p'}, 'p'}, {{'P'}, 'P'}, {{'"'}, '"', BINDING_ARGUMENT},
+  {{'f'}, 'f', BINDING_MOTION | BINDING_ARGUMENT | BINDING_INCLUSIVE},
+  {{'t'}, 't', BINDING_MOTION | BINDING_ARGUMENT | BINDING_INCLUSIVE},
+  {{'q'}, 'q', BINDING_ARGUMENT}, {{'@'}, '@', BINDING_ARGUMENT}, {{'.'}, '.'},
+  {{'v'}, 'v'}, {{'V'}, 'V'}, {{CTRL_KEY('v')}, CTRL_KEY('v')},
+  {{CTRL_KEY('f')}, CTRL_KEY('f')}, {{KEY_PAGE_DOWN}, CTRL_KEY('f')},
+  {{CTRL_KEY('b')}, CTRL_KEY('b')}, {{KEY_PAGE_UP}, CTRL_KEY('b')},
+  {{KEY_LEFT}, KEY_LEFT, BINDING_MOTION}, {{KEY_ARROW_LEFT}, KEY_LEFT, BINDING_MOTION},
+  {{KEY_RIGHT}, KEY_RIGHT, BINDING_MOTION}, {{KEY_ARROW_RIGHT}, KEY_RIGHT, BINDING_MOTION},
+  {{KEY_DOWN}, KEY_DOWN, BINDING_MOTION}, {{'+'}, '+', BINDING_MOTION},
+  {{KEY_ARROW_DOWN}, KEY_DOWN, BINDING_MOTION},
+  {{KEY_UP}, KEY_UP, BINDING_MOTION}, {{'-'}, '-', BINDING_MOTION},
+  {{KEY_ARROW_UP}, KEY_UP, BINDING_MOTION},
+  {{KEY_LINE_START}, KEY_LINE_START, BINDING_MOTION},
+  {{KEY_LINE_FIRST}, KEY_LINE_FIRST, BINDING_MOTION}, {{KEY_HOME}, KEY_LINE_FIRST, BINDING_MOTION},
+  {{KEY_LINE_END}, KEY_LINE_END, BINDING_MOTION | BINDING_INCLUSIVE},
+  {{KEY_END}, KEY_LINE_END, BINDING_MOTION | BINDING_INCLUSIVE},
+  {{WORD_NEXT}, WORD_NEXT, BINDING_MOTION},
+  {{WORD_END}, WORD_END, BINDING_MOTION | BINDING_INCLUSIVE},
+  {{BIGWORD_END}, BIGWORD_END, BINDING_MOTION | BINDING_INCLUSIVE},
+  {{WORD_BACK}, WORD_BACK, BINDING_MOTION},
+  {{'g', 'e'}, WORD_END_BACK, BINDING_MOTION},
+  {{'g', 'g'}, TOP, BINDING_MOTION},
+  {{BOTTOM}, BOTTOM, BINDING_MOTION},
+  {{'z', 'o'}, FOLD_OPEN}, {{'z', 'c'}, FOLD_CLOSE}, {{'z', 'a'}, FOLD_TOGGLE},
+  {{'z', 'R'}, FOLD_OPEN_ALL}, {{'z', 'M'}, FOLD_CLOSE_ALL},
+  {{CTRL_KEY(']')}, CTRL_KEY(']')}, {{CTRL_KEY('t')}, CTRL_KEY('t')},
+};
+// besides these, visual mode has every motion from normalBindings
+const struct Binding visualBindings[] = {
+  {{'v'}, 'v'}, {{'V'}, 'V'}, {{CTRL_KEY('v')}, CTRL_KEY('v')}, {{'o'}, 'o'},
+  {{'d'}, 'd'}, {{'x'}, 'd'}, {{KEY_DELETE}, 'd'}, {{'c'}, 'c'}, {{'s'}, 'c'},
+  {{'I'}, 'I'}, {{'A'}, 'A'}, {{'f'}, 'f', BINDING_ARGUMENT},
+  {{'y'}, 'y'}, {{'Y'}, 'Y'}, {{'"'}, '"', BINDING_ARGUMENT}, {{':'}, ':'},
+};
+// normal mode in the hex view. the motions move over bytes and lines of
+// the dump, and r and R overwrite digits or characters.
+const struct Binding hexBindings[] = {
+  {{KEY_LEFT}, KEY_LEFT}, {{KEY_ARROW_LEFT}, KEY_LEFT}, {{BACKSPACE}, KEY_LEFT},
+  {{KEY_RIGHT}, KEY_RIGHT}, {{KEY_ARROW_RIGHT}, KEY_RIGHT}, {{' '}, KEY_RIGHT},
+  {{KEY_DOWN}, KEY_DOWN}, {{'+'}, '+'}, {{KEY_ARROW_DOWN}, KEY_DOWN}, {{ENTER}, KEY_DOWN},
+  {{KEY_UP}, KEY_UP}, {{'-'}, '-'}, {{KEY_ARROW_UP}, KEY_UP},
+  {{KEY_LINE_START}, KEY_LINE_START},
+  {{KEY_LINE_FIRST}, KEY_LINE_FIRST}, {{KEY_HOME}, KEY_LINE_FIRST},
+  {{KEY_LINE_END}, KEY_LINE_END}, {{KEY_END}, KEY_LINE_END},
+  {{'g', 'g'}, TOP}, {{BOTTOM}, BOTTOM},
+  {{CTRL_KEY('f')}, CTRL_KEY('f')}, {{KEY_PAGE_DOWN}, CTRL_KEY('f')},
+  {{CTRL_KEY('b')}, CTRL_KEY('b')}, {{KEY_PAGE_UP}, CTRL_KEY('b')},
+  {{'\t'}, '\t'}, {{'r'}, 'r', BINDING_ARGUMENT}, {{'R'}, 'R'},
+  {{'.'}, '.'}, {{':'}, ':'},
+};
+// Ctrl-W, in normal mode and the hex view alike
+const struct Binding windowBindings[] = {
+  {{CTRL_KEY('w'), 's'}, WINDOW_SPLIT}, {{CTRL_KEY('w'), 'S'}, WINDOW_SPLIT},
+  {{CTRL_KEY('w'), 'v'}, WINDOW_VSPLIT},
+  {{CTRL_KEY('w'), 'w'}, WINDOW_NEXT}, {{CTRL_KEY('w'), CTRL_KEY('w')}, WINDOW_NEXT},
+  {{CTRL_KEY('w'), 'W'}, WINDOW_PREVIOUS},
+  {{CTRL_KEY('w'), 'h'}, WINDOW_LEFT}, {{CTRL_KEY('w'), KEY_ARROW_LEFT}, WINDOW_LEFT},
+  {{CTRL_KEY('w'), 'j'}, WINDOW_DOWN}, {{CTRL_KEY('w'), KEY_ARROW_DOWN}, WINDOW_DOWN},
+  {{CTRL_KEY('w'), 'k'}, WINDOW_UP}, {{CTRL_KEY('w'), KEY_ARROW_UP}, WINDOW_UP},
+  {{CTRL_KEY('w'), 'l'}, WINDOW_RIGHT}, {{CTRL_KEY('w'), KEY_ARROW_RIGHT}, WINDOW_RIGHT},
+  {{CTRL_KEY('w'), 'c'}, WINDOW_CLOSE}, {{CTRL_KEY('w'), 'o'}, WINDOW_ONLY},
+  {{CTRL_KEY('w'), 'q'}, WINDOW_QUIT},
+};
+
+struct TerminalKey {
+  const char *sequence;
+  int key;
+};
+// what xterm compatible terminals send, in both cursor key modes
+const struct TerminalKey terminalKeys[] = {
+  {"\x1b[A", KEY_ARROW_UP}, {"\x1b[B", KEY_ARROW_DOWN},
+  {"\x1b[C", KEY_ARROW_RIGHT}, {"\x1b[D", KEY_ARROW_LEFT},
+  {"\x1bOA", KEY_ARROW_UP}, {"\x1bOB", KEY_ARROW_DOWN},
+  {"\x1bOC", KEY_ARROW_RIGHT}, {"\x1bOD", KEY_ARROW_LEFT},
+  {"\x1b[H", KEY_HOME}, {"\x1bOH", KEY_HOME}, {"\x1b[1~", KEY_HOME}, {"\x1b[7~", KEY_HOME},
+  {"\x1b[F", KEY_END}, {"\x1bOF", KEY_END}, {"\x1b[4~", KEY_END}, {"\x1b[8~", KEY_END},
+  {"\x1b[3~", KEY_DELETE}, {"\x1b[5~", KEY_PAGE_UP}, {"\x1b[6~", KEY_PAGE_DOWN},
+};
+
+struct KeyName {
+  const char *name;
+  int key;
+};
+// the <...> names :map understands, besides <C-x>
+const struct KeyName keyNames[] = {
+  {"Esc", ESC}, {"CR", ENTER}, {"Enter", ENTER}, {"Return", ENTER},
+  {"Tab", '\t'}, {"BS", BACKSPACE}, {"Space", ' '}, {"lt", '<'}, {"Bar", '|'},
+  {"Left", KEY_ARROW_LEFT}, {"Right", KEY_ARROW_RIGHT}, {"Up", KEY_ARROW_UP}, {"Down", KEY_ARROW_DOWN},
+  {"Home", KEY_HOME}, {"End", KEY_END}, {"Del", KEY_DELETE},
+  {"PageUp", KEY_PAGE_UP}, {"PageDown", KEY_PAGE_DOWN},
+};
+
+int keySlot(int key)
+{
+  return key < 256 ? key : 256 + key - TOP;
+}
+
+int keymapNext(struct Keymap *map, int node, int key)
+{
+  if (!map->count || key < 0 || key >= KEY_LAST)
+    return 0;
+  return map->nodes[node].next[keySlot(key)];
+}
+
+int keymapNewNode(struct Keymap *map)
+{
+  if (map->count == map->capacity) {
+    map->capacity = map->capacity ? map->capacity * 2 : 32;
+    map->nodes = nimRealloc(ALLOC_OTHER, map->nodes, sizeof(struct KeyNode) * map->capacity);
+  }
+  memset(&map->nodes[map->count], 0, sizeof(struct KeyNode));
+  return map->count++;
+}
+
+// the node for keys, creating the path to it. -1 when the map is full.
+int keymapAdd(struct Keymap *map, const int *keys, int keyscount)
+{
+  if (!map->count)
+    keymapNewNode(map);
+  int node = 0;
+  for (int i = 0; i < keyscount; i++) {
+    int slot = keySlot(keys[i]);
+    if (!map->nodes[node].next[slot]) {
+      if (map->count == KEYMAP_MAX_NODES)
+        return -1;
+      int child = keymapNewNode(map);
+      map->nodes[node].next[slot] = child;
+      map->nodes[node].children++;
+    }
+    node = map->nodes[node].next[slot];
+  }
+  return node;
+}
+
+void keymapBind(struct Keymap *map, const int *keys, int keyscount, const struct Binding *binding, char operator)
+{
+  int index = keymapAdd(map, keys, keyscount);
+  struct KeyNode *node = &map->nodes[index];
+  node->command = binding->command;
+  node->flags = binding->flags;
+  node->operator = operator;
+}
+
+// builds the tries once, the bindings never change after that
+void keymapCompile()
+{
+  if (normalKeymap.count)
+    return;
+
+  for (size_t i = 0; i < sizeof(normalBindings) / sizeof(*normalBindings); i++) {
+    const struct Binding *binding = &normalBindings[i];
+    int keys[4];
+    int keyscount = 0;
+    while (keyscount < 3 && binding->keys[keyscount]) {
+      keys[keyscount+1] = binding->keys[keyscount];
+      keyscount++;
+    }
+    keymapBind(&normalKeymap, keys+1, keyscount, binding, 0);
+    if (binding->flags & BINDING_MOTION) {
+      for (const char *operator = "dy"; *operator; operator++) {
+        keys[0] = *operator;
+        keymapBind(&normalKeymap, keys, keyscount+1, binding, *operator);
+      }
+      keymapBind(&visualKeymap, keys+1, keyscount, binding, 0);
+    }
+  }
+  for (size_t i = 0; i < sizeof(visualBindings) / sizeof(*visualBindings); i++)
+    keymapBind(&visualKeymap, visualBindings[i].keys, 1, &visualBindings[i], 0);
+  for (size_t i = 0; i < sizeof(hexBindings) / sizeof(*hexBindings); i++) {
+    const struct Binding *binding = &hexBindings[i];
+    keymapBind(&hexKeymap, binding->keys, binding->keys[1] ? 2 : 1, binding, 0);
+  }
+  for (size_t i = 0; i < sizeof(windowBindings) / sizeof(*windowBindings); i++) {
+    keymapBind(&normalKeymap, windowBindings[i].keys, 2, &windowBindings[i], 0);
+    keymapBind(&hexKeymap, windowBindings[i].keys, 2, &windowBindings[i], 0);
+  }
+
+  for (size_t i = 0; i < sizeof(terminalKeys) / sizeof(*terminalKeys); i++) {
+    int keys[8];
+    int keyscount = 0;
+    for (const char *c = terminalKeys[i].sequence; *c; c++)
+      keys[keyscount++] = (unsigned char)*c;
+    int node = keymapAdd(&terminalKeymap, keys, keyscount);
+    terminalKeymap.nodes[node].command = terminalKeys[i].key;
+  }
+}
+
+// vim's key notation: <Esc>, <C-x>, <Left> and so on. anything else is
+// the key itself.
+int keymapParseKeys(const char *s, int *keys, int max)
+{
+  int count = 0;
+  while (*s && count < max) {
+    const char *end = *s == '<' ? strchr(s, '>') : NULL;
+    if (end) {
+      const char *name = s + 1;
+      int length = end - name, key = -1;
+      if (length == 3 && (name[0] == 'C' || name[0] == 'c') && name[1] == '-')
+        key = CTRL_KEY(name[2]);
+      for (size_t i = 0; key == -1 && i < sizeof(keyNames) / sizeof(*keyNames); i++)
+        if ((int)strlen(keyNames[i].name) == length && !strncasecmp(name, keyNames[i].name, length))
+          key = keyNames[i].key;
+      if (key != -1) {
+        keys[count++] = key;
+        s = end + 1;
+        continue;
+      }
+    }
+    keys[count++] = (unsigned char)*s++;
+  }
+  return count;
+}
+
+struct MapCommand {
+  const char *name;
+  int insert, noremap, unmap;
+};
+const struct MapCommand mapCommands[] = {
+  {"map", 0, 0, 0}, {"nmap", 0, 0, 0}, {"noremap", 0, 1, 0}, {"nnoremap", 0, 1, 0},
+  {"imap", 1, 0, 0}, {"inoremap", 1, 1, 0},
+  {"unmap", 0, 0, 1}, {"nunmap", 0, 0, 1}, {"iunmap", 1, 0, 1},
+};
+
+// :map {lhs} {rhs} and friends. returns 0 when cmd isn't one of them.
+int editorMapCommand(char *cmd)
+{
+  size_t length = strcspn(cmd, " ");
+  const struct MapCommand *command = NULL;
+  for (size_t i = 0; i < sizeof(mapCommands) / sizeof(*mapCommands); i++)
+    if (strlen(mapCommands[i].name) == length && !strncmp(cmd, mapCommands[i].name, length))
+      command = &mapCommands[i];
+  if (!command)
+    return 0;
+
+  char *lhs = cmd + length;
+  while (*lhs == ' ')
+    lhs++;
+  char *rhs = lhs + strcspn(lhs, " ");
+  if (*rhs)
+    *rhs++ = '\0';
+  while (*rhs == ' ')
+    rhs++;
+  if (!*lhs || (!command->unmap && !*rhs)) {
+    editorSetPrompt("E474: Invalid argument");
+    return 1;
+  }
+
+  struct Keymap *map = command->insert ? &insertMaps : &normalMaps;
+  int keys[KEYMAP_PENDING];
+  int keyscount = keymapParseKeys(lhs, keys, KEYMAP_PENDING);
+  int node = 0;
+  for (int i = 0; i < keyscount && (node || !i); i++)
+    node = keymapNext(map, node, keys[i]);
+  if (command->unmap) {
+    if (!node || !map->nodes[node].rhs) {
+      editorSetPrompt("E31: No such mapping");
+      return 1;
+    }
+  } else if ((node = keymapAdd(map, keys, keyscount)) == -1) {
+    editorSetPrompt("E474: Too many mappings");
+    return 1;
+  }
+
+  struct KeyNode *mapping = &map->nodes[node];
+  nimFree(ALLOC_OTHER, mapping->rhs);
+  mapping->rhs = NULL;
+  mapping->rhscount = 0;
+  if (command->unmap)
+    return 1;
+  int rhskeys[256];
+  mapping->rhscount = keymapParseKeys(rhs, rhskeys, 256);
+  mapping->rhs = nimMalloc(ALLOC_OTHER, sizeof(int) * mapping->rhscount);
+  memcpy(mapping->rhs, rhskeys, sizeof(int) * mapping->rhscount);
+  mapping->noremap = command->noremap;
+  return 1;
+}
+// }}}
+// Command mode {{{
+// lines of the dump in the hex view
+int editorLineCount()
+{
+  return editor.hex ? editor.hex->lines : (int)editor.rowscount;
+}
+
+// one line address: a number, ".", "$", '< or '>, optionally followed by
+// +N/-N
+const char *editorParseAddress(const char *cmd, int *line, int *given)
+{
+  *given = 1;
+  if (isdigit(*cmd))
+    *line = strtol(cmd, (char **)&cmd, 10) - 1;
+  else if (*cmd == '.')
+    *line = editor.window->cursory, cmd++;
+  else if (*cmd == '$')
+    *line = editorLineCount() - 1, cmd++;
+  else if (*cmd == '\'' && (cmd[1] == '<' || cmd[1] == '>'))
+    *line = cmd[1] == '<' ? editor.visualTop : editor.visualBottom, cmd += 2;
+  else if (*cmd == '+' || *cmd == '-')
+    *line = editor.window->cursory;
+  else
+    *given = 0;
+
+  while (*given && (*cmd == '+' || *cmd == '-')) {
+    int sign = *cmd++ == '-' ? -1 : 1;
+    int offset = isdigit(*cmd) ? strtol(cmd, (char **)&cmd, 10) : 1;
+    *line += sign * offset;
+  }
+  return cmd;
+}
+
+// parses "%", "N", "N,M" and friends. the range defaults to the cursor line.
+// returns where the command itself starts.
+const char *editorParseRange(const char *cmd, struct Range *range, int *given)
+{
+  *range = createRange(editor.window->cursory, editor.window->cursory);
+  *given = 0;
+  if (*cmd == '%') {
+    *range = createRange(0, editorLineCount() - 1);
+    *given = 1;
+    return cmd + 1;
+  }
+
+  int line, lineGiven;
+  cmd = editorParseAddress(cmd, &line, &lineGiven);
+  if (lineGiven) {
+    *range = createRange(line, line);
+    *given = 1;
+  }
+  if (*cmd == ',') {
+    cmd = editorParseAddress(cmd + 1, &line, &lineGiven);
+    if (lineGiven)
+      range->end = line;
+    *given = 1;
+  }
+  if (range->start > range->end) {
+    int start = range->start;
+    range->start = range->end;
+    range->end = start;
+  }
+  return cmd;
+}
+
+int editorRangeValid(struct Range range)
+{
+  if (range.start < 0 || range.end >= (int)editor.rowscount) {
+    editorSetPrompt("E16: Invalid range");
+    return 0;
+  }
+  return 1;
+}
+
+// commands that take a range. returns 0 if cmd isn't one of them.
+int editorExecuteRangeCommand(char *cmd)
+{
+  struct Range range;
+  int rangeGiven;
+  cmd = (char *)editorParseRange(cmd, &range, &rangeGiven);
+
+  if (*cmd == '\0') {
+    if (!rangeGiven)
+      return 0;
+    // a bare address jumps to the line
+    int lines = editorLineCount();
+    editor.window->cursory = range.end < 0 ? 0 : range.end;
+    if (editor.window->cursory >= lines)
+      editor.window->cursory = lines ? lines - 1 : 0;
+    if (editor.hex)
+      editorHexSetCursor(editorHexCursor());
+    return 1;
+  }
+  // the rest change lines of text, which the hex view doesn't have
+  if (editor.hex)
+    return 0;
+
+  if (*cmd == 's' && (cmd[1] == '\0' || !isalpha(cmd[1]))) {
+    char *fields[3];
+    const char *flags = substituteRepeatFlags(cmd + 1);
+    if (flags) {
+      if (editorRangeValid(range))
+        editorSubstituteRepeat(range, NULL, flags);
+      return 1;
+    }
+    if (editorSplitPattern(cmd + 1, fields, 3) == NULL) {
+      editorSetPrompt("E146: Regular expressions can't be delimited by letters");
+      return 1;
+    }
+    if (editorRangeValid(range))
+      editorSubstitute(range, NULL, fields[0], fields[1], fields[2]);
+    return 1;
+  }
+
+  if ((*cmd == 'g' || *cmd == 'v')
+      && (cmd[1] == '!' || !isalnum(cmd[1]) || !strncmp(cmd, "global", 6) || !strncmp(cmd, "vglobal", 7))) {
+    int invert = *cmd == 'v';
+    if (*cmd == 'v' && cmd[1] == 'g')
+      cmd++;
+    cmd++;
+    if (!strncmp(cmd, "lobal", 5))
+      cmd += 5;
+    if (*cmd == '!') {
+      invert = !invert;
+      cmd++;
+    }
+    if (!rangeGiven)
+      range = createRange(0, editor.rowscount - 1);
+    if (editorRangeValid(range) && editorCanChangeLines())
+      editorGlobal(range, cmd, invert);
+    return 1;
+  }
+
+  // :{range}!cmd filters the range, a bare :!cmd isn't supported
+  if (*cmd == '!' && rangeGiven) {
+    if (cmd[1] == '\0')
+      editorSetPrompt("E471: Argument required");
+    else if (editorRangeValid(range))
+      editorFilter(range.start, range.end + 1, cmd + 1, 0);
+    return 1;
+  }
+
+  // :r !cmd reads its output in below the line, :0r above the first
+  if (*cmd == 'r' && (!isalpha(cmd[1]) || !strncmp(cmd, "read", 4))) {
+    cmd += strncmp(cmd, "read", 4) ? 1 : 4;
+    while (*cmd == ' ')
+      cmd++;
+    if (*cmd != '!' || cmd[1] == '\0')
+      editorSetPrompt("E492: Not supported by :r: %s", cmd);
+    else if (range.end < -1 || range.end >= (int)editor.rowscount + !editor.rowscount)
+      editorSetPrompt("E16: Invalid range");
+    else {
+      int at = range.end + 1 < (int)editor.rowscount ? range.end + 1 : (int)editor.rowscount;
+      editorFilter(at, at, cmd + 1, 1);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// :set name=value and :set name? for the few options nim has
+void editorSetOption(char *arg)
+{
+  while (isspace(*arg))
+    arg++;
+  char *value = strchr(arg, '=');
+  int query = !value && *arg && arg[strlen(arg)-1] == '?';
+  size_t nameLength = value ? (size_t)(value - arg) : strlen(arg) - query;
+
+  if ((nameLength == 9 && !strncmp(arg, "iskeyword", 9))
+      || (nameLength == 3 && !strncmp(arg, "isk", 3))) {
+    if (!value)
+      editorSetPrompt("iskeyword=%s", editor.iskeyword);
+    else if (editorSetIskeyword(value+1) == EXIT_FAILURE)
+      editorSetPrompt("invalid iskeyword: %s", value+1);
+    else
+      editorWordsStart();
+    return;
+  }
+  if ((nameLength == 11 && !strncmp(arg, "ttimeoutlen", 11))
+      || (nameLength == 3 && !strncmp(arg, "ttm", 3))
+      || (nameLength == 10 && !strncmp(arg, "timeoutlen", 10))
+      || (nameLength == 2 && !strncmp(arg, "tm", 2))) {
+    int *option = arg[0] == 't' && arg[1] == 't' ? &editor.ttimeoutlen : &editor.timeoutlen;
+    if (!value)
+      editorSetPrompt("%.*s=%d", (int)nameLength, arg, *option);
+    else if (isdigit(value[1]))
+      *option = atoi(value+1);
+    else
+      editorSetPrompt("invalid %.*s: %s", (int)nameLength, arg, value+1);
+    return;
+  }
+  if ((nameLength == 6 && !strncmp(arg, "binary", 6)) || (nameLength == 3 && !strncmp(arg, "bin", 3))
+      || (nameLength == 8 && !strncmp(arg, "nobinary", 8)) || (nameLength == 5 && !strncmp(arg, "nobin", 5))) {
+    int binary = arg[0] != 'n';
+    if (value)
+      editorSetPrompt("E474: Invalid argument: %s", arg);
+    else if (query)
+      editorSetPrompt("%sbinary", editor.binary ? "" : "no");
+    else if (binary != editor.binary)
+      editorSetBinary(binary);
+    return;
+  }
+  if ((nameLength == 10 && !strncmp(arg, "foldmethod", 10)) || (nameLength == 3 && !strncmp(arg, "fdm", 3))) {
+    const char *methods[] = {"manual", "marker", "indent"};
+    int method = 0;
+    while (value && method < 3 && strcmp(value+1, methods[method]))
+      method++;
+    if (!value)
+      editorSetPrompt("foldmethod=%s", methods[editor.folds.method]);
+    else if (method == 3)
+      editorSetPrompt("E474: Invalid argument: %s", arg);
+    else if (method != (int)editor.folds.method) {
+      editor.folds.method = method;
+      editorFoldsReset();
+      if (editor.large && method != FOLD_MANUAL)
+        editorSetPrompt("Folds aren't available in large file mode");
+    }
+    return;
+  }
+  if ((nameLength == 10 && !strncmp(arg, "shiftwidth", 10)) || (nameLength == 2 && !strncmp(arg, "sw", 2))) {
+    if (!value)
+      editorSetPrompt("shiftwidth=%d", editor.folds.shiftwidth);
+    else if (atoi(value+1) > 0) {
+      editor.folds.shiftwidth = atoi(value+1);
+      if (editor.folds.method == FOLD_INDENT)
+        editorFoldsReset();
+    } else
+      editorSetPrompt("E487: Argument must be positive: %s", arg);
+    return;
+  }
+  // 0 draws after every key
+  if (nameLength == 3 && !strncmp(arg, "fps", 3)) {
+    if (!value)
+      editorSetPrompt("fps=%d", editor.fps);
+    else if (isdigit(value[1]))
+      editor.fps = atoi(value+1);
+    else
+      editorSetPrompt("invalid fps: %s", value+1);
+    return;
+  }
+  editorSetPrompt("unknown option: %.*s", (int)nameLength, arg);
+}
+
+// "vim:" modelines in the first and last five rows, in either the
+// "vim: set opt opt:" or the "vim:opt:opt" form. only the fold options
+// are taken from them.
+void editorModeline()
+{
+  int rows = editor.rowscount;
+  for (int i = 0; i < rows; i = i == 4 && rows > 10 ? rows - 5 : i + 1) {
+    EditorRow *row = &editor.rows[i];
+    const char *text = editorRowText(row), *end = text + row->size, *start = NULL;
+    for (const char *c = text; c < end && (c = memmem(c, end - c, "vim:", 4)); c += 4)
+      if (c == text || isspace((unsigned char)c[-1])) {
+        start = c + 4;
+        break;
+      }
+    if (!start)
+      continue;
+    while (start < end && isspace((unsigned char)*start))
+      start++;
+    int setForm = end - start > 4 && !strncmp(start, "set ", 4);
+    if (setForm)
+      start += 4;
+    while (start < end) {
+      const char *token = start;
+      while (start < end && !isspace((unsigned char)*start) && *start != ':')
+        start++;
+      char option[64];
+      int length = start - token < (int)sizeof(option) ? start - token : (int)sizeof(option) - 1;
+      memcpy(option, token, length);
+      option[length] = '\0';
+      int nameLength = strcspn(option, "=");
+      if ((nameLength == 10 && (!strncmp(option, "foldmethod", 10) || !strncmp(option, "shiftwidth", 10)))
+          || (nameLength == 3 && !strncmp(option, "fdm", 3)) || (nameLength == 2 && !strncmp(option, "sw", 2)))
+        editorSetOption(option);
+      if (setForm && start < end && *start == ':')
+        break;
+      while (start < end && (isspace((unsigned char)*start) || *start == ':'))
+        start++;
+    }
+  }
+}
+
+void editorExecuteCommandRow()
+{
+  char *command = editorRowBuffer(&editor.commandRow);
+  int start = 0;
+
+  while (command[start] == ':') {
+    start++;
+  }
+  editor.commandRow.size-=start;
+  memmove(command, command+start, editor.commandRow.size);
+  command[editor.commandRow.size] = '\0';
+
+  if (editorExecuteRangeCommand(command))
+    return;
+  if (editorMapCommand(command))
+    return;
+
+  if (!strcmp(command,"q")) 
+  {
+    editorWindowQuit();
+  }
+  if (!strcmp(command,"qa") || !strcmp(command,"qall"))
+    editorQuit();
+
+  if (!strcmp(command,"sp") || !strcmp(command,"split"))
+    editorWindowSplit(0);
+  if (!strcmp(command,"vs") || !strcmp(command,"vsplit"))
+    editorWindowSplit(1);
+  if (!strcmp(command,"clo") || !strcmp(command,"close"))
+    editorWindowClose(editor.window);
+  if (!strcmp(command,"on") || !strcmp(command,"only"))
+    editorWindowOnly();
+  if (!strncmp(command,"tag ", 4) || !strncmp(command,"ta ", 3)) {
+    char *name = strchr(command, ' ');
+    while (*name == ' ')
+      name++;
+    if (*name)
+      editorTagJump(name, strlen(name));
+    else
+      editorSetPrompt("E471: Argument required");
+  }
+  if (!strcmp(command,"tag") || !strcmp(command,"ta"))
+    editorSetPrompt("E471: Argument required");
+  if (!strcmp(command,"po") || !strcmp(command,"pop"))
+    editorTagPop();
+  if (!strcmp(command,"nim"))
+    system("xdg-open http://github.com/nimaaskarian/nim");
+
+  if (!strcmp(command,"w"))
+    editorWrite();
+
+  if (!strcmp(command,"perf"))
+    editor.perf.overlay = !editor.perf.overlay;
+
+  if (!strcmp(command,"allocs"))
+    editorAllocReport();
+
+  if (!strncmp(command,"set ", 4))
+    editorSetOption(command+4);
+
+  // like vim, a write that failed keeps the window open
+  if ((!strcmp(command,"wq") | !strcmp(command, "x")) && editorWrite() == EXIT_SUCCESS)
+    editorWindowQuit();
+}
+void editorHandleCommandMode (int keyChar)
+{
+  if (keyChar == ENTER) {
+    editorExecuteCommandRow();
+    editorClearRow(&editor.commandRow);
+    editor.mode = MODE_NORMAL;
+    return;
+  }
+  if (keyChar == BACKSPACE) {
+    editorRowDeleteChar(&editor.commandRow, editor.commandRow.size-1);
+    return;
+  }
+  if (keyChar == CTRL_KEY('u')) {
+    editorClearRow(&editor.commandRow);
+    editorRowInsertChar(&editor.commandRow,editor.commandRow.size, ':');
+    return;
+  }
+
+  if (keyChar >= TOP || iscntrl(keyChar))
+    return;
+
+  editorRowInsertChar(&editor.commandRow,editor.commandRow.size, keyChar);
+}
+// }}}
+// Output {{{
+void editorDamageAll()
+{
+  for (int i = 0; i < editor.windowscount; i++)
+    editor.windows[i]->damageAll = 1;
+  editor.dirty = 1;
+}
+
+// file rows [from, to) need to be drawn again, in whichever windows show them
+void editorDamageRows(int from, int to)
+{
+  editor.dirty = 1;
+  for (int i = 0; i < editor.windowscount; i++)
+    editorDamageWindowRows(editor.windows[i], from, to);
+}
+
+// turns the damage into the window's rows [*from, *to) to draw. when only
+// rowoffset moved, the terminal scrolls what is already there and just
+// the rows that came into view are drawn. that needs the whole width of
+// the screen, a window beside another one is drawn again instead.
+void editorDamagedScreenRows(struct appendBuffer *ab, struct Window *window, int *from, int *to)
+{
+  int topLine = editorFoldLine(window->rowoffset);
+  int delta = topLine - editorFoldLine(window->drawnRowoffset);
+  int wide = window->cols == editor.screencols;
+  if (window->damageAll || (editor.perf.overlay && window == editor.window)
+      || editor.folds.generation != window->drawnFolds || window->coloffset != window->drawnColoffset
+      || (delta && !wide) || delta >= window->rows || -delta >= window->rows) {
+    *from = 0;
+    *to = window->rows;
+    return;
+  }
+
+  // a closed fold is one line for all of its rows, so the last damaged
+  // row gives the end
+  *from = editorFoldLine(window->damageFrom) - topLine;
+  *to = editorFoldLine(window->damageTo - 1) + 1 - topLine;
+  if (window->damageFrom == window->damageTo)
+    *from = *to = 0;
+
+  if (delta) {
+    char buf[32];
+    // scroll region of the window, then scroll up or down
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r", window->top + 1,
+                       window->top + window->rows, delta > 0 ? delta : -delta, delta > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    int scrolledFrom = delta > 0 ? window->rows - delta : 0;
+    int scrolledTo = delta > 0 ? window->rows : -delta;
+    if (*from == *to) {
+      *from = scrolledFrom;
+      *to = scrolledTo;
+    } else {
+      if (scrolledFrom < *from)
+        *from = scrolledFrom;
+      if (scrolledTo > *to)
+        *to = scrolledTo;
+    }
+  }
+  if (*from < 0)
+    *from = 0;
+  if (*to > window->rows)
+    *to = window->rows;
+}
+
+void editorScroll(struct Window *window)
+{
+  if (editor.hex) {
+    editorHexScroll(window);
+    return;
+  }
+  if (!editor.rowscount)
+    return;
+  if (window != editor.window) {
+    // rows can go from under the other windows, and their cursor goes
+    // with its rows, so only its row is checked
+    if (window->cursory >= editor.rowscount)
+      window->cursory = editor.rowscount - 1;
+    window->cursory = editorFoldShown(window->cursory);
+  } else {
+    // like vim, a jump into a closed fold opens it
+    editorFoldReveal(window->cursory);
+    window->renderx = 0;
+    if (window->cursory < editor.rowscount && !editorFoldClosedAt(window->cursory))
+      window->renderx = editorRowCursorxToRenderx(getCurrentRow(), window->cursorx);
+  }
+
+  // in lines on screen, which closed folds make fewer than rows
+  window->rowoffset = editorFoldShown(window->rowoffset);
+  int cursorLine = editorFoldLine(window->cursory), topLine = editorFoldLine(window->rowoffset);
+  if (cursorLine < topLine)
+    window->rowoffset = window->cursory;
+  if (cursorLine >= topLine + window->rows)
+    window->rowoffset = editorFoldRow(cursorLine - window->rows + 1);
+  if (window != editor.window)
+    return;
+
+  if (window->cursorx < window->coloffset)
+    window->coloffset = window->cursorx;
+  if (window->cursorx >= window->coloffset + window->cols)
+    window->coloffset = window->cursorx - window->cols + 1;
+
+  if (window->renderx < window->coloffset)
+    window->coloffset = window->renderx;
+  if (window->renderx >= window->coloffset + window->cols)
+    window->coloffset = window->renderx - window->cols + 1;
+
+  if (window->cursory < editor.rowscount && getCurrentRow()->size <= window->cols)
+    window->coloffset = 0;
+}
+
+struct Selection editorSelection();
+int editorSelectedColumns(struct Selection *selection, int filerow, EditorRow *row, int *first, int *last);
+
+// rows [from, to) of the window. a window at the right of the screen
+// ends its rows by erasing the rest of the line, one left of another pads
+// them to its width and draws the | between them.
+void editorDrawRows(struct appendBuffer *ab, struct Window *window, int from, int to)
+{
+  struct Selection selection;
+  int selecting = editor.mode == MODE_VISUAL && window == editor.window;
+  if (selecting)
+    selection = editorSelection();
+  int separator = window->left + window->cols < editor.screencols;
+  const char spaces[] = "                                ";
+  char move[32], forward[16];
+  abAppend(ab, move, snprintf(move, sizeof(move), "\x1b[%d;%dH", window->top + from + 1, window->left + 1));
+  // each row after the first starts on the next line, left of the window
+  int forwardlength = window->left ? snprintf(forward, sizeof(forward), "\x1b[%dC", window->left) : 0;
+
+  int overlayHeight = window == editor.window ? editorPerfOverlayHeight() : 0;
+  // the rows after the first are found by stepping over closed folds
+  int filerow = editor.hex ? from + window->rowoffset : editorFoldRow(editorFoldLine(window->rowoffset) + from);
+  struct FoldHidden *fold = NULL;
+  for (int y = from; y < to; y++, filerow = fold ? fold->end + 1 : filerow + 1) {
+    fold = NULL;
+    int width = 0;
+    if (y < overlayHeight) {
+      char line[128];
+      int len = editorPerfOverlayLine(line, sizeof(line), y);
+      if (len > window->cols)
+        len = window->cols;
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, line, len);
+      abAppend(ab, "\x1b[m", 3);
+      width = len;
+    } else if (editor.hex && filerow < editor.hex->lines) {
+      width = editorHexDrawRow(ab, window, filerow);
+    } else if (filerow < editor.rowscount && (fold = editorFoldClosedAt(filerow))) {
+      editorFoldDrawRow(ab, fold, window->cols);
+      width = window->cols;
+    } else if (filerow >= editor.rowscount) {
+      if (editor.rowscount == 0 && !editor.hex && y == window->rows/3) {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome), "Nim editor -- version %s", NIM_VERSION);
+        if (welcomelen > window->cols)
+          welcomelen = window->cols;
+
+        int padding = (window->cols - welcomelen) / 2;
+        width = padding + welcomelen;
+        if (padding) {
+          abAppend(ab, "~", 1);
+          padding--;
+        }
+        while (padding--)
+          abAppend(ab, " ", 1);
+
+        abAppend(ab,welcome, welcomelen);
+
+      } else {
+        abAppend(ab, "~", 1);
+        width = 1;
+      }
+    } else {
+      EditorRow *row = editorRowAt(filerow);
+      if (row->stale)
+        editorRenderRow(row);
+      int len = row->rendersize - window->coloffset;
+      if (len < 0) 
+        len = 0;
+      if (len > window->cols)
+        len = window->cols;
+      width = len;
+      char *text = editorRowRender(row) + window->coloffset;
+      int first, last;
+      if (selecting && editorSelectedColumns(&selection, filerow, row, &first, &last)) {
+        // the selection is drawn inverted
+        first -= window->coloffset;
+        last -= window->coloffset - 1;
+        first = first < 0 ? 0 : first > len ? len : first;
+        last = last < first ? first : last > len ? len : last;
+        abAppend(ab, text, first);
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, text + first, last - first);
+        abAppend(ab, "\x1b[m", 3);
+        abAppend(ab, text + last, len - last);
+      } else
+        abAppend(ab, text, len);
+    }
+
+    if (!separator)
+      // erase in line
+      abAppend(ab, "\x1b[K", 3);
+    else {
+      for (; width < window->cols; width += 32)
+        abAppend(ab, spaces, window->cols - width < 32 ? window->cols - width : 32);
+      abAppend(ab, "|", 1);
+    }
+
+    abAppend(ab, "\r\n", 2);
+    abAppend(ab, forward, forwardlength);
+  }
+}
+int editorDrawCommand(struct appendBuffer *ab) 
+{
+
+  abAppend(ab, editorRowBuffer(&editor.commandRow), editor.commandRow.size);
+  return editor.commandRow.size;
+}
+
+// All, Top, Bot or how far down the window is, in buf of 4
+int editorScrollPercentage(struct Window *window, char *buf)
+{
+  int lines = editor.hex ? editor.hex->lines : editorFoldLines();
+  int top = editor.hex ? window->rowoffset : editorFoldLine(window->rowoffset);
+  int scrollPercentage = round((double)top/(lines-window->rows)*100);
+  // a window scrolled past its last full page shows the end too
+  if (scrollPercentage > 100)
+    scrollPercentage = 100;
+  if (lines <= window->rows)
+    scrollPercentage = -1;
+  
+  switch (scrollPercentage) {
+    case -1:
+    return snprintf(buf, 4, "%s", "All");
+    case 0:
+    return snprintf(buf, 4, "%s", "Top");
+    case 100:
+    return snprintf(buf, 4, "%s", "Bot");
+    default:
+    return snprintf(buf, 4, "%d%%", scrollPercentage);
+  }
+}
+
+// the line under a window when there are others: the file name, [+] when
+// it changed, and where the cursor is like in the status bar. the
+// current window's is bold.
+void editorDrawWindowStatus(struct appendBuffer *ab, struct Window *window)
+{
+  char move[32], text[256];
+  abAppend(ab, move, snprintf(move, sizeof(move), "\x1b[%d;%dH", window->top + window->rows + 1, window->left + 1));
+  abAppend(ab, window == editor.window ? "\x1b[1;7m" : "\x1b[7m", window == editor.window ? 6 : 4);
+  // under the | too
+  int cols = window->cols + (window->left + window->cols < editor.screencols);
+  int width = cols < (int)sizeof(text) ? cols : (int)sizeof(text);
+  memset(text, ' ', width);
+  char part[256];
+  int length = snprintf(part, sizeof(part), "%s%s", editor.filename ? editor.filename : "[No Name]",
+                        editor.changes != editor.savedChanges ? " [+]" : "");
+  memcpy(text, part, length < width - 18 ? length : width > 18 ? width - 18 : 0);
+  length = snprintf(part, sizeof(part), "%d,%d", window->cursory+1, window->cursorx+1);
+  if (width >= 17 + length)
+    memcpy(text + width - 17, part, length);
+  length = editorScrollPercentage(window, part);
+  if (width >= 4 + length)
+    memcpy(text + width - 4, part, length);
+  abAppend(ab, text, width);
+  for (; width < cols; width++)
+    abAppend(ab, " ", 1);
+  abAppend(ab, "\x1b[m", 3);
+}
+
+void editorDrawStatusBar(struct appendBuffer *ab) 
+{
+  // invert colors
+  // abAppend(ab, "\x1b[7m", 4);
+  int len = 0;
+  if (editor.mode == MODE_COMMAND) {
+    abClear(&editor.prompt);
+    len += editorDrawCommand(ab);
+  }
+  if (editor.prompt.length) {
+    abAppend(ab,editor.prompt.buffer, editor.prompt.length);
+    len+=editor.prompt.length;
+  } else if (editor.mode == MODE_VISUAL) {
+    const char *name = editor.visualMode == 'v' ? "-- VISUAL --"
+                     : editor.visualMode == 'V' ? "-- VISUAL LINE --" : "-- VISUAL BLOCK --";
+    abAppend(ab, name, strlen(name));
+    len+=strlen(name);
+  } else if (editor.recording && editor.mode != MODE_COMMAND) {
+    char buf[16];
+    int bufLength = snprintf(buf, sizeof(buf), "recording @%c", editor.recording);
+    abAppend(ab, buf, bufLength);
+    len+=bufLength;
+  }
+
+  while (len < editor.screencols) {
+    if (len == editor.screencols - 17) {
+      char buf[13];
+      int bufLength = snprintf(buf, sizeof(buf), "%d,%d", editor.window->cursory+1, editor.window->cursorx+1);
+      abAppend(ab, buf, bufLength);
+      len+=bufLength;
+    } else if (len == editor.screencols-4) {
+      char buf[4];
+      int bufLength = editorScrollPercentage(editor.window, buf);
+      abAppend(ab, buf, bufLength);
+      len+=bufLength;
+    } else {
+      abAppend(ab, " ", 1);
+      len++;
+    }
+  }
+  // abAppend(ab, "\x1b[m", 3);
+}
+
+void editorRefreshScreen() 
+{
+  long long start = monotonicNs();
+  for (int i = 0; i < editor.windowscount; i++)
+    editorScroll(editor.windows[i]);
+  editorPerfAdd(PERF_SCROLL, start);
+
+  start = monotonicNs();
+  // the frame buffer is kept between frames, so redrawing doesn't allocate
+  struct appendBuffer ab = editor.frame;
+  abClear(&ab);
+
+  // hide cursor (set mode ?25 which is hidden)
+  abAppend(&ab, "\x1b[?25l", 6);
+
+  // clear entire screen (removed because of erase in line)
+  // abAppend(&ab, "\x1b[2J", 4);
+
+  // each window draws only what changed in it
+  for (int i = 0; i < editor.windowscount; i++) {
+    struct Window *window = editor.windows[i];
+    int from, to;
+    editorDamagedScreenRows(&ab, window, &from, &to);
+    editorDrawRows(&ab, window, from, to);
+    if (editor.windowscount > 1)
+      editorDrawWindowStatus(&ab, window);
+    window->damageAll = 0;
+    window->damageFrom = window->damageTo = 0;
+    window->drawnRowoffset = window->rowoffset;
+    window->drawnFolds = editor.folds.generation;
+    window->drawnColoffset = window->coloffset;
+  }
+
+  char move[32];
+  abAppend(&ab, move, snprintf(move, sizeof(move), "\x1b[%d;1H", editor.screenrows+1));
+  editorDrawStatusBar(&ab);
+
+  abAppend(&ab, "\x1b[H", 3);
+
+  // move cursor to cursor position
+  char buf[32];
+  if (editor.mode == MODE_COMMAND)
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", editor.screencols, editor.commandRow.size+1);
+  else
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+             editor.window->top + (editorFoldLine(editor.window->cursory)-editorFoldLine(editor.window->rowoffset))+1,
+             editor.window->left + (editor.window->renderx-editor.window->coloffset)+1);
+  abAppend(&ab, buf, strlen(buf));
+
+  // show cursor (unset mode ?25 which is hidden)
+  abAppend(&ab, "\x1b[?25h", 6);
+  editorPerfAdd(PERF_RENDER, start);
+
+  start = monotonicNs();
+  editor.frame = ab;
+  editor.frameSent = 0;
+  editor.dirty = 0;
+  editor.lastFrame = start;
+  // a frame the tty couldn't take at once means it is behind, slow down
+  // until frames go through whole again
+  long long interval = editor.fps ? 1000000000LL / editor.fps : 0;
+  if (!editorFlush())
+    editor.frameBackoff = editor.frameBackoff ? editor.frameBackoff * 2 : interval + 1000000;
+  else
+    editor.frameBackoff /= 2;
+  if (editor.frameBackoff > FRAME_BACKOFF_MAX)
+    editor.frameBackoff = FRAME_BACKOFF_MAX;
+  editorPerfAdd(PERF_FLUSH, start);
+
+  editorPerfEndFrame();
+}
+
+long long editorNextFrame()
+{
+  long long interval = editor.fps ? 1000000000LL / editor.fps : 0;
+  return editor.lastFrame + interval + editor.frameBackoff;
+}
+
+// draws when something changed and the last frame is old enough, so a
+// key after a pause shows at once but a burst of keys shares frames
+void editorScheduleFrame()
+{
+  if (editor.dirty && editor.frameSent == editor.frame.length && monotonicNs() >= editorNextFrame())
+    editorRefreshScreen();
+}
+
+// milliseconds until editorScheduleFrame has something to do, or -1
+int editorFrameTimeout()
+{
+  if (!editor.dirty || editor.frameSent < editor.frame.length)
+    return -1;
+  long long wait = editorNextFrame() - monotonicNs();
+  return wait > 0 ? (wait + 999999) / 1000000 : 0;
+}
+// }}}
+// Input {{{
+int editorEndOfTheWord(int start) {
+  int end = start;
+
+  // Find current word boundary
+  while (isalnum(editorRowBuffer(getCurrentRow())[end]) && end <= getCurrentRow()->size) {
+      end++;
+  }
+
+  // Move cursor to end of current word
+  return end;
+}
+void editorSetCursorx(int x)
+{
+  editor.window->cursorx = x;
+  editor.window->savedcursorx = x;
+}
+void applySavedcursorx()
+{
+  if (editor.window->savedcursorx) {
+    if (getCurrentRow()->size - 1 > editor.window->savedcursorx) {
+      // editor.window->cursorx = editorRowRenderxToCursorx(currentRow, editor.window->savedcursorx);
+      editor.window->cursorx = editor.window->savedcursorx;
+    } else {
+      editor.window->cursorx = getCurrentRow()->size-1;
+    }
+  }
+
+}
+void editorHandleMoveCursorNormal (int key);
+void editorMoveCursoryToLine(int *linenumber)
+{
+  if (*linenumber > editor.rowscount)
+    *linenumber=editor.rowscount;
+
+  if (*linenumber < 0)
+    *linenumber = -(*linenumber);
+
+  editor.window->cursory = *linenumber-1;
+  editor.window->rowoffset = 0;
+  *linenumber=0;
+  // move cursor with zero key so it gets aligned
+  editorHandleMoveCursorNormal(0);
+}
+
+// a closed fold is one line to move over
+int editorMoveCursorDown()
+{
+  struct FoldHidden *fold = editorFoldClosedAt(editor.window->cursory);
+  int next = fold ? fold->end + 1 : editor.window->cursory + 1;
+  if (next < editor.rowscount) {
+    editor.window->cursory = next;
+    applySavedcursorx();
+    return EXIT_SUCCESS;
+  }
+  return EXIT_FAILURE;
+}
+
+int editorMoveCursorUp()
+{
+  if (editor.window->cursory > 0) {
+    editor.window->cursory = editorFoldShown(editor.window->cursory - 1);
+    applySavedcursorx();
+    return EXIT_SUCCESS;
+  }
+  return EXIT_FAILURE;
+}
+
+void editorMoveCursorRight()
+{
+  EditorRow *currentRow = getCurrentRow();
+
+  editor.window->isEndMode = 0;
+  if (currentRow && editor.window->cursorx < currentRow->size - 1)
+    editorSetCursorx(editor.window->cursorx+1);
+}
+
+void editorMoveCursorLeft()
+{
+  editor.window->isEndMode = 0;
+  if (editor.window->cursorx != 0) {
+    editorSetCursorx(editor.window->cursorx-1);
+  } 
+}
+
+int isRowAllSpace(EditorRow *er)
+{
+  return er->blank;
+}
+
+int currentSequenceLastIndex(int start) {
+  EditorRow *currentRow = getCurrentRow();
+  if (start < 0 || start >= currentRow->size)
+    return currentRow->size - 1;
+
+  enum WordType type = editorCharWordType(editorRowBuffer(currentRow)[start]);
+  return scanClassRun(editorRowBuffer(currentRow), start+1, currentRow->size, type) - 1;
+}
+
+int currentSequenceLastIndexReversed(int start) {
+  EditorRow *currentRow = getCurrentRow();
+  if (start > 0 && start < currentRow->size) {
+    enum WordType type = editorCharWordType(editorRowBuffer(currentRow)[start]);
+    int i = scanClassRunBack(editorRowBuffer(currentRow), start-1, 0, type);
+    if (i >= 0)
+      return i;
+  }
+
+  return firstNonSpaceFromStart(currentRow,0);
+}
+
+void editorMoveCursorWordEnd()
+{
+  EditorRow *currentRow = getCurrentRow();
+
+  if (editor.window->cursorx >= currentRow->size - 1)
+    if (editorMoveCursorDown() == EXIT_SUCCESS) {
+      currentRow = getCurrentRow();
+      editor.window->cursorx = 0;
+    }
+  while(isRowAllSpace(currentRow)){
+    if (editorMoveCursorDown() == EXIT_FAILURE)
+      break;
+    editor.window->cursorx = 0;
+    currentRow = getCurrentRow();
+  }
+
+  char currentChar = editorRowBuffer(currentRow)[editor.window->cursorx];
+  int lastIndex = currentSequenceLastIndex(editor.window->cursorx);
+
+  if (editor.window->cursorx == lastIndex) {
+    int firstNonSpace = firstNonSpaceFromStart(currentRow, editor.window->cursorx+1);
+    if (firstNonSpace >= 0)
+      editor.window->cursorx=firstNonSpace;
+    editor.window->cursorx=currentSequenceLastIndex(editor.window->cursorx);
+  } else
+    editor.window->cursorx = lastIndex;
+
+}
+
+// like e, but a word is anything between whitespace
+void editorMoveCursorBigWordEnd()
+{
+  EditorRow *currentRow = getCurrentRow();
+  int x = editor.window->cursorx + 1;
+  while (1) {
+    while (x < currentRow->size && isspace(editorRowBuffer(currentRow)[x]))
+      x++;
+    if (x < currentRow->size)
+      break;
+    if (editorMoveCursorDown() == EXIT_FAILURE)
+      return;
+    currentRow = getCurrentRow();
+    x = 0;
+  }
+  while (x + 1 < currentRow->size && !isspace(editorRowBuffer(currentRow)[x+1]))
+    x++;
+  editor.window->cursorx = x;
+}
+
+void editorMoveCursorWordEndBack()
+{
+  EditorRow *currentRow = getCurrentRow();
+  editor.window->isEndMode = 0;
+
+  if (editor.window->cursorx <= 0)
+    if (editorMoveCursorUp() == EXIT_SUCCESS) {
+      currentRow = getCurrentRow();
+      editorSetCursorx(currentRow->size-1);
+    }
+
+  char currentChar = editorRowBuffer(currentRow)[editor.window->cursorx];
+  int lastIndex = currentSequenceLastIndexReversed(editor.window->cursorx);
+
+  if (editor.window->cursorx == lastIndex) {
+    editorSetCursorx(reversedFirstNonSpace(editorRowBuffer(currentRow), editor.window->cursorx+1));
+    editorSetCursorx(currentSequenceLastIndexReversed(editor.window->cursorx));
+  } else
+     editorSetCursorx(lastIndex);
+
+  while (isspace(editorRowBuffer(currentRow)[editor.window->cursorx])) {
+    editorSetCursorx(editor.window->cursorx-1);
+    if (editor.window->cursorx <= 0) {
+      break;
+    }
+  }
+
+  while(isRowAllSpace(getCurrentRow())){
+    if (editorMoveCursorUp() == EXIT_FAILURE)
+      break;
+    editor.window->cursorx = getCurrentRow()->size-1;
+  }
+
+}
+
+void editorMoveCursorWordStartBack()
+{
+  if (editorCharWordType(editorRowBuffer(getCurrentRow())[editor.window->cursorx]) 
+    != editorCharWordType(editorRowBuffer(getCurrentRow())[editor.window->cursorx-1]))
+    editorMoveCursorWordEndBack();
+
+  while (editor.window->cursorx > 0) {
+    if (editorCharWordType(editorRowBuffer(getCurrentRow())[editor.window->cursorx]) != editorCharWordType(editorRowBuffer(getCurrentRow())[editor.window->cursorx-1]))
+      break;
+    editor.window->cursorx--;
+  }
+}
+
+void editorMoveCursorWordStart()
+{
+  EditorRow *currentRow = getCurrentRow();
+
+  int i = editor.window->cursorx;
+  if (i < currentRow->size) {
+    enum WordType type = editorCharWordType(editorRowBuffer(currentRow)[i]);
+    if (type != WT_SPACE)
+      i = scanClassRun(editorRowBuffer(currentRow), i, currentRow->size, type);
+    i = scanClassRun(editorRowBuffer(currentRow), i, currentRow->size, WT_SPACE);
+    if (i < currentRow->size) {
+      editor.window->cursorx = i;
+      return;
+    }
+  }
+
+  // like vim, stop on empty lines but not on lines of only whitespace
+  while (editorMoveCursorDown() == EXIT_SUCCESS) {
+    currentRow = getCurrentRow();
+    if (currentRow->blank && currentRow->size)
+      continue;
+    editor.window->cursorx = scanClassRun(editorRowBuffer(currentRow), 0, currentRow->size, WT_SPACE);
+    return;
+  }
+}
+
+void editorHandleMoveCursorNormal (int key)
+{
+  EditorRow *currentRow = getCurrentRow();
+
+  switch (key) {
+    case WORD_NEXT:
+      editorMoveCursorWordStart();
+      break;
+    case WORD_BACK:
+      editorMoveCursorWordStartBack();
+      break;
+    case WORD_END:
+      editorMoveCursorWordEnd();
+      break;
+    case BIGWORD_END:
+      editorMoveCursorBigWordEnd();
+      break;
+    case KEY_RIGHT:
+      editorMoveCursorRight();
+      break;
+    CASE_DOWN:
+      editorMoveCursorDown();
+      break;
+    case KEY_LEFT:
+      editorMoveCursorLeft();
+      break;
+    CASE_UP:
+      editorMoveCursorUp();
+      break;
+    case BOTTOM:
+      editor.window->cursory = editor.rowscount - 1;
+      break;
+    case TOP:
+      editor.window->cursory = 0;
+      break;
+    case KEY_LINE_FIRST:
+      editor.window->isEndMode = 0;
+      editor.window->cursorx = 0;
+      break;
+    case KEY_LINE_START:
+      editor.window->isEndMode = 0;
+      int firstNonSpace = firstNonSpaceFromStart(currentRow, editor.window->cursorx+1);
+      if (firstNonSpace >= 0)
+        editor.window->cursorx=firstNonSpace;
+      break;
+    case KEY_LINE_END:
+      editor.window->cursorx = currentRow? currentRow->size-1:0;
+      editor.window->isEndMode = 1;
+      break;
+  }
+
+  currentRow = getCurrentRow();
+
+  int currentRowLength = currentRow ? currentRow->size-1 : 0;
+  if (editor.window->cursorx > currentRowLength || editor.window->isEndMode)
+    editor.window->cursorx = currentRowLength;
+
+  // first set cursory to 0 if its below 0.
+  // so rowscount comparison be valid
+  if (editor.window->cursory < 0)
+    editor.window->cursory = 0;
+
+  if (editor.window->cursorx < 0)
+    editor.window->cursorx = 0;
+
+  if (editor.window->cursory > editor.rowscount)
+    editor.window->cursory = editor.rowscount;
+}
+
+void editorKeyFail();
+void editorMacroRecord(int reg);
+void editorMacroRun(int reg, int count);
+void editorRedoRun(int count);
+void editorVisualStart(int visualMode);
+
+// runs a complete command from normalKeymap. argument is the key typed
+// after commands like f.
+void editorNormalCommand(int command, int argument)
+{
+  int keyChar = command;
+  switch (command) {
+    case 'i':
+      editor.mode = MODE_INSERT;
+      break;
+    case 'I': {
+        int firstNonSpace = firstNonSpaceFromStart(getCurrentRow(), editor.window->cursorx+1);
+        if (firstNonSpace >= 0)
+          editor.window->cursorx=firstNonSpace;
+        editor.mode = MODE_INSERT;
+      }
+      break;
+    case 'a':
+      editor.window->cursorx++;
+      editor.mode = MODE_INSERT;
+      break;
+    case 'A':
+      editor.window->cursorx = getCurrentRow()->size;
+      editor.mode = MODE_INSERT;
+      break;
+    case 'D': {
+        EditorRow *row = getCurrentRow();
+        if (row && editor.window->cursorx < row->size) {
+          editorRegisterStore(editorYankSlice('v', editor.window->cursory, editor.window->cursorx, editor.window->cursory, row->size), 1);
+          editorRowSplice(getCurrentRow(), editor.window->cursorx, row->size, "", 0);
+        }
+      }
+      break;
+    case 'f':
+    case 't': {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        EditorRow *row = getCurrentRow();
+        int x = editor.window->cursorx;
+        while (row && x != -1 && count--)
+          x = findFirstOfCharacter(row, x+1, argument);
+        if (!row || x == -1) {
+          editorKeyFail();
+          break;
+        }
+        // t stops before the character
+        editor.window->cursorx = command == 't' ? x - 1 : x;
+      }
+      break;
+    case 'q':
+      editorMacroRecord(argument);
+      break;
+    case '@': {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        editorMacroRun(argument == '@' ? editor.lastMacro : argument, count);
+      }
+      break;
+    case 'v':
+    case 'V':
+    case CTRL_KEY('v'):
+      editorVisualStart(command);
+      break;
+    case '.': {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 0;
+        editor.numberSequenceInt = 0;
+        editorRedoRun(count);
+      }
+      break;
+    case 'J': {
+      if (editor.window->cursory + 1 >= editor.rowscount || !editorCanChangeLines())
+        break;
+      // a closed fold is joined into one row, or joins the next line
+      int top = editor.window->cursory, bottom = top + 1;
+      editorFoldWiden(&top, &bottom);
+      editor.window->cursory = top;
+      for (int joins = bottom - top; joins > 0; joins--) {
+        EditorRow *nextRow = editorRowAt(editor.window->cursory+1);
+        int start = firstNonSpaceFromStart(nextRow, 0);
+        if (nextRow->size && start >= 0) {
+          char *nextRowBufferWithSpace;
+          nextRowBufferWithSpace = nimMalloc(ALLOC_TRANSIENT, nextRow->size - start + 2);
+          int nextRowSize = nextRow->size;
+          size_t stringSize = nextRowSize - start;
+          if (firstNonSpaceFromStart(getCurrentRow(), 0) == -1)
+              memcpy(nextRowBufferWithSpace, &editorRowBuffer(nextRow)[start], stringSize);
+          else
+              stringSize = sprintf(nextRowBufferWithSpace, " %s", &editorRowBuffer(nextRow)[start]);
+
+          editorRowAppendString(getCurrentRow(), nextRowBufferWithSpace, stringSize);
+          nimFree(ALLOC_TRANSIENT, nextRowBufferWithSpace);
+        }
+        editorDeleteRow(editor.window->cursory+1);
+      }
+        break;
+      }
+    case 'o':
+      editorAppendRowAt("", 0, ++editor.window->cursory);
+      editor.window->cursorx = 0;
+      editor.mode=MODE_INSERT;
+      break;
+    case 'O':
+      editorAppendRowAt("", 0, editor.window->cursory);
+      editor.window->cursorx = 0;
+      editor.mode=MODE_INSERT;
+      break;
+    case ':':
+      editor.mode = MODE_COMMAND;
+      editorRowInsertChar(&editor.commandRow,editor.commandRow.size, ':');
+      break;
+    case FOLD_OPEN:
+    case FOLD_CLOSE:
+    case FOLD_TOGGLE:
+    case FOLD_OPEN_ALL:
+    case FOLD_CLOSE_ALL:
+      editorFoldCommand(command);
+      break;
+    case WINDOW_SPLIT:
+    case WINDOW_VSPLIT:
+    case WINDOW_NEXT:
+    case WINDOW_PREVIOUS:
+    case WINDOW_LEFT:
+    case WINDOW_DOWN:
+    case WINDOW_UP:
+    case WINDOW_RIGHT:
+    case WINDOW_CLOSE:
+    case WINDOW_ONLY:
+    case WINDOW_QUIT:
+      editorWindowCommand(command);
+      break;
+    case DELETE_LINE: {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        int top, bottom;
+        editorFoldLinesSpan(editor.window->cursory, count, &top, &bottom);
+        editor.window->cursory = top;
+        struct Yank *yank = editorYankTakeRows(top, editor.rowscount ? bottom - top + 1 : count);
+        if (yank)
+          editorReportLines(yank->count, "fewer lines");
+        editorRegisterStore(yank, 1);
+        if (editor.window->cursory > editor.rowscount-1)
+          editor.window->cursory = editor.rowscount-1;
+      }
+      break;
+    case YANK_LINE: {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        if (!getCurrentRow()) {
+          editorKeyFail();
+          break;
+        }
+        int top, bottom;
+        editorFoldLinesSpan(editor.window->cursory, count, &top, &bottom);
+        editorRegisterStore(editorYankSlice('V', top, 0, bottom, 0), 0);
+        editorReportLines(bottom - top + 1, "lines yanked");
+      }
+      break;
+    case 'p':
+    case 'P': {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        editorPut(command == 'p', count);
+      }
+      break;
+    case '"':
+      if (editorRegisterIndex(argument) < 0) {
+        editorKeyFail();
+        break;
+      }
+      editor.regname = argument;
+      break;
+    case TOP:
+      if (editor.numberSequenceInt)
+        editorMoveCursoryToLine(&editor.numberSequenceInt);
+      else
+        editorHandleMoveCursorNormal(TOP);
+      break;
+    case WORD_END_BACK:
+      editorMoveCursorWordEndBack();
+      break;
+    case 'x': {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        EditorRow *row = getCurrentRow();
+        if (!row || editor.window->cursorx >= row->size)
+          break;
+        editorRegisterStore(editorYankSlice('v', editor.window->cursory, editor.window->cursorx, editor.window->cursory, editor.window->cursorx + count), 1);
+        editorRowSplice(getCurrentRow(), editor.window->cursorx, count, "", 0);
+      }
+      if (editor.window->cursorx > getCurrentRow()->size - 1)
+        editor.window->cursorx = getCurrentRow()->size-1;
+      break;
+    case WORD_END:
+    case BIGWORD_END:
+    case KEY_RIGHT:
+    case KEY_LEFT:
+    case KEY_LINE_START:
+    case KEY_LINE_FIRST:
+    case KEY_LINE_END:
+    case WORD_NEXT:
+    case WORD_BACK:
+    CASE_DOWN:
+    CASE_UP: {
+        int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+        editor.numberSequenceInt = 0;
+        for (int i = 0; i < count; i++) {
+          int x = editor.window->cursorx, y = editor.window->cursory;
+          editorHandleMoveCursorNormal(keyChar);
+          if (x != editor.window->cursorx || y != editor.window->cursory)
+            continue;
+          // like vim, a motion that can't move at all fails
+          if (i == 0 && keyChar != KEY_LINE_START && keyChar != KEY_LINE_FIRST && keyChar != KEY_LINE_END)
+            editorKeyFail();
+          break;
+        }
+      }
+      break;
+    case BOTTOM:
+      if (editor.numberSequenceInt) 
+        editorMoveCursoryToLine(&editor.numberSequenceInt);
+      else
+        editorHandleMoveCursorNormal(keyChar);
+      break;
+    case CTRL_KEY('f'): {
+        int line = editorFoldLine(editor.window->cursory) + editor.window->rows;
+        if (line > editorFoldLines() - 1)
+          line = editorFoldLines() - 1;
+        editor.window->cursory = editorFoldRow(line);
+        editorWindowCurrent(editor.window);
+      }
+      break;
+    case CTRL_KEY('b'): {
+        int line = editorFoldLine(editor.window->cursory) - editor.window->rows;
+        editor.window->cursory = editorFoldRow(line < 0 ? 0 : line);
+        editorWindowCurrent(editor.window);
+      }
+      break;
+    case CTRL_KEY(']'):
+      editorTagJumpCursor();
+      break;
+    case CTRL_KEY('t'):
+      editorTagPop();
+      break;
+  }
+}
+
+// walks map with one more key, collecting a count in front of the keys.
+// returns the node of a complete binding, with the key after it in
+// argument for bindings that take one, or 0 while keys are missing.
+int editorKeymapWalk(struct Keymap *map, int keyChar, int *argument)
+{
+  struct KeyNode *node = &map->nodes[editor.keyNode];
+  *argument = 0;
+  if (node->flags & BINDING_ARGUMENT) {
+    int complete = editor.keyNode;
+    editor.keyNode = 0;
+    *argument = keyChar;
+    return complete;
+  }
+
+  if (keyChar < TOP && isdigit(keyChar)) {
+    if (keyChar != '0' || editor.numberSequence.length > 0) {
+      char digit = keyChar;
+      abAppend(&editor.numberSequence, &digit, 1);
+      return 0;
+    }
+  } else {
     if (editor.numberSequence.length) {
+      abAppend(&editor.numberSequence, "", 1);
       editor.numberSequenceInt= atoi(editor.numberSequence.buffer);
-      abReinit(&editor.numberSequence);
+      abClear(&editor.numberSequence);
+    }
+  }
+
+  int next = keymapNext(map, editor.keyNode, keyChar);
+  node = &map->nodes[next];
+  if (!next) {
+    // not a command, drop what was typed like vim does
+    editor.keyNode = 0;
+    editor.numberSequenceInt = 0;
+    return 0;
+  }
+  if (node->children || (node->flags & BINDING_ARGUMENT)) {
+    editor.keyNode = next;
+    return 0;
+  }
+  editor.keyNode = 0;
+  return next;
+}
+
+void editorHandleNormalMode(int keyChar) {
+  // q while recording ends it, it takes no register then
+  if (keyChar == 'q' && editor.recording && !editor.keyNode) {
+    editorMacroRecord(0);
+    return;
+  }
+
+  int argument;
+  int complete = editorKeymapWalk(&normalKeymap, keyChar, &argument);
+  if (!complete)
+    return;
+  struct KeyNode *node = &normalKeymap.nodes[complete];
+
+  int failed = editor.keyFailed;
+  if (node->operator) {
+    editor.operator = node->operator;
+    editor.beforeDeletex = editor.window->cursorx;
+    editor.beforeDeletey = editor.window->cursory;
+    editor.keyFailed = 0;
+  }
+  editorNormalCommand(node->command, argument);
+  // like vim, an operator whose motion fails does nothing
+  if (editor.operator && editor.keyFailed)
+    editor.operator = 0;
+  editor.keyFailed |= failed;
+
+  if (editor.operator) {
+    int starty = editor.window->cursory;
+    int endy = editor.beforeDeletey;
+
+    if (starty > endy) {
+      starty=editor.beforeDeletey;
+      endy = editor.window->cursory;
+    }
+      
+    int startx = editor.window->cursorx;
+    int endx = editor.beforeDeletex;
+
+    if (startx > endx) {
+      startx=editor.beforeDeletex;
+      endx = editor.window->cursorx;
+    }
+    EditorRow *row = getCurrentRow();
+    if (starty == endy && (node->flags & BINDING_INCLUSIVE) && row && endx < row->size)
+      endx++;
+    if (starty != endy)
+      editorFoldWiden(&starty, &endy);
+    // y only takes a copy, and goes to the start of what it took
+    if (editor.operator == 'y') {
+      if (starty != endy)
+        editorRegisterStore(editorYankSlice('V', starty, 0, endy, 0), 0);
+      else if (startx != endx)
+        editorRegisterStore(editorYankSlice('v', starty, startx, endy, endx), 0);
+      editorReportLines(endy - starty + 1, "lines yanked");
+      if (starty != endy && editor.window->cursory != starty)
+        startx = editor.beforeDeletex;
+      editor.window->cursory = starty;
+      editor.window->cursorx = startx;
+    } else if (starty != endy) {
+      struct Yank *yank = editorYankTakeRows(starty, endy - starty + 1);
+      if (yank)
+        editorReportLines(yank->count, "fewer lines");
+      editorRegisterStore(yank, 1);
+      // like vim, the line after the deleted ones takes their place
+      editor.window->cursory = starty < editor.rowscount ? starty : editor.rowscount - 1;
+      if (editor.window->cursory < 0)
+        editor.window->cursory = 0;
+      EditorRow *row = getCurrentRow();
+      if (row && editor.window->cursorx >= row->size)
+        editorSetCursorx(row->size ? row->size - 1 : 0);
+      // editorRemoveRow(editor.window->cursory+1);
+      // editorRemoveRow(start);
+    } else if (startx != endx) {
+      editorRegisterStore(editorYankSlice('v', starty, startx, endy, endx), 1);
+      editorRowSplice(getCurrentRow(), startx, endx - startx, "", 0);
+      editor.window->cursorx = startx;
     }
+    editor.operator = 0;
+  }
+  // the register named with " is for the command after it
+  if (node->command != '"')
+    editor.regname = 0;
+  // ctrl-o in insert mode runs one command
+  if (editor.backToInsertFlag) {
+    editor.mode = MODE_INSERT;
+    editor.backToInsertFlag = 0;
+  }
+}
+// }}}
+// Completion {{{
+void editorCompletionPush(const char *word, int length, int count)
+{
+  struct Completion *completion = &editor.completion;
+  if (completion->count == completion->capacity) {
+    completion->capacity = completion->capacity ? completion->capacity * 2 : 64;
+    completion->matches = nimRealloc(ALLOC_OTHER, completion->matches, sizeof(struct CompletionMatch) * completion->capacity);
+  }
+  completion->matches[completion->count] = (struct CompletionMatch){completion->text.length, length, count, completion->count};
+  completion->count++;
+  abAppend(&completion->text, word, length);
+}
+
+// the words below node, in order. word holds the length characters above.
+void editorCompletionCollect(int node, char *word, int length)
+{
+  struct WordNode *nodes = editor.words.nodes;
+  for (int child = nodes[node].child; child >= 0; child = nodes[child].next) {
+    word[length] = nodes[child].c;
+    if (nodes[child].count)
+      editorCompletionPush(word, length + 1, nodes[child].count);
+    editorCompletionCollect(child, word, length + 1);
+  }
+}
+
+int compareCompletionMatch(const void *a, const void *b)
+{
+  const struct CompletionMatch *x = a, *y = b;
+  if (x->count != y->count)
+    return x->count < y->count ? 1 : -1;
+  return x->order - y->order;
+}
+
+// finds the words that start with the one before the cursor, the most
+// frequent first. only the trie under the prefix is walked, so it takes
+// as long as the prefix and the matches and not the buffer.
+int editorCompletionStart()
+{
+  struct Completion *completion = &editor.completion;
+  editorWordsUpdate();
+  EditorRow *row = getCurrentRow();
+  if (!row)
+    return 0;
+  const char *text = editorRowBuffer(row);
+  int cursorx = editor.window->cursorx;
+  int start = scanClassRunBack(text, cursorx - 1, 0, WT_WORD) + 1;
+  int length = cursorx - start;
+  if (length > WORDS_MAX_LENGTH)
+    return 0;
+
+  abClear(&completion->text);
+  completion->count = 0;
+  editorCompletionPush(text + start, length, 0);
+  int node = 0;
+  for (int i = 0; i < length && node >= 0; i++)
+    node = editorWordsChild(node, text[start + i], 0);
+  if (node >= 0) {
+    char word[WORDS_MAX_LENGTH];
+    memcpy(word, text + start, length);
+    editorCompletionCollect(node, word, length);
+  }
+  qsort(completion->matches + 1, completion->count - 1, sizeof(struct CompletionMatch), compareCompletionMatch);
+
+  completion->active = 1;
+  completion->window = editor.window;
+  completion->row = editor.window->cursory;
+  completion->start = start;
+  completion->current = 0;
+  return completion->count > 1;
+}
+
+// whether the last key was a completion, and the match it put in is
+// still before the cursor
+int editorCompletionGoing()
+{
+  struct Completion *completion = &editor.completion;
+  if (!completion->active || completion->window != editor.window || completion->row != editor.window->cursory)
+    return 0;
+  EditorRow *row = getCurrentRow();
+  struct CompletionMatch *match = &completion->matches[completion->current];
+  return row && editor.window->cursorx == completion->start + match->length
+    && completion->start + match->length <= row->size
+    && !memcmp(editorRowBuffer(row) + completion->start, completion->text.buffer + match->offset, match->length);
+}
+
+// Ctrl-N (direction 1) and Ctrl-P (-1) in insert mode. the first one
+// looks the matches up, the next ones go through them and back to what
+// was typed, like vim.
+void editorComplete(int direction)
+{
+  struct Completion *completion = &editor.completion;
+  if (editor.large) {
+    editorSetPrompt("Completion isn't available in large file mode");
+    editorKeyFail();
+    return;
+  }
+  if (!editorCompletionGoing() && !editorCompletionStart()) {
+    completion->active = 0;
+    editorSetPrompt("-- Keyword completion (^N^P) Pattern not found");
+    editorKeyFail();
+    return;
   }
-
+  struct CompletionMatch *from = &completion->matches[completion->current];
+  completion->current = (completion->current + direction + completion->count) % completion->count;
+  struct CompletionMatch *to = &completion->matches[completion->current];
+  editorRowSplice(getCurrentRow(), completion->start, from->length, completion->text.buffer + to->offset, to->length);
+  editor.window->cursorx = completion->start + to->length;
+  if (completion->current)
+    editorSetPrompt("-- Keyword completion (^N^P) match %d of %d", completion->current, completion->count - 1);
+  else
+    editorSetPrompt("-- Keyword completion (^N^P) Back at original");
+}
+// }}}
+// Insert mode {{{ 
+void editorHandleInsertMode(int keyChar) 
+{
+  if (keyChar != CTRL_KEY('n') && keyChar != CTRL_KEY('p'))
+    editor.completion.active = 0;
   switch (keyChar) {
-    case 'i':
-      editor.mode = MODE_INSERT;
-      break;
-    case 'I': {
-        int firstNonSpace = firstNonSpaceFromStart(getCurrentRow(), editor.cursorx+1);
-        if (firstNonSpace >= 0)
-          editor.cursorx=firstNonSpace;
-        editor.mode = MODE_INSERT;
-      }
+    case ENTER:
+      editorNewlineAtCursorx();
+      editor.window->cursorx = 0;
+    break;
+    case CTRL_KEY('n'):
+    case CTRL_KEY('p'):
+      editorComplete(keyChar == CTRL_KEY('n') ? 1 : -1);
       break;
-    case 'a':
-      editor.cursorx++;
-      editor.mode = MODE_INSERT;
+    case CTRL_KEY('o'):
+      editor.backToInsertFlag = 1;
+      editor.mode = MODE_NORMAL;
       break;
-    case 'A':
-      editor.cursorx = getCurrentRow()->size;
-      editor.mode = MODE_INSERT;
+    case BACKSPACE:
+      editorRowDeleteChar(getCurrentRow(), editor.window->cursorx-1);
+      editor.window->cursorx--;
       break;
-    case 'D':
-      for (int i = getCurrentRow()->size-1; i >= editor.cursorx; i--) {
+    case CTRL_KEY('u'):
+      for (int i = editor.window->cursorx-1; i >= 0; i--) {
         editorRowDeleteChar(getCurrentRow(), i);
+        editor.window->cursorx--;
       }
+      editorUpdateRow(getCurrentRow());
       break;
-    case 'f': {
-      editor.findFlag = 1;
+    case KEY_ARROW_LEFT:
+      if (editor.window->cursorx > 0)
+        editorSetCursorx(editor.window->cursorx-1);
       break;
-    }
-    case 'J': {
-      if (editor.cursory + 1 < editor.rowscount) {
-        int start = firstNonSpaceFromStart(&editor.rows[editor.cursory+1], 0);
-        if (editor.rows[editor.cursory+1].size && start >= 0) {
-          char *nextRowBufferWithSpace;
-          nextRowBufferWithSpace = malloc(sizeof(char) * editor.rows[editor.cursory+1].size - start + 1);
-          int nextRowSize = editor.rows[editor.cursory+1].size;
-          size_t stringSize = nextRowSize - start;
-          if (firstNonSpaceFromStart(getCurrentRow(), 0) == -1)
-              memcpy(nextRowBufferWithSpace, &editor.rows[editor.cursory+1].buffer[start], nextRowSize);
-          else
-              stringSize = sprintf(nextRowBufferWithSpace, " %s", &editor.rows[editor.cursory+1].buffer[start]);
+    case KEY_ARROW_RIGHT:
+      if (getCurrentRow() && editor.window->cursorx < getCurrentRow()->size)
+        editorSetCursorx(editor.window->cursorx+1);
+      break;
+    case KEY_ARROW_UP:
+    case KEY_ARROW_DOWN:
+      if (keyChar == KEY_ARROW_UP)
+        editorMoveCursorUp();
+      else
+        editorMoveCursorDown();
+      if (getCurrentRow() && editor.window->cursorx > getCurrentRow()->size)
+        editor.window->cursorx = getCurrentRow()->size;
+      break;
+    case KEY_HOME:
+      editorSetCursorx(0);
+      break;
+    case KEY_END:
+      if (getCurrentRow())
+        editorSetCursorx(getCurrentRow()->size);
+      break;
+    case KEY_DELETE:
+      if (getCurrentRow())
+        editorRowDeleteChar(getCurrentRow(), editor.window->cursorx);
+      break;
+    default:
+      if (keyChar >= TOP)
+        break;
+      if (editor.window->cursory == editor.rowscount) {
+        editorAppendRow("", 0);
+      }
+      editorRowInsertChar(getCurrentRow(), editor.window->cursorx, keyChar);
+      editor.window->cursorx++;
+      break;
+  }
+}
+// }}}
+// Visual mode {{{
+void editorVisualStart(int visualMode)
+{
+  if (!getCurrentRow()) {
+    editorKeyFail();
+    return;
+  }
+  editor.mode = MODE_VISUAL;
+  editor.visualMode = visualMode;
+  editor.visualx = editor.window->cursorx;
+  editor.visualy = editor.window->cursory;
+}
 
-          editorRowAppendString(getCurrentRow(), nextRowBufferWithSpace, stringSize);
+// the render columns the character at x covers
+void editorCharColumns(int y, int x, int *first, int *last)
+{
+  EditorRow *row = editorRowAt(y);
+  *first = editorRowCursorxToRenderx(row, x);
+  *last = x < row->size ? editorRowCursorxToRenderx(row, x+1) - 1 : *first;
+}
+
+struct Selection editorSelection()
+{
+  struct Selection selection;
+  int ax = editor.visualx, ay = editor.visualy, bx = editor.window->cursorx, by = editor.window->cursory;
+  if (ay > by || (ay == by && ax > bx)) {
+    ax = editor.window->cursorx, ay = editor.window->cursory;
+    bx = editor.visualx, by = editor.visualy;
+  }
+  selection.top = ay;
+  selection.bottom = by;
+  selection.startx = ax;
+  selection.endx = bx;
+
+  int firsta, lasta, firstb, lastb;
+  editorCharColumns(editor.visualy, editor.visualx, &firsta, &lasta);
+  editorCharColumns(editor.window->cursory, editor.window->cursorx, &firstb, &lastb);
+  selection.left = firsta < firstb ? firsta : firstb;
+  selection.right = lasta > lastb ? lasta : lastb;
+  // after $ a block goes to the end of every row
+  if (editor.window->isEndMode)
+    selection.right = INT_MAX;
+  return selection;
+}
+
+// the render columns of a row that are selected, 0 when none are
+int editorSelectedColumns(struct Selection *selection, int filerow, EditorRow *row, int *first, int *last)
+{
+  if (filerow < selection->top || filerow > selection->bottom)
+    return 0;
+  *first = 0;
+  *last = row->rendersize - 1;
+  if (editor.visualMode == CTRL_KEY('v')) {
+    *first = selection->left;
+    if (selection->right < *last)
+      *last = selection->right;
+  } else if (editor.visualMode == 'v') {
+    if (filerow == selection->top)
+      *first = editorRowCursorxToRenderx(row, selection->startx);
+    if (filerow == selection->bottom)
+      *last = editorRowCursorxToRenderx(row, selection->endx < row->size ? selection->endx+1 : row->size) - 1;
+  }
+  return 1;
+}
+
+// the bytes of a row inside a block, 0 when the row ends before it
+int editorBlockBytes(EditorRow *row, struct Selection *selection, int *from, int *to)
+{
+  *from = editorRowColumnToCursorx(row, selection->left);
+  if (*from >= row->size)
+    return 0;
+  *to = row->size;
+  if (selection->right != INT_MAX && editorRowColumnToCursorx(row, selection->right) < row->size)
+    *to = editorRowColumnToCursorx(row, selection->right) + 1;
+  return 1;
+}
+
+// a copy of what every row has inside the block. like vim, the part of
+// a tab that sticks into it becomes spaces.
+struct Yank *editorYankBlock(struct Selection *selection)
+{
+  struct Yank *yank = editorYankNew(CTRL_KEY('v'));
+  yank->count = selection->bottom - selection->top + 1;
+  yank->rows = nimMalloc(ALLOC_ROWS, sizeof(*yank->rows) * yank->count);
+  struct appendBuffer piece = ABUF_INIT_FOR(ALLOC_OTHER);
+  for (int i = 0; i < yank->count; i++) {
+    EditorRow *row = editorRowAt(selection->top + i);
+    int from, to;
+    abClear(&piece);
+    if (editorBlockBytes(row, selection, &from, &to)) {
+      char *buffer = editorRowBuffer(row);
+      for (int x = from; x < to; x++) {
+        int first, last;
+        editorCharColumns(selection->top + i, x, &first, &last);
+        if (buffer[x] != '\t' || (first >= selection->left && last <= selection->right)) {
+          abAppend(&piece, &buffer[x], 1);
+          continue;
         }
-        editorDeleteRow(editor.cursory+1);
+        if (first < selection->left)
+          first = selection->left;
+        if (last > selection->right)
+          last = selection->right;
+        for (; first <= last; first++)
+          abAppend(&piece, " ", 1);
       }
-        break;
+    }
+    editorInitRowText(&yank->rows[i], piece.buffer ? piece.buffer : "", piece.length);
+  }
+  abFree(&piece);
+  return yank;
+}
+
+// the selection as a yank: lines for V (and for Y), a slice for v and a
+// copy for a block
+struct Yank *editorVisualYank(struct Selection *selection, int lines)
+{
+  if (lines || editor.visualMode == 'V')
+    return editorYankSlice('V', selection->top, 0, selection->bottom, 0);
+  if (editor.visualMode == 'v')
+    return editorYankSlice('v', selection->top, selection->startx, selection->bottom, selection->endx + 1);
+  return editorYankBlock(selection);
+}
+
+// removes the selection with one splice per row, and the rows of a
+// linewise one with a single move. the cursor ends up where it started.
+// what was removed goes to the registers.
+void editorVisualDelete(struct Selection *selection)
+{
+  int lines = selection->bottom - selection->top;
+  if ((editor.visualMode == 'V' || (editor.visualMode == 'v' && lines)) && !editorCanChangeLines())
+    return;
+  editor.deferRender++;
+  editor.window->cursory = selection->top;
+  if (editor.visualMode == 'V') {
+    editorReportLines(lines + 1, "fewer lines");
+    editorRegisterStore(editorYankTakeRows(selection->top, lines + 1), 1);
+    if (editor.window->cursory >= editor.rowscount && editor.rowscount)
+      editor.window->cursory = editor.rowscount - 1;
+    editor.window->cursorx = 0;
+  } else if (editor.visualMode == 'v') {
+    editorRegisterStore(editorVisualYank(selection, 0), 1);
+    EditorRow *first = editorRowAt(selection->top);
+    EditorRow *last = editorRowAt(selection->bottom);
+    int end = selection->endx + 1 < last->size ? selection->endx + 1 : last->size;
+    char *rest = nimStrndup(ALLOC_TRANSIENT, &editorRowBuffer(last)[end], last->size - end);
+    int restlength = last->size - end;
+    if (lines)
+      editorRowSplice(first, selection->startx, first->size, rest, restlength);
+    else
+      editorRowSplice(first, selection->startx, end - selection->startx, "", 0);
+    nimFree(ALLOC_TRANSIENT, rest);
+    editorDeleteRows(selection->top + 1, lines);
+    editor.window->cursorx = selection->startx;
+  } else {
+    editorRegisterStore(editorYankBlock(selection), 1);
+    for (int y = selection->top; y <= selection->bottom; y++) {
+      EditorRow *row = editorRowAt(y);
+      int from, to;
+      if (!editorBlockBytes(row, selection, &from, &to))
+        continue;
+      // what a tab on either edge had outside the block stays as spaces
+      int first, last, before = 0, after = 0;
+      editorCharColumns(y, from, &first, &last);
+      if (first < selection->left)
+        before = selection->left - first;
+      editorCharColumns(y, to - 1, &first, &last);
+      if (last > selection->right && editorRowBuffer(row)[to - 1] == '\t')
+        after = last - selection->right;
+      char *spaces = nimMalloc(ALLOC_TRANSIENT, before + after + 1);
+      memset(spaces, ' ', before + after);
+      editorRowSplice(row, from, to - from, spaces, before + after);
+      nimFree(ALLOC_TRANSIENT, spaces);
+    }
+    editor.window->cursorx = editorRowColumnToCursorx(editorRowAt(selection->top), selection->left);
+  }
+  editor.deferRender--;
+  editor.window->isEndMode = 0;
+  editorHandleMoveCursorNormal(0);
+}
+
+// I, A and c on a block insert into its first row like usual. the text
+// typed there goes into the other rows when insert mode ends, one splice
+// per row, see editorBlockInsertDone.
+void editorBlockInsertStart(struct Selection *selection, int append, int change)
+{
+  editor.blockInsert = 1;
+  editor.blockTop = selection->top;
+  editor.blockBottom = selection->bottom;
+  editor.blockToEnd = append && selection->right == INT_MAX;
+  editor.blockPad = append;
+  editor.blockChange = change;
+  editor.blockColumn = append && !editor.blockToEnd ? selection->right + 1 : selection->left;
+
+  EditorRow *row = editorRowAt(selection->top);
+  editor.window->cursory = selection->top;
+  int width = editorRowCursorxToRenderx(row, row->size);
+  if (editor.blockToEnd)
+    editor.window->cursorx = row->size;
+  else {
+    // A past the end of a row pads it with spaces, like vim
+    if (append && width < editor.blockColumn) {
+      int pad = editor.blockColumn - width;
+      char *spaces = nimMalloc(ALLOC_TRANSIENT, pad);
+      memset(spaces, ' ', pad);
+      editorRowSplice(row, row->size, 0, spaces, pad);
+      nimFree(ALLOC_TRANSIENT, spaces);
+    }
+    editor.window->cursorx = editorRowColumnToCursorx(row, editor.blockColumn);
+  }
+  editor.blockStartx = editor.window->cursorx;
+  editor.window->isEndMode = 0;
+  editor.mode = MODE_INSERT;
+}
+
+void editorBlockInsertDone()
+{
+  editor.blockInsert = 0;
+  EditorRow *row = getCurrentRow();
+  // the insert left its row, there's nothing to repeat
+  if (!row || editor.window->cursory != editor.blockTop || editor.window->cursorx <= editor.blockStartx)
+    return;
+
+  // padding for short rows, then the text
+  int column = editor.blockToEnd ? 0 : editor.blockColumn;
+  int length = editor.window->cursorx - editor.blockStartx;
+  char *padded = nimMalloc(ALLOC_TRANSIENT, column + length);
+  memset(padded, ' ', column);
+  memcpy(padded + column, &editorRowBuffer(row)[editor.blockStartx], length);
+
+  editor.deferRender++;
+  for (int y = editor.blockTop + 1; y <= editor.blockBottom && y < editor.rowscount; y++) {
+    row = editorRowAt(y);
+    if (editor.blockToEnd) {
+      editorRowSplice(row, row->size, 0, padded, length);
+      continue;
+    }
+    // rows that don't reach into the block are left alone, unless A pads
+    // them. c already took what reached into it away.
+    int width = editorRowCursorxToRenderx(row, row->size);
+    if (width > column || (width == column && (editor.blockChange || editor.blockPad)))
+      editorRowSplice(row, editorRowColumnToCursorx(row, column), 0, padded + column, length);
+    else if (editor.blockPad)
+      editorRowSplice(row, row->size, 0, padded + width, column - width + length);
+  }
+  editor.deferRender--;
+  nimFree(ALLOC_TRANSIENT, padded);
+}
+
+void editorVisualCommand(int command, int argument)
+{
+  struct Selection selection = editorSelection();
+  editor.visualTop = selection.top;
+  editor.visualBottom = selection.bottom;
+  switch (command) {
+    case 'v':
+    case 'V':
+    case CTRL_KEY('v'):
+      if (editor.visualMode == command)
+        editor.mode = MODE_NORMAL;
+      editor.visualMode = command;
+      break;
+    case 'o': {
+        int x = editor.visualx, y = editor.visualy;
+        editor.visualx = editor.window->cursorx;
+        editor.visualy = editor.window->cursory;
+        editor.window->cursorx = x;
+        editor.window->cursory = y;
       }
-    case 'o':
-      editorAppendRowAt("", 0, ++editor.cursory);
-      editor.cursorx = 0;
-      editor.mode=MODE_INSERT;
       break;
-    case 'O':
-      editorAppendRowAt("", 0, editor.cursory);
-      editor.cursorx = 0;
-      editor.mode=MODE_INSERT;
+    case 'd':
+      editor.mode = MODE_NORMAL;
+      editorVisualDelete(&selection);
       break;
-    case ':':
-      editor.mode = MODE_COMMAND;
-      editorRowInsertChar(&editor.commandRow,editor.commandRow.size, ':');
+    case 'y':
+    case 'Y':
+      editor.mode = MODE_NORMAL;
+      editorRegisterStore(editorVisualYank(&selection, command == 'Y'), 0);
+      if (command == 'Y' || editor.visualMode == 'V')
+        editorReportLines(selection.bottom - selection.top + 1, "lines yanked");
+      // the cursor goes to the start of the selection
+      if (editor.visualMode == 'v' && command != 'Y')
+        editor.window->cursorx = selection.startx;
+      else if (editor.visualMode == CTRL_KEY('v') && command != 'Y')
+        editor.window->cursorx = editorRowColumnToCursorx(editorRowAt(selection.top), selection.left);
+      else if (editor.window->cursory != selection.top)
+        editor.window->cursorx = editor.visualx;
+      editor.window->cursory = selection.top;
+      editor.window->isEndMode = 0;
+      editorHandleMoveCursorNormal(0);
       break;
-    case 'd':
-      editor.deleteFlag = 1;
-      editor.beforeDeletex = editor.cursorx;
-      editor.beforeDeletey = editor.cursory;
-      if (editor.sequenceFirst == 'd') {
-        editorDeleteRow(editor.cursory);
-        editorUpdateAllRows();
-        if (editor.cursory > editor.rowscount-1)
-          editor.cursory = editor.rowscount-1;
+    case '"':
+      if (editorRegisterIndex(argument) < 0)
+        editorKeyFail();
+      else
+        editor.regname = argument;
+      break;
+    // the range is the selected rows, like in vim
+    case ':': {
+        editor.mode = MODE_COMMAND;
+        const char *range = ":'<,'>";
+        for (const char *c = range; *c; c++)
+          editorRowInsertChar(&editor.commandRow, editor.commandRow.size, *c);
+      }
+      break;
+    case 'c':
+      editor.mode = MODE_NORMAL;
+      if (editor.visualMode == 'V') {
+        if (!editorCanChangeLines())
+          break;
+        editorVisualDelete(&selection);
+        editorAppendRowAt("", 0, selection.top);
+        editor.window->cursory = selection.top;
+        editor.window->cursorx = 0;
+        editor.mode = MODE_INSERT;
+      } else if (editor.visualMode == 'v') {
+        editorVisualDelete(&selection);
+        editor.window->cursorx = selection.startx;
+        editor.mode = MODE_INSERT;
       } else {
-        editor.sequenceFirst = 'd';
-        return;
+        editorVisualDelete(&selection);
+        editorBlockInsertStart(&selection, 0, 1);
       }
       break;
-    case 'g':
-      if (editor.sequenceFirst == 'g') {
-        if (editor.numberSequenceInt)
-          editorMoveCursoryToLine(&editor.numberSequenceInt);
-        else
-          editorHandleMoveCursorNormal(TOP);
+    case 'I':
+    case 'A':
+      editor.mode = MODE_NORMAL;
+      if (editor.visualMode == 'v') {
+        editor.window->cursory = command == 'I' ? selection.top : selection.bottom;
+        editor.window->cursorx = command == 'I' ? selection.startx : selection.endx + 1;
+        editor.mode = MODE_INSERT;
+        break;
       }
-      else {
-        editor.sequenceFirst = 'g';
-        return;
+      // V works on whole rows
+      if (editor.visualMode == 'V') {
+        selection.left = 0;
+        selection.right = INT_MAX;
       }
+      editorBlockInsertStart(&selection, command == 'A', 0);
       break;
-    case 'x':
-      do {
-        editorRowDeleteChar(getCurrentRow(), editor.cursorx);
-      } while (--editor.numberSequenceInt > 0);
-      if (editor.cursorx > getCurrentRow()->size - 1)
-        editor.cursorx = getCurrentRow()->size-1;
+    default:
+      editorNormalCommand(command, argument);
       break;
-    case WORD_END:
-    if (editor.sequenceFirst == 'g') {
-      editorMoveCursorWordEndBack();
+  }
+}
+
+void editorHandleVisualMode(int keyChar)
+{
+  int argument;
+  int complete = editorKeymapWalk(&visualKeymap, keyChar, &argument);
+  if (!complete)
+    return;
+  int command = visualKeymap.nodes[complete].command;
+  editorVisualCommand(command, argument);
+  if (command != '"')
+    editor.regname = 0;
+}
+// }}}
+// Hex mode {{{
+// a key typed over the digit or the character under the cursor. returns
+// whether it was one that fits there.
+int editorHexReplace(int key)
+{
+  struct Hex *hex = editor.hex;
+  off_t offset = editorHexCursor();
+  if (offset >= hex->size)
+    return 0;
+  if (hex->text) {
+    if (key >= TOP || iscntrl(key))
+      return 0;
+    editorHexSetByte(offset, key);
+    return 1;
+  }
+  if (key >= TOP || !isxdigit(key))
+    return 0;
+  int digit = isdigit(key) ? key - '0' : tolower(key) - 'a' + 10;
+  unsigned char byte = hex->map[offset];
+  byte = hex->nibble ? (byte & 0xf0) | digit : (byte & 0x0f) | digit << 4;
+  editorHexSetByte(offset, byte);
+  return 1;
+}
+
+// moves over digits in the hex column and over bytes in the text column
+void editorHexStep(int count)
+{
+  struct Hex *hex = editor.hex;
+  long long position = editorHexCursor();
+  if (!hex->text)
+    position = position * 2 + hex->nibble;
+  long long last = hex->text ? hex->size - 1 : hex->size * 2 - 1;
+  if ((count < 0 && position == 0) || (count > 0 && position >= last)) {
+    editorKeyFail();
+    return;
+  }
+  position += count;
+  position = position < 0 ? 0 : position > last ? last : position;
+  hex->nibble = hex->text ? 0 : position % 2;
+  editorHexSetCursor(hex->text ? position : position / 2);
+}
+
+void editorHexCommand(int command, int argument)
+{
+  struct Hex *hex = editor.hex;
+  int count = editor.numberSequenceInt > 0 ? editor.numberSequenceInt : 1;
+  int counted = editor.numberSequenceInt > 0;
+  editor.numberSequenceInt = 0;
+  if (command >= WINDOW_SPLIT && command <= WINDOW_QUIT) {
+    editorWindowCommand(command);
+    return;
+  }
+  if (!hex->size && command != ':')
+    return;
+  off_t offset = editorHexCursor();
+  switch (command) {
+    case KEY_LEFT:
+      editorHexStep(-count);
       break;
-    }
     case KEY_RIGHT:
-    case KEY_LEFT:
-    case KEY_LINE_START:
+      editorHexStep(count);
+      break;
+    CASE_UP:
+      editorHexSetCursor(offset - (off_t)count * HEX_BYTES);
+      break;
+    CASE_DOWN:
+      // the last line can be shorter, then the cursor stops on its end
+      editorHexSetCursor(offset + (off_t)count * HEX_BYTES);
+      break;
+    case CTRL_KEY('f'):
+      editorHexSetCursor(offset + (off_t)count * editor.window->rows * HEX_BYTES);
+      break;
+    case CTRL_KEY('b'):
+      editorHexSetCursor(offset - (off_t)count * editor.window->rows * HEX_BYTES);
+      break;
     case KEY_LINE_FIRST:
+    case KEY_LINE_START:
+      editor.window->cursorx = 0;
+      hex->nibble = 0;
+      break;
     case KEY_LINE_END:
-    case WORD_NEXT:
-    case WORD_BACK:
-    CASE_DOWN:
-    CASE_UP:
-      if (editor.numberSequenceInt <= 0)
-        editorHandleMoveCursorNormal(keyChar);
-      else {
-        while (editor.numberSequenceInt > 0) {
-          editorHandleMoveCursorNormal(keyChar);
-          editor.numberSequenceInt--;
+      editorHexSetCursor((off_t)editor.window->cursory * HEX_BYTES + HEX_BYTES - 1);
+      hex->nibble = !hex->text;
+      break;
+    case TOP:
+    case BOTTOM:
+      if (counted)
+        editorHexSetCursor((off_t)(count - 1) * HEX_BYTES);
+      else
+        editorHexSetCursor(command == TOP ? 0 : (off_t)(hex->lines - 1) * HEX_BYTES);
+      hex->nibble = 0;
+      break;
+    case '\t':
+      hex->text = !hex->text;
+      hex->nibble = 0;
+      break;
+    case 'r':
+      for (int i = 0; i < count; i++) {
+        if (!editorHexReplace(argument)) {
+          editorKeyFail();
+          break;
         }
+        if (i < count - 1 && editorHexCursor() + 1 < hex->size)
+          editorHexSetCursor(editorHexCursor() + 1);
       }
       break;
-    case BOTTOM:
-      if (editor.numberSequenceInt) 
-        editorMoveCursoryToLine(&editor.numberSequenceInt);
+    case 'R':
+      editor.mode = MODE_REPLACE;
+      break;
+    case '.':
+      editorRedoRun(counted ? count : 0);
+      break;
+    case ':':
+      editor.mode = MODE_COMMAND;
+      editorRowInsertChar(&editor.commandRow, editor.commandRow.size, ':');
+      break;
+  }
+}
+
+void editorHandleHexMode(int keyChar)
+{
+  int argument;
+  int complete = editorKeymapWalk(&hexKeymap, keyChar, &argument);
+  if (complete)
+    editorHexCommand(hexKeymap.nodes[complete].command, argument);
+}
+
+// R: what is typed replaces digits or characters, moving on after each
+void editorHandleHexReplaceMode(int keyChar)
+{
+  if (keyChar == BACKSPACE || keyChar == KEY_ARROW_LEFT) {
+    editorHexStep(-1);
+    return;
+  }
+  if (keyChar == KEY_ARROW_RIGHT) {
+    editorHexStep(1);
+    return;
+  }
+  if (!editorHexReplace(keyChar)) {
+    editorKeyFail();
+    return;
+  }
+  long long position = editorHexCursor();
+  if (editor.hex->text ? position + 1 < editor.hex->size : position + 1 < editor.hex->size || !editor.hex->nibble)
+    editorHexStep(1);
+}
+// }}}
+// Key dispatch {{{
+void editorRedoKey(int ch);
+void editorRedoDone();
+
+void editorDispatchKey(int ch)
+{
+  editorRedoKey(ch);
+  if (ch == ESC) {
+    abClear(&editor.numberSequence);
+    editor.keyNode = 0;
+    editor.regname = 0;
+
+    editorClearRow(&editor.commandRow);
+    if (editor.mode == MODE_VISUAL) {
+      struct Selection selection = editorSelection();
+      editor.visualTop = selection.top;
+      editor.visualBottom = selection.bottom;
+    }
+    if (editor.mode == MODE_INSERT && editor.blockInsert)
+      editorBlockInsertDone();
+    if (editor.mode == MODE_INSERT)
+      editorMoveCursorLeft();
+
+    editor.mode = MODE_NORMAL;
+    editorRedoDone();
+    return;
+  }
+  switch (editor.mode) {
+    case MODE_NORMAL:
+      if (editor.hex)
+        editorHandleHexMode(ch);
       else
-        editorHandleMoveCursorNormal(keyChar);
+        editorHandleNormalMode(ch);
       break;
-    case CTRL_KEY('f'):
-      editor.cursory+=editor.screenrows;
-      if (editor.cursory > editor.rowscount-1)
-        editor.cursory = editor.rowscount-1;
+    case MODE_INSERT:
+      editorHandleInsertMode(ch);
       break;
-    case CTRL_KEY('b'):
-      editor.cursory-=editor.screenrows;
-      if (editor.cursory < 0)
-        editor.cursory = 0;
+    case MODE_REPLACE:
+      editorHandleHexReplaceMode(ch);
       break;
+    case MODE_VISUAL:
+      editorHandleVisualMode(ch);
+      break;
+    case MODE_COMMAND:
+      editorHandleCommandMode(ch);
+      if (editor.commandRow.size == 0)
+        editor.mode = MODE_NORMAL;
+      break;
+  }
+  editorRedoDone();
+}
+
+struct Keymap *editorMaps()
+{
+  if (editor.mode == MODE_NORMAL)
+    return &normalMaps;
+  if (editor.mode == MODE_INSERT)
+    return &insertMaps;
+  return NULL;
+}
+
+void editorMapKey(int key);
+
+// feeds the keys a mapping stands for, through the mappings again unless
+// it is a noremap. the keys are copied since a :map among them can
+// replace the mapping.
+void editorMapExpand(struct KeyNode *mapping)
+{
+  if (editor.mapDepth >= KEYMAP_MAX_DEPTH) {
+    editorSetPrompt("E223: recursive mapping");
+    editor.mapAbort = 1;
+    return;
+  }
+  int noremap = mapping->noremap, keyscount = mapping->rhscount;
+  int *keys = nimMalloc(ALLOC_TRANSIENT, sizeof(int) * keyscount);
+  memcpy(keys, mapping->rhs, sizeof(int) * keyscount);
+
+  editor.mapDepth++;
+  for (int i = 0; i < keyscount && !editor.mapAbort && !editor.keyFailed; i++) {
+    if (noremap)
+      editorDispatchKey(keys[i]);
+    else
+      editorMapKey(keys[i]);
+  }
+  nimFree(ALLOC_TRANSIENT, keys);
+  if (--editor.mapDepth == 0)
+    editor.mapAbort = 0;
+}
+
+void editorMapReset()
+{
+  editor.mapNode = 0;
+  editor.mapPendingCount = 0;
+  editor.mapDeadline = 0;
+}
+
+// the pending keys didn't make a mapping. the first goes through as it
+// is and the rest is looked at again.
+void editorMapFlush()
+{
+  int keys[KEYMAP_PENDING];
+  int keyscount = editor.mapPendingCount;
+  memcpy(keys, editor.mapPending, sizeof(int) * keyscount);
+  editorMapReset();
+
+  editorDispatchKey(keys[0]);
+  for (int i = 1; i < keyscount; i++)
+    editorMapKey(keys[i]);
+}
+
+// keys that start a mapping wait for the rest of it, for timeoutlen at
+// most. keys that don't go straight to the mode.
+void editorMapKey(int key)
+{
+  struct Keymap *map = editorMaps();
+  if (!map || (!editor.mapPendingCount && !keymapNext(map, 0, key))) {
+    editorDispatchKey(key);
+    return;
+  }
+
+  editor.mapPending[editor.mapPendingCount++] = key;
+  int next = keymapNext(map, editor.mapNode, key);
+  struct KeyNode *node = &map->nodes[next];
+  if (!next || (!node->rhs && !node->children)) {
+    editorMapFlush();
+    return;
+  }
+  if (!node->children) {
+    editorMapReset();
+    editorMapExpand(node);
+    return;
+  }
+  editor.mapNode = next;
+  editor.mapDeadline = monotonicNs() + editor.timeoutlen * 1000000LL;
+  if (editor.mapPendingCount == KEYMAP_PENDING)
+    editorMapFlush();
+}
+
+void editorMacroKey(int key);
+
+void editorProcessKey(int ch)
+{
+  long long start = monotonicNs();
+  // a key can change anything in its window. the others draw the rows
+  // that changed under them, see editorRowChanging.
+  editor.window->damageAll = 1;
+  editor.dirty = 1;
+  editor.keyFailed = 0;
+  editorMacroKey(ch);
+  editorMapKey(ch);
+  editorWordsFlush();
+  arenaReset(&transientArena);
+  editorPerfAdd(PERF_EDIT, start);
+}
+
+// bytes from the terminal become keys here. escape sequences are walked
+// in terminalKeymap, and a prefix that isn't completed in ttimeoutlen is
+// passed on as the keys it was typed as, like a lone escape.
+void editorFeedByte(int c);
+
+void editorEscapeFlush()
+{
+  int keys[KEYMAP_PENDING];
+  int keyscount = editor.escapePendingCount;
+  memcpy(keys, editor.escapePending, sizeof(int) * keyscount);
+  editor.escapeNode = 0;
+  editor.escapePendingCount = 0;
+  editor.escapeDeadline = 0;
+
+  editorProcessKey(keys[0]);
+  for (int i = 1; i < keyscount; i++)
+    editorFeedByte(keys[i]);
+}
+
+void editorFeedByte(int c)
+{
+  int next = keymapNext(&terminalKeymap, editor.escapeNode, c);
+  if (!next) {
+    if (!editor.escapePendingCount) {
+      editorProcessKey(c);
+      return;
+    }
+    editor.escapePending[editor.escapePendingCount++] = c;
+    editorEscapeFlush();
+    return;
+  }
+
+  editor.escapePending[editor.escapePendingCount++] = c;
+  struct KeyNode *node = &terminalKeymap.nodes[next];
+  if (!node->children) {
+    editor.escapeNode = 0;
+    editor.escapePendingCount = 0;
+    editor.escapeDeadline = 0;
+    editorProcessKey(node->command);
+    return;
   }
-  editor.sequenceFirst = '\0';
+  editor.escapeNode = next;
+  editor.escapeDeadline = monotonicNs() + editor.ttimeoutlen * 1000000LL;
+}
 
-  if (editor.deleteFlag) {
-    int starty = editor.cursory;
-    int endy = editor.beforeDeletey;
+// milliseconds until a pending escape sequence or mapping times out, or -1
+int editorKeyTimeoutMs()
+{
+  long long deadline = editor.escapeDeadline;
+  if (editor.mapDeadline && (!deadline || editor.mapDeadline < deadline))
+    deadline = editor.mapDeadline;
+  if (!deadline)
+    return -1;
+  long long wait = deadline - monotonicNs();
+  return wait > 0 ? (wait + 999999) / 1000000 : 0;
+}
 
-    if (starty > endy) {
-      starty=editor.beforeDeletey;
-      endy = editor.cursory;
-    }
-      
-    int startx = editor.cursorx;
-    int endx = editor.beforeDeletex;
+// gives up on whatever timed out by now. pending mappings that are
+// complete are used, everything else goes through as typed.
+void editorKeyTimeout(long long now)
+{
+  if (editor.escapeDeadline && now >= editor.escapeDeadline)
+    editorEscapeFlush();
+  if (editor.mapDeadline && now >= editor.mapDeadline) {
+    long long start = monotonicNs();
+    editor.window->damageAll = 1;
+    editor.dirty = 1;
+    editor.keyFailed = 0;
+    struct KeyNode *node = &editorMaps()->nodes[editor.mapNode];
+    if (node->rhs) {
+      editorMapReset();
+      editorMapExpand(node);
+    } else
+      editorMapFlush();
+    arenaReset(&transientArena);
+    editorPerfAdd(PERF_EDIT, start);
+  }
+}
+// }}}
+// Macros {{{
+void keyBufferAppend(struct KeyBuffer *buffer, int key)
+{
+  if (buffer->count == buffer->capacity) {
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 64;
+    buffer->keys = nimRealloc(ALLOC_OTHER, buffer->keys, sizeof(int) * buffer->capacity);
+  }
+  buffer->keys[buffer->count++] = key;
+}
 
-    if (startx > endx) {
-      startx=editor.beforeDeletex;
-      endx = editor.cursorx;
-    }
-    if (starty != endy) {
-      int deleteCount = 0;
-      for (int i=starty; i < endy+1; i++) {
-        editorDeleteRow(starty);
-        editorUpdateAllRows();
-        if (editor.cursory > 0)
-          editor.cursory--;
-      }
-      // editorRemoveRow(editor.cursory+1);
-      // editorRemoveRow(start);
-    } else if (startx != endx) {
+// a motion that can't move, or a command that can't run. like a beep in
+// vim it throws away the rest of the macro or mapping being run.
+void editorKeyFail()
+{
+  editor.keyFailed = 1;
+}
 
-      for (int i=startx; i < endx; i++) {
-        editorRowDeleteChar(getCurrentRow(), startx);
-        editor.cursorx--;
-      }
-      editorUpdateRow(getCurrentRow());
+// q{a-z} starts recording into a register, q{A-Z} appends to it, and
+// reg 0 stops. the q that stopped it was recorded already and is dropped.
+void editorMacroRecord(int reg)
+{
+  if (!reg) {
+    struct KeyBuffer *macro = &editor.macros[editor.recording - 'a'];
+    if (macro->count)
+      macro->count--;
+    editor.recording = 0;
+    return;
+  }
+  if (!isalpha(reg)) {
+    editorKeyFail();
+    return;
+  }
+  editor.recording = tolower(reg);
+  if (!isupper(reg))
+    editor.macros[editor.recording - 'a'].count = 0;
+}
+
+// typed keys, before mappings, like vim records them
+void editorMacroKey(int key)
+{
+  if (editor.recording)
+    keyBufferAppend(&editor.macros[editor.recording - 'a'], key);
+}
+
+// feeds a copy of keys through the mappings count times, or until one of
+// them fails. nothing is drawn in between, the next frame shows the end.
+void editorReplay(struct KeyBuffer *keys, int count, int redo)
+{
+  if (editor.replaying >= KEYMAP_MAX_DEPTH) {
+    editorSetPrompt("E169: Command too recursive");
+    editorKeyFail();
+    return;
+  }
+  int keyscount = keys->count;
+  int *copy = nimMalloc(ALLOC_OTHER, sizeof(int) * (keyscount + 1));
+  if (keyscount)
+    memcpy(copy, keys->keys, sizeof(int) * keyscount);
+
+  editor.replaying++;
+  editor.deferRender++;
+  editor.redoReplaying += redo;
+  for (int n = 0; n < count && !editor.keyFailed; n++) {
+    for (int i = 0; i < keyscount && !editor.keyFailed; i++) {
+      if (redo)
+        editorDispatchKey(copy[i]);
+      else
+        editorMapKey(copy[i]);
     }
-    editor.deleteFlag = 0;
+    // the arena would otherwise keep what every pass allocated
+    if (editor.replaying == 1 && !editor.mapDepth)
+      arenaReset(&transientArena);
   }
-  if (editor.backToInsertFlag)
-    editor.mode = MODE_INSERT;
+  editor.redoReplaying -= redo;
+  editor.deferRender--;
+  editor.replaying--;
+  nimFree(ALLOC_OTHER, copy);
 }
-// }}}
-// Insert mode {{{ 
-void editorHandleInsertMode(int keyChar) 
+
+void editorMacroRun(int reg, int count)
 {
-  switch (keyChar) {
-    case ENTER:
-      editorNewlineAtCursorx();
-      editor.cursorx = 0;
-    break;
-    case CTRL_KEY('o'):
-      editor.backToInsertFlag = 1;
-      editor.mode = MODE_NORMAL;
-      break;
-    case BACKSPACE:
-      editorRowDeleteChar(getCurrentRow(), editor.cursorx-1);
-      editor.cursorx--;
-      break;
-    case CTRL_KEY('u'):
-      for (int i = editor.cursorx-1; i >= 0; i--) {
-        editorRowDeleteChar(getCurrentRow(), i);
-        editor.cursorx--;
-      }
-      editorUpdateRow(getCurrentRow());
-      break;
-    default:
-      if (editor.cursory == editor.rowscount) {
-        editorAppendRow("", 0);
-      }
-      editorRowInsertChar(&editor.rows[editor.cursory], editor.cursorx, keyChar);
-      editor.cursorx++;
-      break;
+  if (!isalpha(reg)) {
+    editorKeyFail();
+    return;
+  }
+  editor.lastMacro = tolower(reg);
+  editorReplay(&editor.macros[editor.lastMacro - 'a'], count, 0);
+}
+
+// . repeats the keys of the last change. they're collected from the start
+// of every normal mode command, and kept once it changed the buffer or
+// went on to insert mode, up to the escape that ends that.
+void editorRedoKey(int ch)
+{
+  if (editor.redoReplaying)
+    return;
+  if (editor.mode == MODE_NORMAL && !editor.redoInsert && !editor.keyNode
+      && !editor.numberSequence.length && !editor.regname) {
+    editor.redoPending.count = 0;
+    editor.redoChanges = editor.changes;
+  }
+  if (editor.mode != MODE_COMMAND)
+    keyBufferAppend(&editor.redoPending, ch);
+}
+
+// where the count goes in the keys of a change: after a "x register
+int editorRedoCountAt(struct KeyBuffer *keys)
+{
+  return keys->count > 1 && keys->keys[0] == '"' ? 2 : 0;
+}
+
+// takes a count at keys[at] out of redo. returns it, or 0 without one.
+int editorRedoTakeDigits(int at)
+{
+  struct KeyBuffer *redo = &editor.redo;
+  int end = at, count = 0;
+  if (end < redo->count && redo->keys[end] >= '1' && redo->keys[end] <= '9')
+    while (end < redo->count && redo->keys[end] >= '0' && redo->keys[end] <= '9')
+      count = count * 10 + redo->keys[end++] - '0';
+  memmove(&redo->keys[at], &redo->keys[end], sizeof(int) * (redo->count - end));
+  redo->count -= end - at;
+  return count;
+}
+
+// moves the count of the change out of its keys, into redoCount. as in
+// editorKeymapWalk, one between the operator and the motion wins.
+void editorRedoTakeCount()
+{
+  int at = editorRedoCountAt(&editor.redo);
+  editor.redoCount = editorRedoTakeDigits(at);
+  if (at < editor.redo.count && (editor.redo.keys[at] == 'd' || editor.redo.keys[at] == 'y')) {
+    int motion = editorRedoTakeDigits(at + 1);
+    if (motion)
+      editor.redoCount = motion;
+  }
+}
+
+void editorRedoDone()
+{
+  if (editor.redoReplaying)
+    return;
+  if (editor.mode == MODE_INSERT) {
+    editor.redoInsert = 1;
+    return;
+  }
+  // : commands aren't repeated
+  if (editor.mode == MODE_COMMAND)
+    editor.redoPending.count = 0;
+  if (editor.mode != MODE_NORMAL || editor.keyNode || editor.numberSequence.length || editor.regname)
+    return;
+  if (editor.redoPending.count && (editor.redoInsert || editor.changes != editor.redoChanges)) {
+    struct KeyBuffer last = editor.redo;
+    editor.redo = editor.redoPending;
+    editor.redoPending = last;
+    editorRedoTakeCount();
+  }
+  editor.redoPending.count = 0;
+  editor.redoInsert = 0;
+}
+
+// count is the one typed before the ., or 0. like in vim it replaces the
+// count of the change, and a change made without one is run count times.
+void editorRedoRun(int count)
+{
+  // the . itself is not a change
+  editor.redoPending.count = 0;
+  if (!editor.redo.count) {
+    editorKeyFail();
+    return;
+  }
+  if (!editor.redoCount) {
+    editorReplay(&editor.redo, count ? count : 1, 1);
+    return;
+  }
+
+  if (count)
+    editor.redoCount = count;
+  struct KeyBuffer keys = {0};
+  int at = editorRedoCountAt(&editor.redo);
+  char digits[16];
+  int digitscount = snprintf(digits, sizeof(digits), "%d", editor.redoCount);
+  for (int i = 0; i < editor.redo.count; i++) {
+    if (i == at)
+      for (int j = 0; j < digitscount; j++)
+        keyBufferAppend(&keys, digits[j]);
+    keyBufferAppend(&keys, editor.redo.keys[i]);
   }
+  editorReplay(&keys, 1, 1);
+  nimFree(ALLOC_OTHER, keys.keys);
 }
 // }}}
 // Init {{{
 void initEditor()
 {
-  editor.cursorx = 0;
-  editor.cursory = 0;
+  editorWindowsInit();
   editor.beforeDeletex = 0;
   editor.beforeDeletey= 0;
 
-  editor.savedcursorx = 0;
   editor.rowscount = 0;
-  editor.rowoffset = 0;
-  editor.coloffset = 0;
   editor.numberSequenceInt = 0;
   editor.mode = MODE_NORMAL;
   editor.rows = NULL;
+  editor.rowscapacity = 0;
+  editor.large = NULL;
+  if (!editor.memoryCap)
+    editor.memoryCap = LARGEFILE_DEFAULT_CAP;
   editor.filename = NULL;
-  editor.isEndMode = 0;
-  editor.commandRow.buffer = NULL;
-  editor.commandRow.size = 0;
+  editor.iskeyword = NULL;
+  editorSetIskeyword(ISKEYWORD_DEFAULT);
+  memset(&editor.commandRow, 0, sizeof(editor.commandRow));
 
-  editor.deleteFlag = 0;
+  editor.operator = 0;
   editor.backToInsertFlag = 0;
-  editor.findFlag = 0;
+  editor.regname = 0;
+  editorRegistersClear();
+  editor.keyNode = 0;
+  editor.mapNode = editor.mapPendingCount = editor.mapDepth = 0;
+  editor.escapeNode = editor.escapePendingCount = 0;
+  editor.escapeDeadline = editor.mapDeadline = 0;
+  editor.ttimeoutlen = TTIMEOUTLEN_DEFAULT;
+  editor.timeoutlen = TIMEOUTLEN_DEFAULT;
+  keymapCompile();
+
+  editor.prompt = (struct appendBuffer)ABUF_INIT_FOR(ALLOC_COMMAND);
+  editor.frame = (struct appendBuffer)ABUF_INIT_FOR(ALLOC_OUTPUT);
+  allocatorSet(ALLOC_TRANSIENT, arenaAllocator(&transientArena));
+
+  editor.numberSequence = (struct appendBuffer)ABUF_INIT_FOR(ALLOC_COMMAND);
+
+  editor.quitRequested = 0;
+  editor.stream = NULL;
+  editor.filter = NULL;
+  editor.hex = NULL;
+  editor.folds.method = FOLD_MANUAL;
+  editor.folds.shiftwidth = FOLD_SHIFTWIDTH_DEFAULT;
+  editorFoldsReset();
+  editor.completion.text = (struct appendBuffer)ABUF_INIT_FOR(ALLOC_OTHER);
+  editor.typeahead = (struct appendBuffer)ABUF_INIT_FOR(ALLOC_COMMAND);
+  editor.typeaheadNext = 0;
+  editor.visualTop = editor.visualBottom = -1;
+  editor.watchfd = -1;
+  editor.fps = FRAME_FPS_DEFAULT;
+  editor.frameSent = 0;
+  editor.frameBackoff = 0;
+  editor.lastFrame = 0;
+  editor.outfd = STDOUT_FILENO;
+  editorDamageAll();
+  editor.bytesWritten = 0;
+
+  // there is no terminal to ask in batch mode, pretend to be a vt100
+  if (editor.headless || editor.benchmark) {
+    editor.screenrows = 24 - 1;
+    editor.screencols = 80;
+  } else {
+    if (getWindowSize(&editor.screenrows, &editor.screencols) == EXIT_FAILURE)
+      die("getWindowSize");
+    // we want the last row to be for our commands
+    editor.screenrows -= 1;
+  }
+  editorLayout();
+}
+// }}}
+// Batch mode {{{
+struct BatchJob {
+  char *script;
+  size_t scriptlength;
+  char **commands;
+  int commandscount;
+};
+
+int editorReadScript(const char *filename, struct BatchJob *job)
+{
+  FILE *fptr = fopen(filename, "r");
+  if (!fptr)
+    return EXIT_FAILURE;
+
+  struct appendBuffer ab = ABUF_INIT_FOR(ALLOC_OTHER);
+  char chunk[4096];
+  size_t nread;
+  while ((nread = fread(chunk, 1, sizeof(chunk), fptr)) > 0)
+    abAppend(&ab, chunk, nread);
+  fclose(fptr);
+
+  nimFree(ALLOC_OTHER, job->script);
+  job->script = ab.buffer;
+  job->scriptlength = ab.length;
+  return EXIT_SUCCESS;
+}
+
+// the keys go through terminalKeymap like typed ones, so a script can
+// hold escape sequences such as \x1b[C for the right arrow
+void editorBatchFeed(const char *keys, size_t length)
+{
+  for (size_t i = 0; i < length && !editor.quitRequested; i++) {
+    // scripts are usually written in an editor, so a newline means enter
+    int ch = keys[i] == '\n' ? ENTER : (unsigned char)keys[i];
+    editorFeedByte(ch);
+  }
+  // nothing else is coming to complete a pending escape sequence
+  if (editor.escapePendingCount && !editor.quitRequested)
+    editorEscapeFlush();
+}
+
+int editorBatchFile(struct BatchJob *job, char *filename)
+{
+  initEditor();
+  editorOpen(filename);
+
+  editorBatchFeed(job->script, job->scriptlength);
+  // nothing else is coming to complete a pending mapping
+  editorKeyTimeout(LLONG_MAX);
+  for (int i = 0; i < job->commandscount && !editor.quitRequested; i++) {
+    // leave whatever the script was doing before running a command
+    editorProcessKey(ESC);
+    if (job->commands[i][0] != ':')
+      editorProcessKey(':');
+    editorBatchFeed(job->commands[i], strlen(job->commands[i]));
+    editorProcessKey(ENTER);
+  }
+
+  // the script ran :q, :wq or :x itself and already decided about saving.
+  // a failed write is the worker's exit status, so the pipeline sees it.
+  if (editor.quitRequested)
+    return EXIT_SUCCESS;
+  if (editorWrite() == EXIT_FAILURE) {
+    fprintf(stderr, "%.*s\n", editor.prompt.length, editor.prompt.buffer);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
-  abReinit(&editor.prompt);
+int editorBatch(struct BatchJob *job, char **files, int filescount, int workers)
+{
+  if (workers <= 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+
+  int status = EXIT_SUCCESS;
+  int running = 0;
+  for (int i = 0; i < filescount || running; ) {
+    if (i < filescount && running < workers) {
+      pid_t pid = fork();
+      if (pid == -1)
+        die("fork");
+      if (pid == 0)
+        _exit(editorBatchFile(job, files[i]));
+      running++;
+      i++;
+      continue;
+    }
+
+    int childStatus;
+    if (wait(&childStatus) == -1)
+      die("wait");
+    running--;
+    if (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != EXIT_SUCCESS)
+      status = EXIT_FAILURE;
+  }
+  return status;
+}
+// }}}
+// Benchmark {{{
+int compareLongLong(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+int editorReadTrace(const char *filename, int **keys, int *keyscount)
+{
+  FILE *fptr = fopen(filename, "r");
+  if (!fptr)
+    return EXIT_FAILURE;
+
+  long long timestamp;
+  int key;
+  *keys = NULL;
+  *keyscount = 0;
+  while (fscanf(fptr, "%lld %d", &timestamp, &key) == 2) {
+    *keys = nimRealloc(ALLOC_OTHER, *keys, sizeof(int) * (*keyscount+1));
+    (*keys)[(*keyscount)++] = key;
+  }
+  fclose(fptr);
+  return EXIT_SUCCESS;
+}
+
+// replays a trace through the real mode handlers and renderer with the
+// frames going to /dev/null, and reports how long each keystroke took
+int editorBenchmark(const char *tracename, char *filename)
+{
+  int *keys, keyscount;
+  if (editorReadTrace(tracename, &keys, &keyscount) == EXIT_FAILURE) {
+    perror(tracename);
+    return EXIT_FAILURE;
+  }
+
+  initEditor();
+  editor.outfd = open("/dev/null", O_WRONLY);
+  if (editor.outfd == -1)
+    die("open");
+  editorOpen(filename);
+
+  long long *latencies = nimMalloc(ALLOC_OTHER, sizeof(long long) * (keyscount ? keyscount : 1));
+  int replayed = 0;
+  long long start = monotonicNs();
+  editorRefreshScreen();
+  for (int i = 0; i < keyscount && !editor.quitRequested; i++) {
+    long long keyStart = monotonicNs();
+    editorFeedByte(keys[i]);
+    editorCompressColdRows();
+    editorRefreshScreen();
+    latencies[replayed++] = monotonicNs() - keyStart;
+  }
+  editorKeyTimeout(LLONG_MAX);
+  long long total = monotonicNs() - start;
+
+  qsort(latencies, replayed, sizeof(long long), compareLongLong);
+  long long p50 = replayed ? latencies[replayed / 2] : 0;
+  long long p99 = replayed ? latencies[(replayed * 99) / 100] : 0;
+  long long max = replayed ? latencies[replayed - 1] : 0;
+
+  printf("%s: %d keys, %d lines\n", filename, replayed, editor.rowscount);
+  printf("  latency p50 %.1fus, p99 %.1fus, max %.1fus\n", p50 / 1e3, p99 / 1e3, max / 1e3);
+  printf("  frame bytes %lld total, %lld per frame\n", editor.bytesWritten,
+         editor.bytesWritten / (replayed + 1));
+  printf("  total time %.3fms\n", total / 1e6);
+
+  nimFree(ALLOC_OTHER, latencies);
+  nimFree(ALLOC_OTHER, keys);
+  close(editor.outfd);
+  return EXIT_SUCCESS;
+}
+// }}}
+// Microbenchmarks {{{
+// synthetic workloads for the row and file primitives. each case prints
+// a csv line with the time and the allocations per operation, so runs
+// before and after a change to the buffer can be compared with diff.
+// ops per case: fewer on big buffers, where one row op can move them all
+#define MICROBENCH_ROW_OPS 10000
+#define MICROBENCH_MIN_OPS 1000
+#define MICROBENCH_BUFFER_LINES 200000
+const int microbenchLines[] = {1000, 100000};
+const int microbenchLengths[] = {16, 200};
+// one tab in every n characters, 0 for none
+const int microbenchTabs[] = {0, 8};
+const char *microbenchPositions[] = {"head", "middle", "tail"};
+
+struct Microbench {
+  int lines, length, tabs, position, ops;
+  char *line;
+  char *path;
+};
+
+// only what runs between resume and pause is counted
+struct MicrobenchClock {
+  long long ns, allocs, bytes;
+  long long started, startAllocs, startBytes;
+} microbenchClock;
+
+void microbenchAllocs(long long *allocs, long long *bytes)
+{
+  *allocs = *bytes = 0;
+  for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+    *allocs += allocators.stats[i].allocs;
+    *bytes += allocators.stats[i].bytes;
+  }
+}
+
+void microbenchResume()
+{
+  microbenchAllocs(&microbenchClock.startAllocs, &microbenchClock.startBytes);
+  microbenchClock.started = monotonicNs();
+}
+
+void microbenchPause()
+{
+  long long now = monotonicNs(), allocs, bytes;
+  microbenchAllocs(&allocs, &bytes);
+  microbenchClock.ns += now - microbenchClock.started;
+  microbenchClock.allocs += allocs - microbenchClock.startAllocs;
+  microbenchClock.bytes += bytes - microbenchClock.startBytes;
+}
+
+// where head, middle and tail are in something count long
+int microbenchAt(int position, int count)
+{
+  return position == 0 ? 0 : position == 1 ? count / 2 : count;
+}
+
+void microbenchClear()
+{
+  for (int i = 0; i < editor.rowscount; i++)
+    editorFreeRow(&editor.rows[i]);
+  nimFree(ALLOC_ROWS, editor.rows);
+  editor.rows = NULL;
+  editor.rowscount = editor.rowscapacity = 0;
+  editor.window->cursorx = editor.window->cursory = 0;
+}
+
+void microbenchFill(struct Microbench *bench, int lines)
+{
+  microbenchClear();
+  for (int i = 0; i < lines; i++)
+    editorAppendRow(bench->line, bench->length);
+}
+
+void microbenchAppendRow(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++)
+    editorAppendRowAt(bench->line, bench->length, microbenchAt(bench->position, editor.rowscount));
+  microbenchPause();
+}
+
+void microbenchDeleteRow(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines + bench->ops);
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++)
+    editorDeleteRow(microbenchAt(bench->position, editor.rowscount - 1));
+  microbenchPause();
+}
+
+void microbenchInsertChar(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++) {
+    EditorRow *row = &editor.rows[i % editor.rowscount];
+    editorRowInsertChar(row, microbenchAt(bench->position, row->size), 'x');
+  }
+  microbenchPause();
+}
+
+void microbenchAppendString(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++)
+    editorRowAppendString(&editor.rows[i % editor.rowscount], "0123456789abcdef", 16);
+  microbenchPause();
+}
+
+void microbenchUpdateRow(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++)
+    editorUpdateRow(&editor.rows[i % editor.rowscount]);
+  microbenchPause();
+}
+
+void microbenchRowsToString(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++) {
+    int length;
+    nimFree(ALLOC_OUTPUT, editorRowsToString(&length));
+  }
+  microbenchPause();
+}
+
+void microbenchSave(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  editor.filename = bench->path;
+  microbenchResume();
+  for (int i = 0; i < bench->ops; i++)
+    editorWrite();
+  microbenchPause();
+  editor.filename = NULL;
+}
+
+void microbenchOpen(struct Microbench *bench)
+{
+  microbenchFill(bench, bench->lines);
+  editor.filename = bench->path;
+  editorWrite();
+  editor.filename = NULL;
+  for (int i = 0; i < bench->ops; i++) {
+    microbenchClear();
+    microbenchResume();
+    editorOpen(bench->path);
+    microbenchPause();
+  }
+  nimFree(ALLOC_OTHER, editor.filename);
+  editor.filename = NULL;
+}
 
-  abReinit(&editor.numberSequence);
+struct MicrobenchCase {
+  const char *name;
+  void (*run)(struct Microbench *bench);
+  // whether the edit position matters, and whether it works on the whole
+  // buffer (fewer ops then)
+  int positions, whole;
+};
+const struct MicrobenchCase microbenchCases[] = {
+  {"append_row", microbenchAppendRow, 1, 0},
+  {"delete_row", microbenchDeleteRow, 1, 0},
+  {"insert_char", microbenchInsertChar, 1, 0},
+  {"append_string", microbenchAppendString, 0, 0},
+  {"update_row", microbenchUpdateRow, 0, 0},
+  {"rows_to_string", microbenchRowsToString, 0, 1},
+  {"save", microbenchSave, 0, 1},
+  {"open", microbenchOpen, 0, 1},
+};
+
+// runs the cases whose name contains filter, all of them when it's empty
+int editorMicrobench(const char *filter)
+{
+  editor.headless = 1;
+  initEditor();
+
+  char path[] = "/tmp/nim-microbench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  printf("benchmark,lines,length,tabs,position,ops,ns_per_op,bytes_per_op,allocs_per_op\n");
+  for (size_t c = 0; c < sizeof(microbenchCases) / sizeof(*microbenchCases); c++) {
+    const struct MicrobenchCase *bench = &microbenchCases[c];
+    if (!strstr(bench->name, filter))
+      continue;
+    for (size_t l = 0; l < sizeof(microbenchLines) / sizeof(*microbenchLines); l++)
+    for (size_t n = 0; n < sizeof(microbenchLengths) / sizeof(*microbenchLengths); n++)
+    for (size_t t = 0; t < sizeof(microbenchTabs) / sizeof(*microbenchTabs); t++)
+    for (int p = 0; p < (bench->positions ? 3 : 1); p++) {
+      struct Microbench run = {microbenchLines[l], microbenchLengths[n], microbenchTabs[t], p};
+      run.ops = MICROBENCH_ROW_OPS * 1000 / run.lines;
+      if (run.ops > MICROBENCH_ROW_OPS)
+        run.ops = MICROBENCH_ROW_OPS;
+      if (run.ops < MICROBENCH_MIN_OPS)
+        run.ops = MICROBENCH_MIN_OPS;
+      if (bench->whole)
+        run.ops = MICROBENCH_BUFFER_LINES / run.lines > 3 ? MICROBENCH_BUFFER_LINES / run.lines : 3;
+      run.path = path;
+
+      // the same pseudo random line every run
+      unsigned int seed = 1;
+      run.line = nimMalloc(ALLOC_OTHER, run.length);
+      for (int i = 0; i < run.length; i++) {
+        seed = seed * 1103515245 + 12345;
+        int r = seed >> 16;
+        run.line[i] = run.tabs && r % run.tabs == 0 ? '\t' : r % 6 == 0 ? ' ' : 'a' + r % 26;
+      }
 
-  if (getWindowSize(&editor.screenrows, &editor.screencols) == EXIT_FAILURE)
-    die("getWindowSize");
-  // we want the last row to be for our commands
-  editor.screenrows -= 1;
+      memset(&microbenchClock, 0, sizeof(microbenchClock));
+      bench->run(&run);
+      printf("%s,%d,%d,%d,%s,%d,%.1f,%.1f,%.2f\n", bench->name, run.lines, run.length, run.tabs,
+             bench->positions ? microbenchPositions[p] : "-", run.ops,
+             (double)microbenchClock.ns / run.ops, (double)microbenchClock.bytes / run.ops,
+             (double)microbenchClock.allocs / run.ops);
+      fflush(stdout);
+      nimFree(ALLOC_OTHER, run.line);
+    }
+  }
+  microbenchClear();
+  unlink(path);
+  return EXIT_SUCCESS;
 }
+// }}}
+// Main {{{
 int main(int argc, char *argv[])
 { 
+  struct BatchJob job = {NULL, 0, NULL, 0};
+  int workers = 0;
+  char *benchTrace = NULL, *microbench = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:c:j:w:B:X:P:M:nb")) != -1) {
+    switch (opt) {
+      case 's':
+        if (editorReadScript(optarg, &job) == EXIT_FAILURE) {
+          perror(optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        job.commands = nimRealloc(ALLOC_OTHER, job.commands, sizeof(char *) * (job.commandscount+1));
+        job.commands[job.commandscount++] = optarg;
+        break;
+      case 'j':
+        workers = atoi(optarg);
+        break;
+      case 'w':
+        editor.trace = fopen(optarg, "w");
+        if (!editor.trace) {
+          perror(optarg);
+          return EXIT_FAILURE;
+        }
+        editor.traceStart = monotonicNs();
+        break;
+      case 'B':
+        benchTrace = optarg;
+        break;
+      case 'X':
+        microbench = optarg;
+        break;
+      case 'M':
+        editor.memoryCap = atoll(optarg) * 1024 * 1024;
+        break;
+      case 'n':
+        editor.noIndexCache = 1;
+        break;
+      case 'b':
+        editor.binary = 1;
+        break;
+      case 'P':
+        if (editorPerfOpenCsv(optarg) == EXIT_FAILURE) {
+          perror(optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-s scriptin] [-c command]... [-j workers] [-w traceout] [-B tracein] [-X microbench] [-P perf.csv] [-M memory MiB] [-n] [-b] [+F] [file | -]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (job.script || job.commandscount) {
+    editor.headless = 1;
+    return editorBatch(&job, &argv[optind], argc - optind, workers);
+  }
+
+  if (microbench)
+    return editorMicrobench(microbench);
+
+  if (benchTrace) {
+    editor.benchmark = 1;
+    int status = EXIT_SUCCESS;
+    for (int i = optind; i < argc; i++)
+      if (editorBenchmark(benchTrace, argv[i]) == EXIT_FAILURE)
+        status = EXIT_FAILURE;
+    return status;
+  }
+
+  // +F follows the file as it grows, like less
+  char *filename = NULL;
+  for (int i = optind; i < argc; i++) {
+    if (!strcmp(argv[i], "+F"))
+      editor.follow = 1;
+    else if (!filename)
+      filename = argv[i];
+  }
+
+  // stdin is the file, so keys come from the terminal itself
+  if (filename && !strcmp(filename, "-")) {
+    editor.infd = open("/dev/tty", O_RDONLY);
+    if (editor.infd == -1) {
+      perror("/dev/tty");
+      return EXIT_FAILURE;
+    }
+  }
+
   enableRawMode();
   initEditor();
-  if (argc >= 2)
-    editorOpen(argv[1]);
+  if (filename)
+    editorOpen(filename);
+  editorCompressColdRows();
   
   while (1) {
-    editorRefreshScreen();
+    editorScheduleFrame();
+    long long start = monotonicNs();
+    int rows = editor.screenrows, cols = editor.screencols;
     getWindowSize(&editor.screenrows, &editor.screencols);
     editor.screenrows -= 1;
-    char ch = editorReadKey();
-    if (ch == ESC) {
-      abReinit(&editor.numberSequence);
-
-      editor.commandRow.buffer = NULL;
-      editor.commandRow.size = 0;
-      if (editor.mode == MODE_INSERT)
-        editorMoveCursorLeft();
-
-      editor.mode = MODE_NORMAL;
-    }
-    else {
-        switch (editor.mode) {
-          case MODE_NORMAL:
-            editorHandleNormalMode(ch);
-            break;
-          case MODE_INSERT:
-            editorHandleInsertMode(ch);
-            break;
-          case MODE_COMMAND:
-            editorHandleCommandMode(ch);
-            if (editor.commandRow.size == 0)
-              editor.mode = MODE_NORMAL;
-            break;
-        }
+    if (rows != editor.screenrows || cols != editor.screencols)
+      editorLayout();
+    editorPerfAdd(PERF_INPUT, start);
+
+    if (!editorWaitForKey()) {
+      editorKeyTimeout(monotonicNs());
+      editorCompressColdRows();
+      continue;
     }
+    int ch = editorReadKey();
+    // only count the time after the key arrived, not the time spent waiting
+    editorPerfAdd(PERF_INPUT, editor.keyArrived);
+    editorFeedByte((unsigned char)ch);
+    editorCompressColdRows();
   } 
   abFree(&editor.numberSequence);
-  free(editor.rows);
+  nimFree(ALLOC_ROWS, editor.rows);
   return EXIT_SUCCESS;
 }
 // }}}